@@ -1,36 +1,201 @@
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "LibDisk.h"
 
-typedef struct sector {
-  char data[SECTOR_SIZE];
-} sector_t;
+// used to see what happened w/ disk ops (each thread has its own)
+__thread int diskErrno;
 
-// used to see what happened w/ disk ops
-int diskErrno; 
+// everything about a disk; there's a default disk, and others can be
+// made with Disk_New(); each thread works on the disk it has chosen
+// with Disk_Use()
+struct _disk {
+  // the geometry of the disk: the size of a sector and the number of
+  // sectors; a new disk is created with the geometry of the last one
+  // unless Disk_SetGeometry() changes it, and an existing one has as
+  // many sectors as its file holds
+  int sector_size;
+  int total_sectors;
 
-// the disk in memory (static makes it private to the file)
-static sector_t* disk;
+  // the disk in memory
+  char* disk;
+
+  // the backing file of a mapped disk (see Disk_Open); -1 means the
+  // disk is a private copy in memory (see Disk_Init) and is persisted
+  // by writing the changed sectors into the file it came from
+  int disk_fd;
+
+  // the file the in-memory disk was last loaded from or saved to;
+  // this is where Disk_Sync() writes when the disk is not mapped
+  char disk_file[1024];
+
+  // one bit for each sector written since the last Disk_Sync(); the
+  // bits are set atomically, since sectors may be written from
+  // several threads at once
+  uint64_t* dirty;
+  int dirty_words;
+
+  // one bit for each sector kept back from Disk_Sync() (see Disk_Hold)
+  uint64_t* held;
+
+  // set if written sectors only reach the file through Disk_Sync(),
+  // which then doesn't return until they're on stable storage (see
+  // Disk_SetOrdered)
+  int ordered;
+};
+
+// the default disk (static makes it private to the file)
+static disk_t disk_default = { SECTOR_SIZE, TOTAL_SECTORS, NULL, -1, "", NULL, 0, NULL, 0 };
+
+// the disk the calling thread works on (in the initial-exec TLS model,
+// so that getting at it is a plain load on every disk call)
+static __thread disk_t* dk __attribute__((tls_model("initial-exec"))) = &disk_default;
 
 // used for statistics
 // static int lastSector = 0;
 // static int seekCount = 0;
 
+// the size of a complete disk image in bytes
+#define DISK_BYTES ((off_t)dk->total_sectors*dk->sector_size)
+
+// the address of a sector of the disk
+#define SECTOR(sector) (dk->disk+(size_t)(sector)*dk->sector_size)
+
+// dirty runs separated by no more than this many clean sectors are
+// written back together; rewriting a few clean sectors is cheaper
+// than another system call
+#define SYNC_MERGE_GAP 8
+
+// mark all sectors clean (0) or dirty (1)
+static void dirty_reset(int all)
+{
+  if (dk->dirty) memset(dk->dirty, all ? 0xff : 0, dk->dirty_words*sizeof(uint64_t));
+}
+
+// make room in the dirty bitmap for 'nsectors' sectors, all clean
+// (and none held); return 0 if successful, -1 otherwise
+static int dirty_alloc(int nsectors)
+{
+  uint64_t* words = (uint64_t*)calloc((nsectors+63)/64, sizeof(uint64_t));
+  uint64_t* held = (uint64_t*)calloc((nsectors+63)/64, sizeof(uint64_t));
+  if (words == NULL || held == NULL) {
+    free(words);
+    free(held);
+    return -1;
+  }
+  free(dk->dirty);
+  free(dk->held);
+  dk->dirty = words;
+  dk->held = held;
+  dk->dirty_words = (nsectors+63)/64;
+  return 0;
+}
+
+// the sectors of word 'i' of the dirty bitmap that the next sync writes
+static inline uint64_t dirty_word(int i)
+{
+  return dk->dirty[i] & ~dk->held[i];
+}
+
+// mark sectors [start, end) as written since the last sync
+static void dirty_mark(int start, int end)
+{
+  while (start < end) {
+    int bit = start%64, n = 64-bit;
+    if (n > end-start) n = end-start;
+    __atomic_fetch_or(&dk->dirty[start/64], (n == 64 ? ~(uint64_t)0 : (((uint64_t)1 << n)-1) << bit), __ATOMIC_RELAXED);
+    start += n;
+  }
+}
+
+// find the first run of dirty sectors at or after sector 'from';
+// return its first sector and store the sector after its end in
+// 'end', or return -1 if there are no dirty sectors left
+static int dirty_next_run(int from, int* end)
+{
+  int i = from/64, start;
+  uint64_t w;
+
+  if (from >= dk->total_sectors) return -1;
+
+  // skip clean words to the first dirty sector
+  w = dirty_word(i) & (~(uint64_t)0 << (from%64));
+  while (w == 0) {
+    if (++i >= dk->dirty_words) return -1;
+    w = dirty_word(i);
+  }
+  start = i*64 + __builtin_ctzll(w);
+  if (start >= dk->total_sectors) return -1;
+
+  // and then skip dirty words to the first clean sector
+  w = ~dirty_word(i) & (~(uint64_t)0 << (start%64));
+  while (w == 0) {
+    if (++i >= dk->dirty_words) break;
+    w = ~dirty_word(i);
+  }
+  *end = (i < dk->dirty_words) ? i*64 + __builtin_ctzll(w) : dk->total_sectors;
+  if (*end > dk->total_sectors) *end = dk->total_sectors;
+  return start;
+}
+
+// return whether any of sectors [start, end) is held
+static int held_any(int start, int end)
+{
+  for (int sector = start; sector < end; sector++)
+    if (dk->held[sector/64] & ((uint64_t)1 << (sector%64))) return 1;
+  return 0;
+}
+
+// write sectors [start, end) of the in-memory disk to the same place
+// in the file open as 'fd'; return 0 if successful, -1 otherwise
+static int write_run(int fd, int start, int end)
+{
+  char* buf = SECTOR(start);
+  size_t len = (size_t)(end-start)*dk->sector_size;
+  off_t off = (off_t)start*dk->sector_size;
+
+  while (len > 0) {
+    ssize_t n = pwrite(fd, buf, len, off);
+    if (n <= 0) return -1;
+    buf += n; len -= n; off += n;
+  }
+  return 0;
+}
+
+// flush sectors [start, end) of the mapped disk to its file; return 0
+// if successful, -1 otherwise
+static int msync_run(int start, int end)
+{
+  // msync() wants a page aligned start address
+  size_t pgmask = (size_t)sysconf(_SC_PAGESIZE)-1;
+  size_t lo = ((size_t)start*dk->sector_size) & ~pgmask;
+  size_t hi = (size_t)end*dk->sector_size;
+  return msync(dk->disk+lo, hi-lo, MS_SYNC);
+}
+
 /*
  * Disk_Init
  *
  * Initializes the disk area (really just some memory for now).
  *
- * THIS FUNCTION MUST BE CALLED BEFORE ANY OTHER FUNCTION IN HERE CAN BE USED!
+ * THIS FUNCTION (OR Disk_Open) MUST BE CALLED BEFORE ANY OTHER FUNCTION
+ * IN HERE CAN BE USED!
  *
  */
 int Disk_Init()
 {
+  // drop whatever disk we had before
+  Disk_Close();
+
   // create the disk image and fill every sector with zeroes
-  disk = (sector_t *) calloc(TOTAL_SECTORS, sizeof(sector_t));
-  if(disk == NULL) {
+  dk->disk = (char *) calloc(dk->total_sectors, dk->sector_size);
+  if(dk->disk == NULL || dirty_alloc(dk->total_sectors) < 0) {
+    Disk_Close();
     diskErrno = E_MEM_OP;
     return -1;
   }
@@ -48,10 +213,19 @@ int Disk_Save(char* file)
   FILE* diskFile;
     
   // error check
-  if (file == NULL) {
+  if (file == NULL || dk->disk == NULL) {
     diskErrno = E_INVALID_PARAM;
     return -1;
   }
+
+  // saving a mapped disk onto its own file is just a sync (and
+  // truncating the file under the mapping would be fatal)
+  if (dk->disk_fd >= 0) {
+    struct stat st, mst;
+    if (stat(file, &st) == 0 && fstat(dk->disk_fd, &mst) == 0 &&
+	st.st_dev == mst.st_dev && st.st_ino == mst.st_ino)
+      return Disk_Sync();
+  }
     
   // open the diskFile
   if ((diskFile = fopen(file, "w")) == NULL) {
@@ -60,14 +234,21 @@ int Disk_Save(char* file)
   }
     
   // actually write the disk image to a file
-  if ((fwrite(disk, sizeof(sector_t), TOTAL_SECTORS, diskFile)) != TOTAL_SECTORS) {
+  if ((fwrite(dk->disk, dk->sector_size, dk->total_sectors, diskFile)) != dk->total_sectors) {
     fclose(diskFile);
     diskErrno = E_WRITING_FILE;
     return -1;
   }
     
-  // clean up and return
+  // clean up and return; the in-memory disk now matches this file
   fclose(diskFile);
+  if (dk->disk_fd < 0) {
+    if (file != dk->disk_file) {
+      strncpy(dk->disk_file, file, sizeof(dk->disk_file));
+      dk->disk_file[sizeof(dk->disk_file)-1] = '\0';
+    }
+    dirty_reset(0);
+  }
   return 0;
 }
 
@@ -82,7 +263,7 @@ int Disk_Load(char* file)
   FILE* diskFile;
     
   // error check
-  if (file == NULL) {
+  if (file == NULL || dk->disk == NULL) {
     diskErrno = E_INVALID_PARAM;
     return -1;
   }
@@ -92,16 +273,45 @@ int Disk_Load(char* file)
     diskErrno = E_OPENING_FILE;
     return -1;
   }
+
+  // the file must hold a whole number of sectors; an in-memory disk
+  // takes on as many as there are, a mapped one must have as many
+  struct stat st;
+  if (fstat(fileno(diskFile), &st) < 0 || st.st_size == 0 || st.st_size%dk->sector_size ||
+      (dk->disk_fd >= 0 && st.st_size != DISK_BYTES)) {
+    fclose(diskFile);
+    diskErrno = E_FILE_SIZE;
+    return -1;
+  }
+  if (st.st_size != DISK_BYTES) {
+    int nsectors = st.st_size/dk->sector_size;
+    char* resized = (char*)realloc(dk->disk, st.st_size);
+    if (resized != NULL) dk->disk = resized;
+    if (resized == NULL || dirty_alloc(nsectors) < 0) {
+      fclose(diskFile);
+      diskErrno = E_MEM_OP;
+      return -1;
+    }
+    dk->total_sectors = nsectors;
+  }
     
   // actually read the disk image into memory
-  if ((fread(disk, sizeof(sector_t), TOTAL_SECTORS, diskFile)) != TOTAL_SECTORS) {
+  if ((fread(dk->disk, dk->sector_size, dk->total_sectors, diskFile)) != dk->total_sectors) {
     fclose(diskFile);
     diskErrno = E_READING_FILE;
     return -1;
   }
     
-  // clean up and return
+  // clean up and return; a mapped disk now differs from its file
+  // everywhere, an in-memory one is in sync with the file it came from
   fclose(diskFile);
+  if (dk->disk_fd >= 0) {
+    dirty_reset(1);
+  } else {
+    strncpy(dk->disk_file, file, sizeof(dk->disk_file));
+    dk->disk_file[sizeof(dk->disk_file)-1] = '\0';
+    dirty_reset(0);
+  }
   return 0;
 }
 
@@ -114,13 +324,13 @@ int Disk_Load(char* file)
 int Disk_Read(int sector, char* buffer)
 {
   // quick error checks
-  if ((sector < 0) || (sector >= TOTAL_SECTORS) || (buffer == NULL)) {
+  if ((dk->disk == NULL) || (sector < 0) || (sector >= dk->total_sectors) || (buffer == NULL)) {
     diskErrno = E_INVALID_PARAM;
     return -1;
   }
     
   // copy the memory for the user
-  if((memcpy((void*)buffer, (void*)(disk + sector), sizeof(sector_t))) == NULL) {
+  if((memcpy((void*)buffer, (void*)SECTOR(sector), dk->sector_size)) == NULL) {
     diskErrno = E_MEM_OP;
     return -1;
   }
@@ -136,15 +346,410 @@ int Disk_Read(int sector, char* buffer)
 int Disk_Write(int sector, char* buffer) 
 {
   // quick error checks
-  if((sector < 0) || (sector >= TOTAL_SECTORS) || (buffer == NULL)) {
+  if((dk->disk == NULL) || (sector < 0) || (sector >= dk->total_sectors) || (buffer == NULL)) {
     diskErrno = E_INVALID_PARAM;
     return -1;
   }
     
   // copy the memory for the user
-  if((memcpy((void*)(disk + sector), (void*)buffer, sizeof(sector_t))) == NULL) {
+  if((memcpy((void*)SECTOR(sector), (void*)buffer, dk->sector_size)) == NULL) {
     diskErrno = E_MEM_OP;
     return -1;
   }
+
+  // remember what needs to go back to the file on the next sync
+  dirty_mark(sector, sector+1);
+  return 0;
+}
+
+// check the sectors of a vectored transfer; return 0 if they are all
+// good, -1 otherwise
+static int check_iovec(disk_iovec_t* iov, int count)
+{
+  int i;
+  if ((dk->disk == NULL) || (iov == NULL && count > 0) || (count < 0))
+    return -1;
+  for (i = 0; i < count; i++) {
+    if ((iov[i].sector < 0) || (iov[i].sector >= dk->total_sectors) || (iov[i].buffer == NULL))
+      return -1;
+  }
+  return 0;
+}
+
+// return the number of entries starting at iov[i] that name
+// consecutive sectors held in consecutive memory, so they can be
+// moved with a single copy
+static int iovec_run(disk_iovec_t* iov, int i, int count)
+{
+  int n = 1;
+  while ((i+n < count) &&
+	 (iov[i+n].sector == iov[i].sector+n) &&
+	 (iov[i+n].buffer == iov[i].buffer+(size_t)n*dk->sector_size))
+    n++;
+  return n;
+}
+
+/*
+ * Disk_ReadV
+ *
+ * Reads a list of sectors, each into its own buffer. Entries naming
+ * consecutive sectors and buffers are copied in one go.
+ */
+int Disk_ReadV(disk_iovec_t* iov, int count)
+{
+  int i, n;
+
+  // quick error checks, all of them before anything is copied
+  if (check_iovec(iov, count) < 0) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+
+  for (i = 0; i < count; i += n) {
+    n = iovec_run(iov, i, count);
+    memcpy(iov[i].buffer, SECTOR(iov[i].sector), (size_t)n*dk->sector_size);
+  }
+  return 0;
+}
+
+/*
+ * Disk_WriteV
+ *
+ * Writes a list of sectors, each from its own buffer. Entries naming
+ * consecutive sectors and buffers are copied in one go.
+ */
+int Disk_WriteV(disk_iovec_t* iov, int count)
+{
+  int i, n;
+
+  // quick error checks, all of them before anything is copied
+  if (check_iovec(iov, count) < 0) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+
+  for (i = 0; i < count; i += n) {
+    n = iovec_run(iov, i, count);
+    memcpy(SECTOR(iov[i].sector), iov[i].buffer, (size_t)n*dk->sector_size);
+    dirty_mark(iov[i].sector, iov[i].sector+n);
+  }
+  return 0;
+}
+
+/*
+ * Disk_ReadRange
+ *
+ * Reads 'count' consecutive sectors into one contiguous buffer.
+ */
+int Disk_ReadRange(int sector, int count, char* buffer)
+{
+  // quick error checks
+  if ((dk->disk == NULL) || (sector < 0) || (count < 0) ||
+      (sector+count > dk->total_sectors) || (buffer == NULL)) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+
+  memcpy(buffer, SECTOR(sector), (size_t)count*dk->sector_size);
   return 0;
 }
+
+/*
+ * Disk_WriteRange
+ *
+ * Writes 'count' consecutive sectors from one contiguous buffer.
+ */
+int Disk_WriteRange(int sector, int count, char* buffer)
+{
+  // quick error checks
+  if ((dk->disk == NULL) || (sector < 0) || (count < 0) ||
+      (sector+count > dk->total_sectors) || (buffer == NULL)) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+
+  memcpy(SECTOR(sector), buffer, (size_t)count*dk->sector_size);
+  dirty_mark(sector, sector+count);
+  return 0;
+}
+
+/*
+ * Disk_Addr
+ *
+ * Returns where the sector is kept in memory, for reading it in place;
+ * consecutive sectors are consecutive in memory. The address is good
+ * until the disk is closed or re-initialized; the memory must not be
+ * written through it (writes wouldn't be marked dirty).
+ */
+const char* Disk_Addr(int sector)
+{
+  // quick error checks
+  if ((dk->disk == NULL) || (sector < 0) || (sector >= dk->total_sectors)) {
+    diskErrno = E_INVALID_PARAM;
+    return NULL;
+  }
+  return (const char*)SECTOR(sector);
+}
+
+/*
+ * Disk_Open
+ *
+ * Maps the disk image stored in a file directly into memory, so that
+ * Disk_Read() and Disk_Write() work on the file's pages and nothing is
+ * copied up front. If 'create' is set, a new zero-filled image is
+ * created (overwriting an existing file with the same name); otherwise
+ * the file must already hold a disk image, and the disk has as many
+ * sectors as there are in the file. If the
+ * file can't be mapped, diskErrno is E_MEM_OP and the caller may fall
+ * back to Disk_Init() and Disk_Load().
+ */
+int Disk_Open(char* file, int create)
+{
+  int fd, nsectors = dk->total_sectors;
+  struct stat st;
+  void* addr;
+
+  // error check
+  if (file == NULL) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+
+  // open the file, creating an empty image if asked to
+  if ((fd = open(file, create ? O_RDWR|O_CREAT|O_TRUNC : O_RDWR, 0644)) < 0) {
+    diskErrno = E_OPENING_FILE;
+    return -1;
+  }
+  if (create) {
+    if (ftruncate(fd, DISK_BYTES) < 0) {
+      close(fd);
+      diskErrno = E_WRITING_FILE;
+      return -1;
+    }
+  } else if (fstat(fd, &st) < 0 || st.st_size == 0 || st.st_size%dk->sector_size) {
+    close(fd);
+    diskErrno = E_FILE_SIZE;
+    return -1;
+  } else nsectors = st.st_size/dk->sector_size;
+
+  // map the whole image; pages are only read in as sectors are touched;
+  // an ordered disk is mapped privately, so that the pages written
+  // don't reach the file until Disk_Sync() writes them
+  addr = mmap(NULL, (size_t)nsectors*dk->sector_size, PROT_READ|PROT_WRITE,
+	      dk->ordered ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED) {
+    close(fd);
+    diskErrno = E_MEM_OP;
+    return -1;
+  }
+
+  // drop whatever disk we had before and switch to the mapped one
+  Disk_Close();
+  if (dirty_alloc(nsectors) < 0) {
+    munmap(addr, (size_t)nsectors*dk->sector_size);
+    close(fd);
+    diskErrno = E_MEM_OP;
+    return -1;
+  }
+  dk->disk = (char*) addr;
+  dk->total_sectors = nsectors;
+  dk->disk_fd = fd;
+  strncpy(dk->disk_file, file, sizeof(dk->disk_file));
+  dk->disk_file[sizeof(dk->disk_file)-1] = '\0';
+  dirty_reset(0);
+  return 0;
+}
+
+/*
+ * Disk_Sync
+ *
+ * Makes sure every sector written since the last sync reaches the file
+ * the disk came from, and nothing else. Runs of adjacent dirty sectors
+ * go out together: a mapped disk msync()s them, an in-memory disk (or
+ * an ordered one) pwrite()s them into the file it was loaded from (or
+ * last saved to), and an ordered disk fdatasync()s the file at the end.
+ * Held sectors (see Disk_Hold) are left out, and stay dirty.
+ */
+int Disk_Sync()
+{
+  int fd, start, end, nstart, nend, wrote = 0;
+
+  if (dk->disk == NULL) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+
+  if (dk->disk_fd >= 0) fd = dk->disk_fd;
+  else if (dk->disk_file[0] == '\0') {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  } else if ((fd = open(dk->disk_file, O_WRONLY)) < 0) {
+    diskErrno = E_OPENING_FILE;
+    return -1;
+  }
+
+  start = dirty_next_run(0, &end);
+  while (start >= 0) {
+    // stretch the run over short clean gaps (but not over held sectors)
+    while ((nstart = dirty_next_run(end, &nend)) >= 0 &&
+	   nstart-end <= SYNC_MERGE_GAP && !held_any(end, nstart))
+      end = nend;
+
+    if ((dk->disk_fd >= 0 && !dk->ordered ? msync_run(start, end) : write_run(fd, start, end)) < 0) {
+      if (dk->disk_fd < 0) close(fd);
+      diskErrno = E_WRITING_FILE;
+      return -1;
+    }
+    start = nstart; end = nend;
+    wrote = 1;
+  }
+  if (dk->ordered && wrote && fdatasync(fd) < 0) {
+    if (dk->disk_fd < 0) close(fd);
+    diskErrno = E_WRITING_FILE;
+    return -1;
+  }
+
+  if (dk->disk_fd < 0) close(fd);
+  for (int i = 0; i < dk->dirty_words; i++) dk->dirty[i] &= dk->held[i];
+  return 0;
+}
+
+/*
+ * Disk_Close
+ *
+ * Releases the disk, unmapping it if it was mapped by Disk_Open().
+ * Nothing is written back; call Disk_Sync() or Disk_Save() first.
+ */
+int Disk_Close()
+{
+  if (dk->disk != NULL) {
+    if (dk->disk_fd >= 0) {
+      munmap(dk->disk, DISK_BYTES);
+      close(dk->disk_fd);
+    } else free(dk->disk);
+  }
+  free(dk->dirty);
+  free(dk->held);
+  dk->disk = NULL;
+  dk->dirty = NULL;
+  dk->held = NULL;
+  dk->disk_fd = -1;
+  dk->disk_file[0] = '\0';
+  return 0;
+}
+
+/*
+ * Disk_SetGeometry
+ *
+ * Sets the size of a sector (a power of two, SECTOR_SIZE to
+ * MAX_SECTOR_SIZE bytes) and the number of sectors of the disks
+ * created from now on by Disk_Init() and Disk_Open(). Can only be
+ * called while there's no disk.
+ */
+int Disk_SetGeometry(int size, int count)
+{
+  // error check
+  if ((dk->disk != NULL) || (size < SECTOR_SIZE) || (size > MAX_SECTOR_SIZE) ||
+      (size & (size-1)) || (count <= 0)) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  dk->sector_size = size;
+  dk->total_sectors = count;
+  return 0;
+}
+
+/*
+ * Disk_SetOrdered
+ *
+ * Makes the disks opened from now on by Disk_Open() (or made by
+ * Disk_Init()) ordered if 'ordered' is set: sectors written only reach
+ * the file when Disk_Sync() writes them, and it returns once they're
+ * on stable storage. Together with Disk_Hold(), this lets the sectors
+ * reach the file in a chosen order (as a journal needs).
+ */
+void Disk_SetOrdered(int ordered)
+{
+  dk->ordered = ordered;
+}
+
+/*
+ * Disk_Hold, Disk_Release
+ *
+ * Keep a written sector from going to the file on the next syncs; it
+ * stays dirty, and goes with the first sync after Disk_Release(),
+ * which lets all the held sectors go.
+ */
+int Disk_Hold(int sector)
+{
+  if ((dk->disk == NULL) || (sector < 0) || (sector >= dk->total_sectors)) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+  }
+  __atomic_fetch_or(&dk->held[sector/64], (uint64_t)1 << (sector%64), __ATOMIC_RELAXED);
+  return 0;
+}
+
+void Disk_Release()
+{
+  if (dk->held) memset(dk->held, 0, dk->dirty_words*sizeof(uint64_t));
+}
+
+/*
+ * Disk_SectorSize, Disk_TotalSectors
+ *
+ * Return the geometry of the disk (or of the next one to be created
+ * if there's no disk).
+ */
+int Disk_SectorSize()
+{
+  return dk->sector_size;
+}
+
+int Disk_TotalSectors()
+{
+  return dk->total_sectors;
+}
+
+/*
+ * Disk_New, Disk_Free, Disk_Use
+ *
+ * Make a new disk (with no image yet, and the default geometry), and
+ * free one (closing it first). Disk_Use() makes the calling thread
+ * work on the given disk from then on (the default one if NULL); a
+ * disk should only be used by one thread at a time while it's being
+ * opened, closed, loaded, or synced.
+ */
+disk_t* Disk_New()
+{
+  disk_t* d = (disk_t*)malloc(sizeof(disk_t));
+  if (d == NULL) {
+    diskErrno = E_MEM_OP;
+    return NULL;
+  }
+  d->sector_size = SECTOR_SIZE;
+  d->total_sectors = TOTAL_SECTORS;
+  d->disk = NULL;
+  d->disk_fd = -1;
+  d->disk_file[0] = '\0';
+  d->dirty = NULL;
+  d->dirty_words = 0;
+  d->held = NULL;
+  d->ordered = 0;
+  return d;
+}
+
+void Disk_Free(disk_t* d)
+{
+  disk_t* old = dk;
+  if (d == NULL || d == &disk_default) return;
+  dk = d;
+  Disk_Close();
+  dk = (old == d) ? &disk_default : old;
+  free(d);
+}
+
+void Disk_Use(disk_t* d)
+{
+  dk = d ? d : &disk_default;
+}
@@ -13,9 +13,11 @@
 #ifndef __Disk_H__
 #define __Disk_H__
 
-// a few disk parameters
+// a few disk parameters: the default geometry, and the largest
+// sector size that can be asked for instead (see Disk_SetGeometry)
 #define SECTOR_SIZE 512
 #define TOTAL_SECTORS 10000 
+#define MAX_SECTOR_SIZE 4096
 
 // disk errors
 typedef enum {
@@ -24,9 +26,16 @@ typedef enum {
   E_OPENING_FILE,
   E_WRITING_FILE,
   E_READING_FILE,
+  E_FILE_SIZE,
 } Disk_Error_t;
 
-extern int diskErrno; // used to see what happened w/ disk ops
+extern __thread int diskErrno; // used to see what happened w/ disk ops
+
+// one sector of a vectored transfer (see Disk_ReadV and Disk_WriteV)
+typedef struct _disk_iovec {
+  int sector;   // the sector to read or write
+  char* buffer; // a sector's worth of memory to read into or write from
+} disk_iovec_t;
 
 int Disk_Init();
 int Disk_Save(char* file);
@@ -34,4 +43,44 @@ int Disk_Load(char* file);
 int Disk_Write(int sector, char* buffer);
 int Disk_Read(int sector, char* buffer);
 
+// move many sectors in one call: either a list of (sector, buffer)
+// pairs, or 'count' consecutive sectors starting at 'sector' to or from
+// one contiguous buffer; all sectors are checked before any is moved
+int Disk_ReadV(disk_iovec_t* iov, int count);
+int Disk_WriteV(disk_iovec_t* iov, int count);
+int Disk_ReadRange(int sector, int count, char* buffer);
+int Disk_WriteRange(int sector, int count, char* buffer);
+
+// read-only address of a sector in memory (NULL if there's an error)
+const char* Disk_Addr(int sector);
+
+// map the disk image straight from a file instead of keeping a copy
+// in memory; sectors are paged in only when touched and Disk_Sync()
+// writes back only the range that has been written
+int Disk_Open(char* file, int create);
+int Disk_Sync();
+int Disk_Close();
+
+// an ordered disk only writes sectors to its file on Disk_Sync(), and
+// syncs the file to stable storage; sectors held are left out of the
+// syncs until released, so that the file gets them in a chosen order
+void Disk_SetOrdered(int ordered);
+int Disk_Hold(int sector);
+void Disk_Release();
+
+// the size of a sector and the number of sectors of the disk; a new
+// disk gets the geometry set here, an existing one keeps its sector
+// size and has as many sectors as its file holds
+int Disk_SetGeometry(int sector_size, int total_sectors);
+int Disk_SectorSize();
+int Disk_TotalSectors();
+
+// a process can have several disks open at once: all the calls above
+// work on the disk the calling thread has chosen with Disk_Use(),
+// which is a default one unless it has chosen another
+typedef struct _disk disk_t;
+disk_t* Disk_New();
+void Disk_Free(disk_t* disk);
+void Disk_Use(disk_t* disk);
+
 #endif // __Disk_H__
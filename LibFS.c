@@ -1,10 +1,19 @@
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include "LibDisk.h"
 #include "LibFS.h"
+#include "fsd.h"
 
 // set to 1 to have detailed debug print-outs and 0 to have none
 #define FSDEBUG 0
@@ -16,15 +25,24 @@
 void noprintf(char* str, ...) {}
 #endif
 
-// the file system partitions the disk into five parts:
+// the file system partitions the disk into six parts:
 
 // 1. the superblock (one sector), which contains a magic number at
-// its first four bytes (integer)
+// its first four bytes (integer), followed by the geometry the disk
+// was formatted with
 #define SUPERBLOCK_START_SECTOR 0
 
 // the magic number chosen for our file system
 #define OS_MAGIC 0xdeadbeef
 
+typedef struct _superblock {
+  int magic;
+  int sector_size;   // the geometry; zero (on disks formatted before it
+  int total_sectors; // was recorded) means the default
+  int max_files;
+  int journal_sectors; // sectors of the journal (zero means none)
+} superblock_t;
+
 // 2. the inode bitmap (one or more sectors), which indicates whether
 // the particular entry in the inode table (#4) is currently in use
 #define INODE_BITMAP_START_SECTOR 1
@@ -32,8 +50,8 @@ void noprintf(char* str, ...) {}
 // the total number of bytes and sectors needed for the inode bitmap;
 // we use one bit for each inode (whether it's a file or directory) to
 // indicate whether the particular inode in the inode table is in use
-#define INODE_BITMAP_SIZE ((MAX_FILES+7)/8)
-#define INODE_BITMAP_SECTORS ((INODE_BITMAP_SIZE+SECTOR_SIZE-1)/SECTOR_SIZE)
+#define INODE_BITMAP_SIZE ((fs->geo.max_files+7)/8)
+#define INODE_BITMAP_SECTORS ((INODE_BITMAP_SIZE+fs->geo.sector_size-1)/fs->geo.sector_size)
 
 // 3. the sector bitmap (one or more sectors), which indicates whether
 // the particular sector in the disk is currently in use
@@ -42,8 +60,8 @@ void noprintf(char* str, ...) {}
 // the total number of bytes and sectors needed for the data block
 // bitmap (we call it the sector bitmap); we use one bit for each
 // sector of the disk to indicate whether the sector is in use or not
-#define SECTOR_BITMAP_SIZE ((TOTAL_SECTORS+7)/8)
-#define SECTOR_BITMAP_SECTORS ((SECTOR_BITMAP_SIZE+SECTOR_SIZE-1)/SECTOR_SIZE)
+#define SECTOR_BITMAP_SIZE ((fs->geo.total_sectors+7)/8)
+#define SECTOR_BITMAP_SECTORS ((SECTOR_BITMAP_SIZE+fs->geo.sector_size-1)/fs->geo.sector_size)
 
 // 4. the inode table (one or more sectors), which contains the inodes
 // stored consecutively
@@ -54,10 +72,21 @@ void noprintf(char* str, ...) {}
 // corresponding file or directory
 typedef struct _inode {
   int size; // the size of the file or number of directory entries
-  int type; // 0 means regular file; 1 means directory
+  int type; // 0 means regular file; 1 means directory (see INODE_HASHED)
   int data[MAX_SECTORS_PER_FILE]; // indices to sectors containing data blocks
 } inode_t;
 
+// a directory, or a file of no more than MAX_SECTORS_PER_FILE blocks,
+// has the sectors of all its data blocks in the inode; a bigger file
+// has the INODE_INDIRECT bit set in its inode type, and then only the
+// first NDIRECT of those are data blocks: the next one is an indirect
+// block, a sector full of the sectors of the data blocks that follow,
+// and the last one is a double-indirect block, full of the sectors of
+// more indirect blocks
+#define INODE_INDIRECT 0x200
+#define NDIRECT (MAX_SECTORS_PER_FILE-2)
+#define PTRS_PER_SECTOR (fs->geo.sector_size/(int)sizeof(int))
+
 // the inode structures are stored consecutively and yet they don't
 // straddle accross the sector boundaries; that is, there may be
 // fragmentation towards the end of each sector used by the inode
@@ -65,12 +94,57 @@ typedef struct _inode {
 // are as many entries in the table as the number of files allowed in
 // the system; the inode bitmap (#2) indicates whether the entries are
 // current in use or not
-#define INODES_PER_SECTOR (SECTOR_SIZE/sizeof(inode_t))
-#define INODE_TABLE_SECTORS ((MAX_FILES+INODES_PER_SECTOR-1)/INODES_PER_SECTOR)
-
-// 5. the data blocks; all the rest sectors are reserved for data
+#define INODES_PER_SECTOR (fs->geo.sector_size/sizeof(inode_t))
+#define INODE_TABLE_SECTORS ((fs->geo.max_files+INODES_PER_SECTOR-1)/INODES_PER_SECTOR)
+
+// 5. the journal (none on disks formatted before it was added), where
+// the metadata changed since the last sync is written first, so that a
+// crash while it's written back in place is recovered from on the next
+// boot (see journal_commit); its first sector is the journal header,
+// and the rest are slots of a circular log
+#define JOURNAL_START_SECTOR (INODE_TABLE_START_SECTOR+INODE_TABLE_SECTORS)
+#define JOURNAL_SLOTS (fs->geo.journal_sectors-1)
+#define JOURNAL_SLOT_SECTOR(slot) (JOURNAL_START_SECTOR+1+(slot))
+
+// the magic number of the journal header and of each log block
+#define JOURNAL_MAGIC 0x6a726e6c
+
+// the journal header says where the log starts; the transactions from
+// there on are replayed at boot
+typedef struct _journal_header {
+  int magic;
+  int seq;  // the number of the first transaction in the log
+  int tail; // and the slot it starts at
+} journal_header_t;
+
+// a transaction (the metadata written back by one sync) is logged as
+// one or more blocks in consecutive slots; a block is a descriptor
+// listing the sectors it holds copies of, followed by the copies; the
+// last block of the transaction is marked as its commit, and each block
+// has a checksum, so that a transaction is only replayed if all of it
+// made it to the disk
+typedef struct _journal_desc {
+  int magic;
+  int seq;       // the number of the transaction
+  int count;     // the number of copies following
+  int commit;    // 1 in the last block of the transaction
+  uint32_t sum;  // checksum of the descriptor (with this zero) and the copies
+  int sectors[]; // where the copies belong
+} journal_desc_t;
+
+// the number of copies a block can hold
+#define JOURNAL_PER_DESC ((fs->geo.sector_size-(int)sizeof(journal_desc_t))/(int)sizeof(int))
+
+// unless asked for another size, a journal takes about 1% of the disk
+// (but no less than 32 sectors, and no more than 1024); a sync that
+// changes more metadata than that is written through it in chunks
+#define JOURNAL_DEFAULT_SECTORS \
+  (fs->geo.total_sectors/100 < 32 ? 32 : fs->geo.total_sectors/100 > 1024 ? 1024 : \
+   fs->geo.total_sectors/100)
+
+// 6. the data blocks; all the rest sectors are reserved for data
 // blocks for the content of files and directories
-#define DATABLOCK_START_SECTOR (INODE_TABLE_START_SECTOR+INODE_TABLE_SECTORS)
+#define DATABLOCK_START_SECTOR (JOURNAL_START_SECTOR+fs->geo.journal_sectors)
 
 // other file related definitions
 
@@ -80,8 +154,10 @@ typedef struct _inode {
 // max length of a filename is 16 bytes (including the ending null)
 #define MAX_NAME 16
 
-// max number of open files is 256
+// the table of open files grows 256 entries at a time, to at most
+// 65536 open files
 #define MAX_OPEN_FILES 256
+#define MAX_OPEN_FILES_LIMIT 65536
 
 
 // each directory entry represents a file/directory in the parent
@@ -93,192 +169,808 @@ typedef struct _dirent {
 } dirent_t;
 
 // the number of directory entries that can be contained in a sector
-#define DIRENTS_PER_SECTOR (SECTOR_SIZE/sizeof(dirent_t))
+#define DIRENTS_PER_SECTOR (fs->geo.sector_size/sizeof(dirent_t))
+
+// the max number of entries in a directory
+#define MAX_DIRENTS (MAX_SECTORS_PER_FILE*DIRENTS_PER_SECTOR)
+
+// a small directory is a packed list of entries, appended to at the
+// end; once it has HASHED_DIR_THRESHOLD entries it's turned into a
+// hash table: each of its MAX_SECTORS_PER_FILE data blocks is a
+// bucket, and an entry goes into the bucket the hash of its name
+// picks, or else the first one after that which isn't full; such a
+// directory has the INODE_HASHED bit set in its inode type
+#define HASHED_DIR_THRESHOLD (2*DIRENTS_PER_SECTOR)
+#define INODE_HASHED 0x100
+#define INODE_TYPE(inode) ((inode)->type&~(INODE_HASHED|INODE_INDIRECT))
+
+// the header of a bucket, kept in the bytes of the sector left over
+// after the entries
+typedef struct _dir_bucket {
+  uint16_t count;    // number of entries in the bucket (packed at the front)
+  uint16_t overflow; // number of entries that hash here but are kept away
+} dir_bucket_t;
+
+#define DIR_BUCKET(data) ((dir_bucket_t*)((data)+DIRENTS_PER_SECTOR*sizeof(dirent_t)))
+
+// global errno value here (each thread has its own)
+__thread int osErrno;
+
+// the file system keeps a small write-back cache of disk sectors
+// between itself and the disk; buffers are found through a hash table
+// on the sector number and reclaimed with the CLOCK algorithm; a dirty
+// buffer only goes to the disk when it's reclaimed or on FS_Sync()
+#define CACHE_SECTORS 128
+
+// number of hash chains (a power of two) for looking up cached sectors
+#define CACHE_HASH_SIZE 256
+#define CACHE_HASH(sector) ((sector)&(CACHE_HASH_SIZE-1))
+
+// a cached copy of a disk sector
+typedef struct _cache_buf {
+  int sector; // the disk sector cached here (-1 means buffer not used)
+  int dirty;  // 1 if the buffer has changes not yet written to disk
+  int ref;    // 1 if used since the clock hand last went past
+  int pins;   // number of users currently holding the buffer
+  int next;   // next buffer on the same hash chain (-1 ends the chain)
+  char data[MAX_SECTOR_SIZE];
+} cache_buf_t;
+
+// an allocation bitmap is kept in memory, as 64-bit words, for as
+// long as the file system is booted; the words hold the bitmap sectors
+// byte for byte as they are on disk (bit i is the bit 0x80>>(i%8) of
+// byte i/8), so that changed sectors are written back unconverted
+typedef struct _bitmap {
+  int start;       // the first disk sector of the bitmap
+  int num;         // the number of disk sectors of the bitmap
+  int size;        // the number of bits in the bitmap
+  int nfree;       // the number of bits that are zero
+  int reserved;    // and of those, promised to buffered writes (see writebehind)
+  int hint;        // next-fit cursor: the word the next search starts at
+  uint64_t* words; // the bitmap itself, 'num' sectors worth
+  char* dirty;     // one flag for each sector changed since written back
+} bitmap_t;
+
+// path lookups go through a directory entry cache (dcache), which
+// remembers the inode found for a name in a parent directory, and
+// also that a name is not there (negative entry); entries are found
+// through a hash table on (parent, name) and reclaimed with the CLOCK
+// algorithm, the same as the sector cache; the entries of a directory
+// change only with the directory locked, but the dcache as a whole is
+// shared, so it's guarded by dcache_lock
+#define DCACHE_ENTRIES 1024
+
+// number of hash chains (a power of two) for looking up dcache entries
+#define DCACHE_HASH_SIZE 2048
+
+// a cached name lookup
+typedef struct _dcache_entry {
+  int parent; // the parent directory inode (-1 means entry not used)
+  int inode;  // the child inode found (-1 means no such child)
+  int ref;    // 1 if used since the clock hand last went past
+  int next;   // next entry on the same hash chain (-1 ends the chain)
+  char fname[MAX_NAME];
+} dcache_entry_t;
 
-// global errno value here
-int osErrno;
+// representing an open file
+typedef struct _open_file {
+  int inode; // pointing to the inode of the file (0 means entry not used)
+  int pos;   // read/write position
+  int next_free; // next unused entry on the free list (-1 ends the list)
+  int ra_next;    // where the next read starts if reading sequentially
+  int ra_sectors; // size of the next readahead (0 if not sequential)
+  int ra_start;   // file offset of the readahead window
+  int ra_len;     // and the number of bytes in it
+  unsigned ra_gen; // generation of the inode when the window was filled
+  char* ra_buf;   // the readahead window (NULL until needed)
+  int wb_start;   // file offset of the buffered writes
+  int wb_len;     // and the number of bytes buffered
+  char* wb_buf;   // the write-behind buffer (NULL until needed)
+  struct _open_file* wb_next; // next fd of the inode with buffered writes
+  int wb_reserved; // sectors reserved for the buffered writes to go to
+  pthread_mutex_t lock; // held by the call using the fd (the last field)
+} open_file_t;
 
-// the name of the disk backstore file (with which the file system is booted)
-static char bs_filename[1024];
+// a thread with transactions open on a file system
+typedef struct _txn {
+  pthread_t thread;
+  int depth;          // how many (they're nested)
+  struct _txn* next;  // the next thread with some open
+} txn_t;
+
+// the file system can be used from several threads at once; each
+// part of its state has its own lock:
+// - fs_lock is held shared by every call, and exclusively by those
+//   that boot or sync the whole file system
+// - each inode has a reader/writer lock (see inode_lock) guarding its
+//   inode, its data blocks, and the buffered writes of its fds
+// - each fd has a mutex for its position and readahead window, and
+//   fd_table_lock guards the table of open files
+// - alloc_lock guards the bitmaps, dcache_lock the dcache, and
+//   cache_lock the sector cache
+// - txn_lock guards the list of transactions open, and is taken on its
+//   own (never with another lock held)
+// a thread takes the rest in this order: fs_lock, the mutex of the fd,
+// inode locks (a directory before its entries), fd_table_lock,
+// alloc_lock, dcache_lock, and cache_lock last
+
+// everything about a booted file system is kept together, so that a
+// process can have several of them at once (see FS_Mount); the calls
+// work on the one the calling thread has chosen ('fs' below)
+struct _fs {
+  // the geometry of the disk: the size of a sector, the number of
+  // sectors, and the number of inodes; a disk is formatted with the
+  // defaults (SECTOR_SIZE, TOTAL_SECTORS and MAX_FILES) unless another
+  // geometry is asked for (see FS_Format), and the layout of the disk
+  // is worked out from the geometry it was booted with
+  fs_geometry_t geo;
+
+  // the name of the disk backstore file (with which the file system is booted)
+  char bs_filename[1024];
+
+  // the disk the file system is on (NULL for the default disk of LibDisk)
+  disk_t* disk;
+
+  // the connection to fsd if the file system is served by it (-1 if
+  // it's on a disk of our own), and the lock making one call at a time
+  int server;
+  pthread_mutex_t server_lock;
+
+  // the locks described above
+  pthread_rwlock_t fs_lock;
+  pthread_mutex_t fd_table_lock;
+  pthread_mutex_t alloc_lock;
+  pthread_mutex_t dcache_lock;
+  pthread_mutex_t cache_lock;
+
+  // the sector cache
+  cache_buf_t cache[CACHE_SECTORS];
+  int cache_hash[CACHE_HASH_SIZE]; // first buffer of each chain
+  int cache_hand; // the clock hand
+
+  // statistics reported by FS_Stats()
+  fs_stats_t stats;
+
+  // the inode bitmap and the sector bitmap
+  bitmap_t inode_bitmap, sector_bitmap;
+
+  // if the disk has a journal: one bit for each sector (of metadata)
+  // changed in the cache since the last sync (guarded by cache_lock),
+  // the slot the journal header on disk says the log starts at, the
+  // slot the next transaction goes to, and its number
+  uint64_t* meta;
+  int journal_tail, journal_head, journal_seq;
+
+  // one bit for each sector freed since the last sync, if the disk has
+  // a journal (guarded by alloc_lock); the metadata on the disk may
+  // still point at such a sector, so it's only given back to the sector
+  // bitmap once the sync has committed the metadata that doesn't (or
+  // before, if the disk fills up: then it's also flagged in 'reused',
+  // and whatever it's reused for waits for that commit instead)
+  uint64_t* freed;
+  uint64_t* reused;
+
+  // the threads with transactions open (see FS_TxnBegin)
+  txn_t* txns;
+  pthread_mutex_t txn_lock;
+
+  // the inode table (see inode_table_init) and its inode locks
+  inode_t* inodes; // one for each inode of the file system
+  char* inodes_dirty; // one flag for each inode table sector
+  pthread_rwlock_t* inode_locks;
+  int inode_locks_size; // number of locks set up
+
+  // the dcache
+  dcache_entry_t dcache[DCACHE_ENTRIES];
+  int dcache_hash[DCACHE_HASH_SIZE]; // first entry of each chain
+  int dcache_hand; // the clock hand
+
+  // the table of open files (see OPEN_FILE) and what goes with each inode
+  open_file_t* open_files[MAX_OPEN_FILES_LIMIT/MAX_OPEN_FILES];
+  int open_files_top;  // entries above this have never been used
+  int open_files_free; // first unused entry (-1 if none)
+
+  // number of file descriptors open on each inode (guarded by
+  // fd_table_lock), and the first of those with writes still in their
+  // write-behind buffers (guarded by the inode lock)
+  int* open_count;
+  open_file_t** writebehind_fds;
+
+  // the contents of an inode are changed this many times; a readahead
+  // window filled at an older generation is stale
+  unsigned* inode_gen;
+};
+
+// the file system booted by FS_Boot()
+static fs_t fs_default = {
+  .fs_lock = PTHREAD_RWLOCK_INITIALIZER,
+  .fd_table_lock = PTHREAD_MUTEX_INITIALIZER,
+  .alloc_lock = PTHREAD_MUTEX_INITIALIZER,
+  .dcache_lock = PTHREAD_MUTEX_INITIALIZER,
+  .cache_lock = PTHREAD_MUTEX_INITIALIZER,
+  .server = -1,
+  .server_lock = PTHREAD_MUTEX_INITIALIZER,
+  .txn_lock = PTHREAD_MUTEX_INITIALIZER,
+  .open_files_free = -1,
+};
+
+// the file system the calling thread works on (initial-exec, so that
+// getting at it is a plain load rather than a call into the loader;
+// the library is linked into programs, not dlopen()ed)
+static __thread fs_t* fs __attribute__((tls_model("initial-exec"))) = &fs_default;
+
+// empty the cache (any dirty buffers are dropped)
+static void cache_init()
+{
+  for(int i=0; i<CACHE_SECTORS; i++) {
+    fs->cache[i].sector = -1;
+    fs->cache[i].dirty = fs->cache[i].ref = fs->cache[i].pins = 0;
+    fs->cache[i].next = -1;
+  }
+  for(int i=0; i<CACHE_HASH_SIZE; i++) fs->cache_hash[i] = -1;
+  fs->cache_hand = 0;
+  memset(&fs->stats, 0, sizeof(fs->stats));
+}
 
-/* the following functions are internal helper functions */
+// the cache is guarded by cache_lock; the functions below up to
+// cache_get() are called with it held
 
-// check magic number in the superblock; return 1 if OK, and 0 if not
-static int check_magic()
+// return the buffer caching the given sector; -1 if it's not cached
+static int cache_lookup(int sector)
 {
-  char buf[SECTOR_SIZE];
-  if(Disk_Read(SUPERBLOCK_START_SECTOR, buf) < 0)
-    return 0;
-  if(*(int*)buf == OS_MAGIC) return 1;
-  else return 0;
+  int i = fs->cache_hash[CACHE_HASH(sector)];
+  while(i >= 0 && fs->cache[i].sector != sector) i = fs->cache[i].next;
+  return i;
 }
 
-// returns exponent of number
-int getExponent(int num, int exponent) {
-    int final = 1;
-	
-    while (1) {
-        if (exponent & 1) {
-            final *= num;
-		}
-        exponent >>= 1;
+// take the buffer off its hash chain and mark it unused
+static void cache_unhash(int i)
+{
+  int* link = &fs->cache_hash[CACHE_HASH(fs->cache[i].sector)];
+  while(*link != i) link = &fs->cache[*link].next;
+  *link = fs->cache[i].next;
+  fs->cache[i].sector = -1;
+  fs->cache[i].next = -1;
+}
 
-        if (!exponent) {
-            break;
-		}
-        num *= num;
+// write back a dirty buffer; return 0 if successful, -1 otherwise
+static int cache_writeback(int i)
+{
+  if(!fs->cache[i].dirty) return 0;
+  if(Disk_Write(fs->cache[i].sector, fs->cache[i].data) < 0) return -1;
+  fs->cache[i].dirty = 0;
+  fs->stats.cache_writebacks++;
+  return 0;
+}
+
+// find a buffer to reuse: sweep the clock hand over the buffers,
+// giving those used since the last sweep a second chance and skipping
+// those that are pinned; the chosen buffer is written back if dirty;
+// return its index, or -1 if every buffer is pinned or write-back fails
+static int cache_reclaim()
+{
+  for(int n=0; n<2*CACHE_SECTORS; n++) {
+    int i = fs->cache_hand;
+    fs->cache_hand = (fs->cache_hand+1)%CACHE_SECTORS;
+    if(fs->cache[i].pins > 0) continue;
+    if(fs->cache[i].sector < 0) return i;
+    if(fs->cache[i].ref) { fs->cache[i].ref = 0; continue; }
+    if(cache_writeback(i) < 0) return -1;
+    cache_unhash(i);
+    fs->stats.cache_evictions++;
+    return i;
+  }
+  dprintf("... error: all cache buffers are pinned\n");
+  return -1;
+}
+
+// get the buffer of the given sector, bringing the sector into the
+// cache if it's not there already (unless 'load' is 0, which means the
+// caller will overwrite the whole sector anyway); the buffer is pinned
+// and stays put until it's released with cache_put(); return NULL if
+// there's an error; the content of a buffer is guarded by whoever
+// owns the sector (the inode it belongs to), not by cache_lock
+static cache_buf_t* cache_get(int sector, int load)
+{
+  pthread_mutex_lock(&fs->cache_lock);
+  int i = cache_lookup(sector);
+  if(i >= 0) fs->stats.cache_hits++;
+  else {
+    fs->stats.cache_misses++;
+    if((i = cache_reclaim()) < 0 ||
+       (load && Disk_Read(sector, fs->cache[i].data) < 0)) {
+      pthread_mutex_unlock(&fs->cache_lock);
+      return NULL;
     }
+    fs->cache[i].sector = sector;
+    fs->cache[i].dirty = 0;
+    fs->cache[i].next = fs->cache_hash[CACHE_HASH(sector)];
+    fs->cache_hash[CACHE_HASH(sector)] = i;
+  }
+  fs->cache[i].ref = 1;
+  fs->cache[i].pins++;
+  pthread_mutex_unlock(&fs->cache_lock);
+  return &fs->cache[i];
+}
 
-    return final;
+// release a buffer obtained from cache_get(); 'dirty' says whether the
+// caller has changed its content
+static void cache_put(cache_buf_t* buf, int dirty)
+{
+  pthread_mutex_lock(&fs->cache_lock);
+  assert(buf->pins > 0);
+  buf->pins--;
+  if(dirty) {
+    buf->dirty = 1;
+    if(fs->meta) fs->meta[buf->sector/64] |= (uint64_t)1 << (buf->sector%64);
+  }
+  pthread_mutex_unlock(&fs->cache_lock);
 }
 
-// initalizes bitmap / assigns 1's and 0's
-static void bitsHandler(int currentBits, int sector) {
-	int fullSectors = currentBits / 8; 
-	int remainingBits = currentBits % 8; 
-	int currentBytes = fullSectors;
-	char buffer[SECTOR_SIZE];
-	int i;
+// copy a sector (through the cache) into the buffer; return 0 if
+// successful, -1 otherwise
+static int cache_read(int sector, char* buffer)
+{
+  cache_buf_t* buf = cache_get(sector, 1);
+  if(!buf) return -1;
+  memcpy(buffer, buf->data, fs->geo.sector_size);
+  cache_put(buf, 0);
+  return 0;
+}
 
-	if(remainingBits > 0) { 
-		currentBytes++;
-	}
-	
-	for(i = 0; i < fullSectors; i++) { 
-		buffer[i] = (unsigned char)255;
-	}
+// copy the buffer into a sector (in the cache; it reaches the disk
+// later); return 0 if successful, -1 otherwise
+static int cache_write(int sector, char* buffer)
+{
+  cache_buf_t* buf = cache_get(sector, 0);
+  if(!buf) return -1;
+  memcpy(buf->data, buffer, fs->geo.sector_size);
+  cache_put(buf, 1);
+  return 0;
+}
 
-	if(remainingBits > 0) { 
-		int count = 0;
+// the number of uncached sectors collected before a vectored cache
+// operation hands them to the disk in one call
+#define CACHE_BATCH 64
+
+// read a list of sectors: those in the cache are copied from there,
+// the rest are read from the disk in batches straight into the
+// caller's buffers; sectors read this way don't enter the cache, so
+// that streaming file data doesn't push metadata out of it (and the
+// disk is read without holding cache_lock); return 0 if successful, -1
+// otherwise
+static int cache_readv(disk_iovec_t* iov, int count)
+{
+  disk_iovec_t miss[CACHE_BATCH];
+  int nmiss = 0;
+  pthread_mutex_lock(&fs->cache_lock);
+  for(int i=0; i<count; i++) {
+    int c = cache_lookup(iov[i].sector);
+    if(c >= 0) {
+      fs->stats.cache_hits++;
+      fs->cache[c].ref = 1;
+      memcpy(iov[i].buffer, fs->cache[c].data, fs->geo.sector_size);
+      continue;
+    }
+    fs->stats.cache_misses++;
+    miss[nmiss++] = iov[i];
+    if(nmiss == CACHE_BATCH) {
+      pthread_mutex_unlock(&fs->cache_lock);
+      if(Disk_ReadV(miss, nmiss) < 0) return -1;
+      nmiss = 0;
+      pthread_mutex_lock(&fs->cache_lock);
+    }
+  }
+  pthread_mutex_unlock(&fs->cache_lock);
+  return (nmiss > 0) ? Disk_ReadV(miss, nmiss) : 0;
+}
 
-		for(i = 7; i > (7 - remainingBits); i--) {
-			count += getExponent(2,i);
-		}
+// write a list of sectors: those in the cache are updated there (and
+// reach the disk later), the rest are written to the disk in batches
+// straight from the caller's buffers; return 0 if successful, -1
+// otherwise
+static int cache_writev(disk_iovec_t* iov, int count)
+{
+  disk_iovec_t miss[CACHE_BATCH];
+  int nmiss = 0;
+  pthread_mutex_lock(&fs->cache_lock);
+  for(int i=0; i<count; i++) {
+    int c = cache_lookup(iov[i].sector);
+    if(c >= 0) {
+      fs->cache[c].ref = 1;
+      fs->cache[c].dirty = 1;
+      memcpy(fs->cache[c].data, iov[i].buffer, fs->geo.sector_size);
+      continue;
+    }
+    miss[nmiss++] = iov[i];
+    if(nmiss == CACHE_BATCH) {
+      pthread_mutex_unlock(&fs->cache_lock);
+      if(Disk_WriteV(miss, nmiss) < 0) return -1;
+      nmiss = 0;
+      pthread_mutex_lock(&fs->cache_lock);
+    }
+  }
+  pthread_mutex_unlock(&fs->cache_lock);
+  return (nmiss > 0) ? Disk_WriteV(miss, nmiss) : 0;
+}
 
-		buffer[currentBytes - 1] = (unsigned char)count;
-	}
+// drop a sector from the cache without writing it back; used when the
+// sector has been freed and its content no longer matters
+static void cache_forget(int sector)
+{
+  pthread_mutex_lock(&fs->cache_lock);
+  int i = cache_lookup(sector);
+  if(i >= 0 && fs->cache[i].pins == 0) {
+    fs->cache[i].dirty = 0;
+    cache_unhash(i);
+  }
+  pthread_mutex_unlock(&fs->cache_lock);
+}
 
-	for(i = currentBytes; i < SECTOR_SIZE; i++) { 
-		buffer[i] = 0;
-	}
+// write back the sector if it's cached and dirty, so that the disk
+// has its latest content; return 0 if successful, -1 otherwise
+static int cache_clean(int sector)
+{
+  pthread_mutex_lock(&fs->cache_lock);
+  int i = cache_lookup(sector);
+  int status = (i >= 0) ? cache_writeback(i) : 0;
+  pthread_mutex_unlock(&fs->cache_lock);
+  return status;
+}
 
-	Disk_Write(sector, buffer); // write to sector
+// write back all dirty buffers; return 0 if successful, -1 otherwise
+static int cache_flush()
+{
+  int status = 0;
+  pthread_mutex_lock(&fs->cache_lock);
+  for(int i=0; i<CACHE_SECTORS && status == 0; i++) {
+    if(fs->cache[i].sector >= 0 && cache_writeback(i) < 0) status = -1;
+  }
+  pthread_mutex_unlock(&fs->cache_lock);
+  return status;
 }
 
-// initialize a bitmap with 'num' sectors starting from 'start'
-// sector; all bits should be set to zero except that the first
-// 'nbits' number of bits are set to one
-static void bitmap_init(int start, int num, int nbits) { //Made by: Ricardo Casilimas
+/* the following functions are internal helper functions */
 
-	int maxBits = SECTOR_SIZE * 8; 
-	int currentBits = nbits;
-	int i;
+// read the superblock straight from the disk (nothing's cached before
+// the geometry is known) and check its magic number; return 1 if OK,
+// and 0 if not
+static int check_magic(superblock_t* sb)
+{
+  char buf[MAX_SECTOR_SIZE];
+  if(Disk_Read(SUPERBLOCK_START_SECTOR, buf) < 0)
+    return 0;
+  memcpy(sb, buf, sizeof(superblock_t));
+  if(sb->magic == OS_MAGIC) return 1;
+  else return 0;
+}
+
+// switch to the given geometry (where zero means the default, and a
+// journal of -1 sectors means none) and check that a file system can be
+// laid out with it: sector and inode numbers have to fit the bitmaps,
+// there has to be room for at least one data block, and a hashed
+// directory's bucket header has to fit after the entries; return 0 if
+// successful, -1 otherwise
+static int geometry_set(fs_geometry_t* g)
+{
+  fs->geo.sector_size = g->sector_size ? g->sector_size : SECTOR_SIZE;
+  fs->geo.total_sectors = g->total_sectors ? g->total_sectors : TOTAL_SECTORS;
+  fs->geo.max_files = g->max_files ? g->max_files : MAX_FILES;
+
+  // the number of blocks a file can have through its indirect blocks,
+  // as long as its size fits in an int
+  long long nblocks = NDIRECT+PTRS_PER_SECTOR+(long long)PTRS_PER_SECTOR*PTRS_PER_SECTOR;
+  if(nblocks > INT_MAX/fs->geo.sector_size) nblocks = INT_MAX/fs->geo.sector_size;
+  fs->geo.max_file_size = (int)nblocks*fs->geo.sector_size;
+
+  if(fs->geo.sector_size < SECTOR_SIZE || fs->geo.sector_size > MAX_SECTOR_SIZE ||
+     (fs->geo.sector_size & (fs->geo.sector_size-1)))
+    return -1;
+  if(fs->geo.total_sectors < 0 || fs->geo.total_sectors > INT_MAX-64 ||
+     fs->geo.max_files < 0 || fs->geo.max_files > INT_MAX-64)
+    return -1;
 
-	for(i = start; i < (start + num); i++) { //Loop through all sectors
+  // a journal has its header and room for a block with one copy
+  fs->geo.journal_sectors = g->journal_sectors ? g->journal_sectors : JOURNAL_DEFAULT_SECTORS;
+  if(fs->geo.journal_sectors == -1) fs->geo.journal_sectors = 0;
+  if(fs->geo.journal_sectors < 0 || fs->geo.journal_sectors == 1 || fs->geo.journal_sectors == 2 ||
+     fs->geo.journal_sectors > fs->geo.total_sectors)
+    return -1;
 
-		if(currentBits > maxBits) {
-			bitsHandler(maxBits, i); 
-			currentBits -= maxBits;
-		} else {
-			bitsHandler(currentBits, i); 
-			currentBits = 0; 
-		}
+  if(DATABLOCK_START_SECTOR >= fs->geo.total_sectors) return -1;
+  if(DIRENTS_PER_SECTOR*sizeof(dirent_t)+sizeof(dir_bucket_t) > fs->geo.sector_size) return -1;
+  return 0;
+}
 
-	}	
+// return word 'w' of the bitmap with its bits in bitmap order, so that
+// bit i of the word is bit 63-i of the value
+static inline uint64_t bitmap_word(bitmap_t* bm, int w)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  return __builtin_bswap64(bm->words[w]);
+#else
+  return bm->words[w];
+#endif
 }
 
-// set the first unused bit from a bitmap of 'nbits' bits (flip the
-// first zero appeared in the bitmap to one) and return its location;
-// return -1 if the bitmap is already full (no more zeros)
-static int bitmap_first_unused(int start, int num, int nbits) { //Made by: Ricardo Casilimas
+// return the mask of the bits of word 'w' that lie within the bitmap
+static inline uint64_t bitmap_valid(bitmap_t* bm, int w)
+{
+  int rem = bm->size-w*64;
+  return (rem >= 64) ? ~(uint64_t)0 : ~(~(uint64_t)0 >> rem);
+}
 
-	int totalBits = nbits *= 8; 
-	char buffer[SECTOR_SIZE];
-	int currentSectors = 0; 
-	int maxBits = SECTOR_SIZE * 8; 
-    int maxBytes = SECTOR_SIZE; 
-	int i, j;
+// set up bitmap 'bm' with 'size' bits, stored in 'num' sectors starting
+// from 'start' sector; return 0 if successful, -1 otherwise
+static int bitmap_attach(bitmap_t* bm, int start, int num, int size)
+{
+  free(bm->words);
+  free(bm->dirty);
+  bm->start = start;
+  bm->num = num;
+  bm->size = size;
+  bm->hint = 0;
+  bm->reserved = 0;
+  bm->words = (uint64_t*)calloc(num, fs->geo.sector_size);
+  bm->dirty = (char*)calloc(num, 1);
+  if(!bm->words || !bm->dirty) return -1;
+  return 0;
+}
 
-	for(i = start; i < (start + num); i++) { //Loops through each sector
-		
+// count the zero bits of the bitmap
+static void bitmap_count(bitmap_t* bm)
+{
+  int used = 0;
+  for(int w=0; w*64<bm->size; w++)
+    used += __builtin_popcountll(bitmap_word(bm, w) & bitmap_valid(bm, w));
+  bm->nfree = bm->size-used;
+}
 
-		Disk_Read(start, buffer); //Reads fromn the disk onto the buffer
-		
-		if(totalBits > maxBits)  {
-			totalBits = maxBits;
-		}
-		if((maxBytes % 8) > 0) { //bits left to be stored
-			maxBytes++;
-		}
+// initialize a bitmap of 'size' bits with 'num' sectors starting from
+// 'start' sector; all bits should be set to zero except that the first
+// 'nbits' number of bits are set to one
+static int bitmap_init(bitmap_t* bm, int start, int num, int size, int nbits) { //Made by: Ricardo Casilimas
 
-		for(j = 0; j < maxBytes; j++) {  //Loop through all bites in the sector
-			char tempBuffer = buffer[j]; 
+  if(bitmap_attach(bm, start, num, size) < 0) return -1;
 
-			if(tempBuffer != (char)255) { 
-				unsigned char tempBuffer2 = ~tempBuffer; 
+  unsigned char* bytes = (unsigned char*)bm->words;
+  memset(bytes, 0xff, nbits/8);
+  if(nbits%8) bytes[nbits/8] = (unsigned char)(0xff00 >> (nbits%8));
 
-				int bitLocation = 0; 
-				int byteSize = 8; 
+  memset(bm->dirty, 1, num);
+  bm->nfree = size-nbits;
+  bm->hint = nbits/64;
+  return 0;
+}
 
-				if(j == (maxBytes - 1)) {
-					byteSize = maxBits - totalBits;
-				}
+// load a bitmap of 'size' bits with 'num' sectors starting from 'start'
+// sector from disk; return 0 if successful, -1 otherwise
+static int bitmap_load(bitmap_t* bm, int start, int num, int size)
+{
+  if(bitmap_attach(bm, start, num, size) < 0) return -1;
+  for(int i=0; i<num; i++) {
+    if(cache_read(start+i, (char*)bm->words+i*fs->geo.sector_size) < 0) return -1;
+  }
+  bitmap_count(bm);
+  return 0;
+}
 
-				while(tempBuffer2 != 0) { 
-					if(--byteSize < 0) {
-						return -1; 
-					}
-					bitLocation++; 
-					tempBuffer2 = tempBuffer2>>1; 
-				}
+// write the changed sectors of the bitmap back to disk; return 0 if
+// successful, -1 otherwise
+static int bitmap_flush(bitmap_t* bm)
+{
+  for(int i=0; i<bm->num; i++) {
+    if(!bm->dirty[i]) continue;
+    if(cache_write(bm->start+i, (char*)bm->words+i*fs->geo.sector_size) < 0) return -1;
+    bm->dirty[i] = 0;
+  }
+  return 0;
+}
 
-				if(bitLocation == 0) 
-					bitLocation = 7;
+// the bitmaps are loaded, initialized, and written back only with
+// the whole file system locked; the bits are set and reset under
+// alloc_lock
 
-				byteSize = getExponent(2, bitLocation - 1); 
-				buffer[j] = buffer[j] | byteSize;
- 
-				Disk_Write(i, buffer); //Writes back to the disk
+// give the sectors freed since the last sync back to the sector bitmap;
+// if 'early' is set, it's before the sync, and they're flagged as reused
+// (see struct _fs); return the number of sectors
+static int bitmap_release_freed(int early)
+{
+  bitmap_t* bm = &fs->sector_bitmap;
+  int n = 0;
+  for(int w=0; w<(fs->geo.total_sectors+63)/64; w++) {
+    for(uint64_t bits=fs->freed[w]; bits; bits&=bits-1, n++) {
+      int ibit = w*64+__builtin_ctzll(bits);
+      ((unsigned char*)bm->words)[ibit/8] &= ~(0x80>>(ibit%8));
+      bm->dirty[ibit/(fs->geo.sector_size*8)] = 1;
+      bm->nfree++;
+    }
+    if(early) fs->reused[w] |= fs->freed[w];
+    fs->freed[w] = 0;
+  }
+  return n;
+}
 
-				return ((currentSectors * SECTOR_SIZE * 8) + (j * 8) + (8 - bitLocation)); 
-			}
-		}
-		currentSectors++;
-	}
-	return -1; 
+// make the sectors freed since the last sync available to a bitmap
+// that has run out; return 1 if there are any, 0 if not
+static int bitmap_reclaim(bitmap_t* bm)
+{
+  if(bm != &fs->sector_bitmap || !fs->freed) return 0;
+  return bitmap_release_freed(1) > 0;
 }
 
-// reset the i-th bit of a bitmap with 'num' sectors starting from
-// 'start' sector; return 0 if successful, -1 otherwise
-static int bitmap_reset(int start, int num, int ibit) { //Made by: Ricardo Casilimas
+// the sectors reserved for the buffered writes the calling thread is
+// writing out (see writebehind_flush) that it hasn't allocated yet
+static __thread int wb_allowance;
 
-	int maxBits = SECTOR_SIZE * 8; 
-	int tempBits = ibit - 1; 
-	int bitLocation = tempBits % maxBits; 
-	int sectorLocation = (tempBits / maxBits) + start; 
+// the number of zero bits of the bitmap the calling thread may set:
+// those reserved for buffered writes are left alone, except by the
+// writes they're reserved for
+static int bitmap_avail(bitmap_t* bm)
+{
+  if(bm != &fs->sector_bitmap) return bm->nfree;
+  return bm->nfree-bm->reserved+wb_allowance;
+}
 
-	if(ibit > maxBits) { //Return -1 if not successful
-		return -1; 
-	}
+// 'n' bits of the bitmap have been set
+static void bitmap_used(bitmap_t* bm, int n)
+{
+  bm->nfree -= n;
+  if(bm == &fs->sector_bitmap && wb_allowance > 0) {
+    int r = (n < wb_allowance) ? n : wb_allowance;
+    bm->reserved -= r;
+    wb_allowance -= r;
+  }
+}
 
-	if(bitLocation == 0) { //Resets the ith bit
-		sectorLocation -= 1; 
-		bitLocation = maxBits; 
-	}
+// set bit 'ibit' of the bitmap (which must be zero)
+static void bitmap_set(bitmap_t* bm, int ibit)
+{
+  ((unsigned char*)bm->words)[ibit/8] |= 0x80>>(ibit%8);
+  bm->dirty[ibit/(fs->geo.sector_size*8)] = 1;
+  bitmap_used(bm, 1);
+}
+
+// set the first unused bit from the bitmap (flip the first zero
+// appeared in the bitmap to one) and return its location; return -1
+// if the bitmap is already full (no more zeros); the search goes a
+// word at a time and starts where the last one left off (next fit),
+// so it doesn't slow down as the bitmap fills from the front
+static int bitmap_first_unused(bitmap_t* bm) { //Made by: Ricardo Casilimas
+
+  int nwords = (bm->size+63)/64, ibit = -1;
+  pthread_mutex_lock(&fs->alloc_lock);
+  if(bitmap_avail(bm) <= 0) bitmap_reclaim(bm);
+  for(int n=0; bitmap_avail(bm) > 0 && n<nwords; n++) {
+    int w = (bm->hint+n)%nwords;
+    uint64_t avail = ~bitmap_word(bm, w) & bitmap_valid(bm, w);
+    if(avail) {
+      ibit = w*64+__builtin_clzll(avail);
+      bitmap_set(bm, ibit);
+      bm->hint = w;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&fs->alloc_lock);
+  return ibit;
+}
+
+// return the first bit at or after bit 'ibit' that is one (if 'val'
+// is 1) or zero (if 'val' is 0); return the size of the bitmap if
+// there's no such bit
+static int bitmap_next(bitmap_t* bm, int ibit, int val)
+{
+  while(ibit < bm->size) {
+    int w = ibit/64;
+    uint64_t v = val ? bitmap_word(bm, w) : ~bitmap_word(bm, w);
+    v &= ~(uint64_t)0 >> (ibit%64); // ignore the bits before 'ibit'
+    if(v) {
+      ibit = w*64+__builtin_clzll(v);
+      return (ibit < bm->size) ? ibit : bm->size;
+    }
+    ibit = (w+1)*64;
+  }
+  return bm->size;
+}
+
+// set 'n' bits of the bitmap starting from bit 'ibit' (which must all
+// be zero)
+static void bitmap_set_run(bitmap_t* bm, int ibit, int n)
+{
+  unsigned char* bytes = (unsigned char*)bm->words;
+  for(int i=ibit; i<ibit+n; ) {
+    if(i%8 == 0 && i+8 <= ibit+n) {
+      int nbytes = (ibit+n-i)/8;
+      memset(bytes+i/8, 0xff, nbytes);
+      i += nbytes*8;
+    } else {
+      bytes[i/8] |= 0x80>>(i%8);
+      i++;
+    }
+  }
+  for(int sec=ibit/(fs->geo.sector_size*8); sec<=(ibit+n-1)/(fs->geo.sector_size*8); sec++)
+    bm->dirty[sec] = 1;
+  bitmap_used(bm, n);
+}
+
+// allocate a run of up to 'want' consecutive zero bits, preferably
+// starting at bit 'goal' (say, right after the sectors a file already
+// has; -1 for no preference), otherwise the first run long enough
+// going from the next-fit cursor; if no run is long enough, the
+// longest run there is gets allocated instead and the caller needs to
+// come back for the rest; return the first bit of the run and its
+// length through 'got', or -1 if the bitmap is full
+static int bitmap_alloc_run(bitmap_t* bm, int goal, int want, int* got)
+{
+  if(want <= 0) return -1;
+  pthread_mutex_lock(&fs->alloc_lock);
+  if(bitmap_avail(bm) <= 0 && !bitmap_reclaim(bm)) {
+    pthread_mutex_unlock(&fs->alloc_lock);
+    return -1;
+  }
+  if(want > bitmap_avail(bm)) want = bitmap_avail(bm);
+
+  // extend from the goal if we can
+  if(goal >= 0 && goal < bm->size && bitmap_next(bm, goal, 0) == goal) {
+    int end = bitmap_next(bm, goal, 1);
+    *got = (end-goal < want) ? end-goal : want;
+    bitmap_set_run(bm, goal, *got);
+    pthread_mutex_unlock(&fs->alloc_lock);
+    return goal;
+  }
+
+  // look for the first run long enough, from the cursor to the end and
+  // then from the start up to the cursor, remembering the longest one
+  int best = -1, bestlen = 0;
+  int from = bm->hint*64;
+  for(int pass=0; pass<2; pass++) {
+    int lo = pass ? 0 : from, hi = pass ? from : bm->size;
+    int ibit = bitmap_next(bm, lo, 0);
+    while(ibit < hi) {
+      int end = bitmap_next(bm, ibit, 1);
+      if(end-ibit >= want) {
+	best = ibit; bestlen = want;
+	pass = 2; // found it
+	break;
+      }
+      if(end-ibit > bestlen) { best = ibit; bestlen = end-ibit; }
+      ibit = bitmap_next(bm, end, 0);
+    }
+  }
+  if(best >= 0) {
+    bitmap_set_run(bm, best, bestlen);
+    bm->hint = (best+bestlen)/64;
+    *got = bestlen;
+  }
+  pthread_mutex_unlock(&fs->alloc_lock);
+  return best;
+}
 
-	char buffer[SECTOR_SIZE]; //buffer
-	Disk_Read(sectorLocation, buffer);
+// reset the i-th bit of the bitmap; return 0 if successful, -1
+// otherwise
+static int bitmap_reset(bitmap_t* bm, int ibit) { //Made by: Ricardo Casilimas
 
-	int byteLocation = bitLocation / 8; 
-	int currentBit = bitLocation % 8; 
+  if(ibit < 0 || ibit >= bm->size) return -1;
 
-	int tempBuffer = buffer[byteLocation];	
-	int tempBuffer2 = 255 - getExponent(2, 7 - currentBit); 
+  unsigned char* byte = (unsigned char*)bm->words+ibit/8;
+  unsigned char mask = 0x80>>(ibit%8);
+  pthread_mutex_lock(&fs->alloc_lock);
+  if(!(*byte & mask)) { // not in use
+    pthread_mutex_unlock(&fs->alloc_lock);
+    return -1;
+  }
 
-	buffer[byteLocation] = tempBuffer & tempBuffer2;
-	Disk_Write(sectorLocation, buffer); 
+  if(bm == &fs->sector_bitmap && fs->freed) { // freed at the next sync
+    fs->freed[ibit/64] |= (uint64_t)1 << (ibit%64);
+    pthread_mutex_unlock(&fs->alloc_lock);
+    return 0;
+  }
 
-  	return 0; 
+  *byte &= ~mask;
+  bm->dirty[ibit/(fs->geo.sector_size*8)] = 1;
+  bm->nfree++;
+  pthread_mutex_unlock(&fs->alloc_lock);
+  return 0;
 }
 
 // return 1 if the file name is illegal; otherwise, return 0; legal
@@ -305,488 +997,2234 @@ static int illegal_filename(char* name) { //Made by: George Barroso
 	return 0; 
 }
 
-// return the child inode of the given file name 'fname' from the
-// parent inode; the parent inode is currently stored in the segment
-// of inode table in the cache (we cache only one disk sector for
-// this); once found, both cached_inode_sector and cached_inode_buffer
-// may be updated to point to the segment of inode table containing
-// the child inode; the function returns -1 if no such file is found;
-// it returns -2 is something else is wrong (such as parent is not
-// directory, or there's read error, etc.)
-static int find_child_inode(int parent_inode, char* fname, int *cached_inode_sector, char* cached_inode_buffer) {
+// the whole inode table is kept in memory (pinned) for as long as the
+// file system is booted, so that getting at an inode is just indexing
+// an array; the sectors of the table whose inodes have changed are
+// flagged and written back on FS_Sync()
 
-  int cached_start_entry = ((*cached_inode_sector)-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
-  int offset = parent_inode-cached_start_entry;
-  assert(0 <= offset && offset < INODES_PER_SECTOR);
-  inode_t* parent = (inode_t*)(cached_inode_buffer+offset*sizeof(inode_t));
-  dprintf("... load parent inode: %d (size=%d, type=%d)\n",
-	 parent_inode, parent->size, parent->type);
-  if(parent->type != 1) {
-    dprintf("... parent not a directory\n");
-    return -2;
+// set up an inode table with only the root directory in it (all
+// sectors flagged to be written); return 0 if successful, -1 otherwise
+static int inode_table_init()
+{
+  free(fs->inodes);
+  free(fs->inodes_dirty);
+  fs->inodes = (inode_t*)calloc(fs->geo.max_files, sizeof(inode_t));
+  fs->inodes_dirty = (char*)malloc(INODE_TABLE_SECTORS);
+  if(!fs->inodes || !fs->inodes_dirty) return -1;
+  memset(fs->inodes_dirty, 1, INODE_TABLE_SECTORS);
+
+  // the first inode table entry is the root directory
+  fs->inodes[0].size = 0;
+  fs->inodes[0].type = 1;
+  return 0;
+}
+
+// load the whole inode table from disk; return 0 if successful, -1
+// otherwise
+static int inode_table_load()
+{
+  free(fs->inodes);
+  free(fs->inodes_dirty);
+  fs->inodes = (inode_t*)malloc(fs->geo.max_files*sizeof(inode_t));
+  fs->inodes_dirty = (char*)calloc(INODE_TABLE_SECTORS, 1);
+  if(!fs->inodes || !fs->inodes_dirty) return -1;
+
+  char buf[MAX_SECTOR_SIZE];
+  for(int i=0; i<INODE_TABLE_SECTORS; i++) {
+    int n = fs->geo.max_files-i*INODES_PER_SECTOR; // inodes in this sector
+    if(n > INODES_PER_SECTOR) n = INODES_PER_SECTOR;
+    if(cache_read(INODE_TABLE_START_SECTOR+i, buf) < 0) return -1;
+    memcpy(&fs->inodes[i*INODES_PER_SECTOR], buf, n*sizeof(inode_t));
   }
+  return 0;
+}
 
-  int nentries = parent->size; // remaining number of directory entries 
-  int idx = 0;
-  while(nentries > 0) {
-    char buf[SECTOR_SIZE]; // cached content of directory entries
-    if(Disk_Read(parent->data[idx], buf) < 0) return -2;
-    for(int i=0; i<DIRENTS_PER_SECTOR; i++) {
-      if(i>nentries) break;
-      if(!strcmp(((dirent_t*)buf)[i].fname, fname)) {
-	// found the file/directory; update inode cache
-	int child_inode = ((dirent_t*)buf)[i].inode;
-	dprintf("... found child_inode=%d\n", child_inode);
-	int sector = INODE_TABLE_START_SECTOR+child_inode/INODES_PER_SECTOR;
-	if(sector != (*cached_inode_sector)) {
-	  *cached_inode_sector = sector;
-	  if(Disk_Read(sector, cached_inode_buffer) < 0) return -2;
-	  dprintf("... load inode table for child\n");
-	}
-	return child_inode;
-      }
-    }
-    idx++; nentries -= DIRENTS_PER_SECTOR;
+// write the changed sectors of the inode table back to disk; return 0
+// if successful, -1 otherwise
+static int inode_table_flush()
+{
+  char buf[MAX_SECTOR_SIZE];
+  for(int i=0; i<INODE_TABLE_SECTORS; i++) {
+    if(!fs->inodes_dirty[i]) continue;
+    int n = fs->geo.max_files-i*INODES_PER_SECTOR; // inodes in this sector
+    if(n > INODES_PER_SECTOR) n = INODES_PER_SECTOR;
+    memset(buf, 0, fs->geo.sector_size);
+    memcpy(buf, &fs->inodes[i*INODES_PER_SECTOR], n*sizeof(inode_t));
+    if(cache_write(INODE_TABLE_START_SECTOR+i, buf) < 0) return -1;
+    fs->inodes_dirty[i] = 0;
   }
-  dprintf("... could not find child inode\n");
-  return -1; // not found
+  return 0;
 }
 
-// follow the absolute path; if successful, return the inode of the
-// parent directory immediately before the last file/directory in the
-// path; for example, for '/a/b/c/d.txt', the parent is '/a/b/c' and
-// the child is 'd.txt'; the child's inode is returned through the
-// parameter 'last_inode' and its file name is returned through the
-// parameter 'last_fname' (both are references); it's possible that
-// the last file/directory is not in its parent directory, in which
-// case, 'last_inode' points to -1; if the function returns -1, it
-// means that we cannot follow the path
-static int follow_path(char* path, int* last_inode, char* last_fname)
+// returns specific node
+inode_t* getNode(int childNode) {
+	assert(0 <= childNode && childNode < fs->geo.max_files);
+	return &fs->inodes[childNode];
+}
+
+// flag the inode as changed, so it's written back on the next sync
+static void inode_dirty(int ino)
 {
-  if(!path) {
-    dprintf("... invalid path\n");
+  __atomic_store_n(&fs->inodes_dirty[ino/INODES_PER_SECTOR], 1, __ATOMIC_RELAXED);
+}
+
+// each inode has a reader/writer lock, taken for reading to look at
+// the inode and its data blocks (the entries of a directory, the data
+// of a file), and for writing to change them; this locks the inode,
+// for writing if 'write' is set, for reading otherwise
+static void inode_lock(int ino, int write)
+{
+  if(write) pthread_rwlock_wrlock(&fs->inode_locks[ino]);
+  else pthread_rwlock_rdlock(&fs->inode_locks[ino]);
+}
+
+static void inode_unlock(int ino)
+{
+  pthread_rwlock_unlock(&fs->inode_locks[ino]);
+}
+
+// indirect blocks are read and written through the sector cache, so
+// those of the files in use stay in memory
+
+// return the sector pointer in the given slot of an indirect block, or
+// -1 if there's an error (with osErrno set)
+static int ptr_load(int sector, int slot)
+{
+  cache_buf_t* buf = cache_get(sector, 1);
+  if(!buf) {
+    osErrno = E_GENERAL;
     return -1;
   }
-  if(path[0] != '/') {
-    dprintf("... '%s' not absolute path\n", path);
+  int ptr = ((int*)buf->data)[slot];
+  cache_put(buf, 0);
+  return ptr;
+}
+
+// store a sector pointer in the given slot of an indirect block;
+// return 0 if successful, -1 otherwise (with osErrno set)
+static int ptr_store(int sector, int slot, int ptr)
+{
+  cache_buf_t* buf = cache_get(sector, 1);
+  if(!buf) {
+    osErrno = E_GENERAL;
     return -1;
   }
-  
-  // make a copy of the path (skip leading '/'); this is necessary
-  // since the path is going to be modified by strsep()
-  char pathstore[MAX_PATH]; 
-  strncpy(pathstore, path+1, MAX_PATH-1);
-  pathstore[MAX_PATH-1] = '\0'; // for safety
-  char* lpath = pathstore;
-  
-  int parent_inode = -1, child_inode = 0; // start from root
-  // cache the disk sector containing the root inode
-  int cached_sector = INODE_TABLE_START_SECTOR;
-  char cached_buffer[SECTOR_SIZE];
-  if(Disk_Read(cached_sector, cached_buffer) < 0) return -1;
-  dprintf("... load inode table for root from disk sector %d\n", cached_sector);
-  
-  // for each file/directory name separated by '/'
-  char* token;
-  while((token = strsep(&lpath, "/")) != NULL) {
-    dprintf("... process token: '%s'\n", token);
-    if(*token == '\0') continue; // multiple '/' ignored
-    if(illegal_filename(token)) {
-      dprintf("... illegal file name: '%s'\n", token);
-      return -1; 
-    }
-    if(child_inode < 0) {
-      // regardless whether child_inode was not found previously, or
-      // there was issues related to the parent (say, not a
-      // directory), or there was a read error, we abort
-      dprintf("... parent inode can't be established\n");
-      return -1;
-    }
-    parent_inode = child_inode;
-    child_inode = find_child_inode(parent_inode, token,
-				   &cached_sector, cached_buffer);
-    if(last_fname) strcpy(last_fname, token);
+  ((int*)buf->data)[slot] = ptr;
+  cache_put(buf, 1);
+  return 0;
+}
+
+// allocate an empty indirect block, preferably at the 'goal' sector;
+// return its sector, or -1 if there's an error (with osErrno set)
+static int indirect_alloc(int goal)
+{
+  int got, sector = bitmap_alloc_run(&fs->sector_bitmap, goal, 1, &got);
+  if(sector < 0) {
+    osErrno = E_NO_SPACE;
+    return -1;
   }
-  if(child_inode < -1) return -1; // if there was error, abort
-  else {
-    // there was no error, several possibilities:
-    // 1) '/': parent = -1, child = 0
-    // 2) '/valid-dirs.../last-valid-dir/not-found': parent=last-valid-dir, child=-1
-    // 3) '/valid-dirs.../last-valid-dir/found: parent=last-valid-dir, child=found
-    // in the first case, we set parent=child=0 as special case
-    if(parent_inode==-1 && child_inode==0) parent_inode = 0;
-    dprintf("... found parent_inode=%d, child_inode=%d\n", parent_inode, child_inode);
-    *last_inode = child_inode;
-    return parent_inode;
+  cache_buf_t* buf = cache_get(sector, 0);
+  if(!buf) {
+    bitmap_reset(&fs->sector_bitmap, sector);
+    osErrno = E_GENERAL;
+    return -1;
   }
+  memset(buf->data, 0, fs->geo.sector_size);
+  cache_put(buf, 1);
+  return sector;
 }
 
-// add a new file or directory (determined by 'type') of given name
-// 'file' under parent directory represented by 'parent_inode'
-int add_inode(int type, int parent_inode, char* file)
+// free an indirect block ('depth' 1) or a double-indirect one (2),
+// with all the blocks it points to
+static void indirect_free(int sector, int depth)
 {
-  // get a new inode for child
-  int child_inode = bitmap_first_unused(INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, INODE_BITMAP_SIZE);
-  if(child_inode < 0) {
-    dprintf("... error: inode table is full\n");
-    return -1; 
+  cache_buf_t* buf = cache_get(sector, 1);
+  if(buf) {
+    for(int k=0; k<PTRS_PER_SECTOR; k++) {
+      int ptr = ((int*)buf->data)[k];
+      if(ptr <= 0) continue;
+      if(depth > 1) indirect_free(ptr, depth-1);
+      else {
+	cache_forget(ptr);
+	bitmap_reset(&fs->sector_bitmap, ptr);
+      }
+    }
+    cache_put(buf, 0);
   }
-  dprintf("... new child inode %d\n", child_inode);
-
-  // load the disk sector containing the child inode
-  int inode_sector = INODE_TABLE_START_SECTOR+child_inode/INODES_PER_SECTOR;
-  char inode_buffer[SECTOR_SIZE];
-  if(Disk_Read(inode_sector, inode_buffer) < 0) return -1;
-  dprintf("... load inode table for child inode from disk sector %d\n", inode_sector);
-
-  // get the child inode
-  int inode_start_entry = (inode_sector-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
-  int offset = child_inode-inode_start_entry;
-  assert(0 <= offset && offset < INODES_PER_SECTOR);
-  inode_t* child = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
+  cache_forget(sector);
+  bitmap_reset(&fs->sector_bitmap, sector);
+}
 
-  // update the new child inode and write to disk
+// find the indirect block holding the sector of block 'i' of a file
+// with INODE_INDIRECT set (i is at least NDIRECT), and the slot it's
+// in; return the indirect block, 0 if the file hasn't got it, or -1 if
+// there's an error (with osErrno set)
+static int indirect_find(inode_t* file, int i, int* slot)
+{
+  int j = i-NDIRECT;
+  if(j < PTRS_PER_SECTOR) {
+    *slot = j;
+    return file->data[NDIRECT];
+  }
+  j -= PTRS_PER_SECTOR;
+  *slot = j%PTRS_PER_SECTOR;
+  if(!file->data[NDIRECT+1]) return 0;
+  return ptr_load(file->data[NDIRECT+1], j/PTRS_PER_SECTOR);
+}
+
+// find the sectors of the blocks [i, i+n) of the file (0 for a block
+// the file hasn't got); the indirect block in use is looked up once
+// for all the blocks in it; return 0 if successful, -1 otherwise (with
+// osErrno set)
+static int block_map(inode_t* file, int i, int n, int* sectors)
+{
+  cache_buf_t* buf = NULL; // the indirect block in use
+  int slot = 0;
+  for(int k=0; k<n; k++, i++) {
+    if(!(file->type&INODE_INDIRECT) || i < NDIRECT) {
+      sectors[k] = (i < MAX_SECTORS_PER_FILE) ? file->data[i] : 0;
+      continue;
+    }
+    // go on to the next indirect block when this one's used up
+    if(buf && ++slot == PTRS_PER_SECTOR) {
+      cache_put(buf, 0);
+      buf = NULL;
+    }
+    if(!buf) {
+      int ind = indirect_find(file, i, &slot);
+      if(ind < 0) return -1;
+      if(ind == 0) {
+	sectors[k] = 0;
+	continue;
+      }
+      if(!(buf = cache_get(ind, 1))) {
+	osErrno = E_GENERAL;
+	return -1;
+      }
+    }
+    sectors[k] = ((int*)buf->data)[slot];
+  }
+  if(buf) cache_put(buf, 0);
+  return 0;
+}
+
+// make 'sector' block 'i' of the file (inode 'ino'), with the indirect
+// blocks that takes (allocated right after it if that's free, and
+// otherwise wherever the next free sector is; the sector itself is
+// taken already); return 0 if successful, -1 otherwise (with osErrno
+// set)
+static int block_set(int ino, int i, int sector)
+{
+  inode_t* file = getNode(ino);
+  inode_dirty(ino);
+  if(!(file->type&INODE_INDIRECT)) {
+    if(i < MAX_SECTORS_PER_FILE) {
+      file->data[i] = sector;
+      return 0;
+    }
+    // the file outgrows its inode: the last two data blocks move to
+    // a new indirect block
+    int ind = indirect_alloc(sector+1);
+    if(ind < 0) return -1;
+    if(ptr_store(ind, 0, file->data[NDIRECT]) < 0 ||
+       ptr_store(ind, 1, file->data[NDIRECT+1]) < 0) {
+      bitmap_reset(&fs->sector_bitmap, ind);
+      return -1;
+    }
+    file->data[NDIRECT] = ind;
+    file->data[NDIRECT+1] = 0;
+    file->type |= INODE_INDIRECT;
+  }
+  if(i < NDIRECT) {
+    file->data[i] = sector;
+    return 0;
+  }
+
+  int j = i-NDIRECT;
+  if(j < PTRS_PER_SECTOR) return ptr_store(file->data[NDIRECT], j, sector);
+  j -= PTRS_PER_SECTOR;
+  if(!file->data[NDIRECT+1]) {
+    int dind = indirect_alloc(sector+1);
+    if(dind < 0) return -1;
+    file->data[NDIRECT+1] = dind;
+  }
+  int ind = ptr_load(file->data[NDIRECT+1], j/PTRS_PER_SECTOR);
+  if(ind < 0) return -1;
+  if(ind == 0) {
+    if((ind = indirect_alloc(sector+1)) < 0) return -1;
+    if(ptr_store(file->data[NDIRECT+1], j/PTRS_PER_SECTOR, ind) < 0) {
+      bitmap_reset(&fs->sector_bitmap, ind);
+      return -1;
+    }
+  }
+  return ptr_store(ind, j%PTRS_PER_SECTOR, sector);
+}
+
+// the number of indirect blocks a file of 'n' blocks has
+static int indirect_blocks(int n)
+{
+  if(n <= MAX_SECTORS_PER_FILE) return 0;
+  n -= NDIRECT+PTRS_PER_SECTOR;
+  if(n <= 0) return 1;
+  return 2+(n+PTRS_PER_SECTOR-1)/PTRS_PER_SECTOR;
+}
+
+// free all the blocks of the file
+static void file_free(inode_t* file)
+{
+  int n = MAX_SECTORS_PER_FILE;
+  if(file->type&INODE_INDIRECT) {
+    if(file->data[NDIRECT] > 0) indirect_free(file->data[NDIRECT], 1);
+    if(file->data[NDIRECT+1] > 0) indirect_free(file->data[NDIRECT+1], 2);
+    n = NDIRECT;
+  }
+  for(int i=0; i<n; i++) {
+    if(file->data[i] > 0) {
+      cache_forget(file->data[i]);
+      bitmap_reset(&fs->sector_bitmap, file->data[i]);
+    }
+  }
+}
+
+
+// empty the dcache
+static void dcache_init()
+{
+  for(int i=0; i<DCACHE_ENTRIES; i++) {
+    fs->dcache[i].parent = -1;
+    fs->dcache[i].ref = 0;
+    fs->dcache[i].next = -1;
+  }
+  for(int i=0; i<DCACHE_HASH_SIZE; i++) fs->dcache_hash[i] = -1;
+  fs->dcache_hand = 0;
+}
+
+// hash the file name (FNV-1a, with the bits mixed at the end since
+// names tend to differ only in the last few characters), mixed with
+// the given seed
+static unsigned name_hash(unsigned seed, char* fname)
+{
+  uint32_t h = 2166136261u^seed;
+  for(; *fname; fname++) h = (h^(unsigned char)*fname)*16777619u;
+  h ^= h>>16; h *= 0x85ebca6bu;
+  h ^= h>>13; h *= 0xc2b2ae35u;
+  return h^(h>>16);
+}
+
+// the hash chain for the name in the parent
+static int dcache_chain(int parent, char* fname)
+{
+  return name_hash(parent, fname)&(DCACHE_HASH_SIZE-1);
+}
+
+// return the entry for the name in the parent; -1 if it's not cached
+static int dcache_find(int parent, char* fname)
+{
+  int i = fs->dcache_hash[dcache_chain(parent, fname)];
+  while(i >= 0 && (fs->dcache[i].parent != parent || strcmp(fs->dcache[i].fname, fname)))
+    i = fs->dcache[i].next;
+  return i;
+}
+
+// take the entry off its hash chain and mark it unused
+static void dcache_unhash(int i)
+{
+  int* link = &fs->dcache_hash[dcache_chain(fs->dcache[i].parent, fs->dcache[i].fname)];
+  while(*link != i) link = &fs->dcache[*link].next;
+  *link = fs->dcache[i].next;
+  fs->dcache[i].parent = -1;
+  fs->dcache[i].next = -1;
+}
+
+// look up the name in the parent; return the child inode (-1 if the
+// child is known not to exist), or -2 if the dcache doesn't know
+static int dcache_lookup(int parent, char* fname)
+{
+  int inode = -2;
+  pthread_mutex_lock(&fs->dcache_lock);
+  int i = dcache_find(parent, fname);
+  if(i < 0) fs->stats.dcache_misses++;
+  else {
+    fs->dcache[i].ref = 1;
+    inode = fs->dcache[i].inode;
+    if(inode < 0) fs->stats.dcache_negative_hits++;
+    else fs->stats.dcache_hits++;
+  }
+  pthread_mutex_unlock(&fs->dcache_lock);
+  return inode;
+}
+
+// remember the child inode (-1 for none) of the name in the parent
+static void dcache_enter(int parent, char* fname, int inode)
+{
+  pthread_mutex_lock(&fs->dcache_lock);
+  int i = dcache_find(parent, fname);
+  if(i < 0) {
+    // sweep the clock hand for an entry to reuse
+    for(;;) {
+      i = fs->dcache_hand;
+      fs->dcache_hand = (fs->dcache_hand+1)%DCACHE_ENTRIES;
+      if(fs->dcache[i].parent < 0) break;
+      if(fs->dcache[i].ref) { fs->dcache[i].ref = 0; continue; }
+      dcache_unhash(i);
+      break;
+    }
+    fs->dcache[i].parent = parent;
+    strncpy(fs->dcache[i].fname, fname, MAX_NAME-1);
+    fs->dcache[i].fname[MAX_NAME-1] = '\0';
+    int chain = dcache_chain(parent, fs->dcache[i].fname);
+    fs->dcache[i].next = fs->dcache_hash[chain];
+    fs->dcache_hash[chain] = i;
+  }
+  fs->dcache[i].inode = inode;
+  fs->dcache[i].ref = 1;
+  pthread_mutex_unlock(&fs->dcache_lock);
+}
+
+// drop all entries of the given parent (a directory being removed, so
+// that its inode can be reused)
+static void dcache_purge(int parent)
+{
+  pthread_mutex_lock(&fs->dcache_lock);
+  for(int i=0; i<DCACHE_ENTRIES; i++)
+    if(fs->dcache[i].parent == parent) dcache_unhash(i);
+  pthread_mutex_unlock(&fs->dcache_lock);
+}
+
+// the bucket of a hashed directory where the lookup of a name starts
+static int dir_bucket_home(char* fname)
+{
+  return name_hash(0, fname)%MAX_SECTORS_PER_FILE;
+}
+
+// find the name in the hashed directory, starting from its home
+// bucket and going on through the buckets after it until all the
+// entries that didn't fit at home have been seen; return the index of
+// the entry through 'idx' with the bucket holding it pinned (to be
+// released by the caller), or NULL if the name is not there (also if
+// there's a read error, with 'idx' set to -2)
+static cache_buf_t* hashed_dir_find(inode_t* dir, char* fname, int* idx)
+{
+  int home = dir_bucket_home(fname), away = 0;
+  *idx = -1;
+  for(int n=0, b=home; n<MAX_SECTORS_PER_FILE; n++, b=(b+1)%MAX_SECTORS_PER_FILE) {
+    cache_buf_t* buf = cache_get(dir->data[b], 1);
+    if(!buf) { *idx = -2; return NULL; }
+    dirent_t* dirents = (dirent_t*)buf->data;
+    dir_bucket_t* bucket = DIR_BUCKET(buf->data);
+    if(n == 0) away = bucket->overflow;
+    for(int i=0; i<bucket->count; i++) {
+      if(!strcmp(dirents[i].fname, fname)) {
+	*idx = i;
+	return buf;
+      }
+      if(n > 0 && dir_bucket_home(dirents[i].fname) == home) away--;
+    }
+    cache_put(buf, 0);
+    if(away <= 0) break;
+  }
+  return NULL;
+}
+
+// look up the name in the hashed directory; return its inode, -1 if
+// it's not there, or -2 if there's a read error
+static int hashed_dir_lookup(inode_t* dir, char* fname)
+{
+  int i;
+  cache_buf_t* buf = hashed_dir_find(dir, fname, &i);
+  if(!buf) return i;
+  int child_inode = ((dirent_t*)buf->data)[i].inode;
+  cache_put(buf, 0);
+  return child_inode;
+}
+
+// add the entry to the hashed directory, which must not be full; if
+// the home bucket is full, it goes into the first bucket after that
+// with room, and the home bucket counts it as away; return 0 if
+// successful, -1 otherwise
+static int hashed_dir_insert(inode_t* dir, dirent_t* dirent)
+{
+  int b = dir_bucket_home(dirent->fname);
+  for(int n=0; ; n++, b=(b+1)%MAX_SECTORS_PER_FILE) {
+    cache_buf_t* buf = cache_get(dir->data[b], 1);
+    if(!buf) return -1;
+    dir_bucket_t* bucket = DIR_BUCKET(buf->data);
+    if(bucket->count < DIRENTS_PER_SECTOR) {
+      ((dirent_t*)buf->data)[bucket->count++] = *dirent;
+      cache_put(buf, 1);
+      return 0;
+    }
+    if(n == 0) bucket->overflow++;
+    cache_put(buf, n == 0);
+  }
+}
+
+// remove the entry of the name from the hashed directory; return 0 if
+// successful, -1 otherwise
+static int hashed_dir_remove(inode_t* dir, char* fname)
+{
+  int i;
+  cache_buf_t* buf = hashed_dir_find(dir, fname, &i);
+  if(!buf) return -1;
+
+  // move the last entry of the bucket into its place
+  dirent_t* dirents = (dirent_t*)buf->data;
+  dir_bucket_t* bucket = DIR_BUCKET(buf->data);
+  dirents[i] = dirents[--bucket->count];
+  memset(&dirents[bucket->count], 0, sizeof(dirent_t));
+  int away = (buf->sector != dir->data[dir_bucket_home(fname)]);
+  cache_put(buf, 1);
+
+  // an entry kept away from home is no longer to be looked for
+  if(away) {
+    if(!(buf = cache_get(dir->data[dir_bucket_home(fname)], 1))) return -1;
+    DIR_BUCKET(buf->data)->overflow--;
+    cache_put(buf, 1);
+  }
+  return 0;
+}
+
+// give back the first 'n' buckets of a hashed directory (one whose
+// conversion failed halfway)
+static void free_buckets(inode_t* dir, int n)
+{
+  while(n-- > 0) {
+    cache_forget(dir->data[n]);
+    bitmap_reset(&fs->sector_bitmap, dir->data[n]);
+  }
+}
+
+// turn the linear directory into a hashed one, with all its buckets
+// allocated up front; return 0 if successful, or -1 if not (say, the
+// disk is full), in which case the directory stays as it was and the
+// buckets are given back
+static int hash_directory(inode_t* dir)
+{
+  inode_t hashed;
+  memset(&hashed, 0, sizeof(inode_t));
+  for(int i=0; i<MAX_SECTORS_PER_FILE; ) {
+    int got, sector = bitmap_alloc_run(&fs->sector_bitmap, (i > 0) ? hashed.data[i-1]+1 : -1,
+				       MAX_SECTORS_PER_FILE-i, &got);
+    if(sector < 0) {
+      free_buckets(&hashed, i);
+      return -1;
+    }
+    for(int k=0; k<got; k++) {
+      cache_buf_t* buf = cache_get(sector+k, 0);
+      if(!buf) {
+	for(; k<got; k++) bitmap_reset(&fs->sector_bitmap, sector+k);
+	free_buckets(&hashed, i);
+	return -1;
+      }
+      memset(buf->data, 0, fs->geo.sector_size);
+      cache_put(buf, 1);
+      hashed.data[i++] = sector+k;
+    }
+  }
+
+  // move the entries over, and give back the old sectors
+  int nsectors = (dir->size+DIRENTS_PER_SECTOR-1)/DIRENTS_PER_SECTOR;
+  for(int i=0; i<nsectors; i++) {
+    char buffer[MAX_SECTOR_SIZE];
+    int status = cache_read(dir->data[i], buffer);
+    for(int k=0; status == 0 && k<DIRENTS_PER_SECTOR && i*DIRENTS_PER_SECTOR+k<dir->size; k++)
+      status = hashed_dir_insert(&hashed, &((dirent_t*)buffer)[k]);
+    if(status < 0) {
+      free_buckets(&hashed, MAX_SECTORS_PER_FILE);
+      return -1;
+    }
+  }
+  for(int i=0; i<nsectors; i++) {
+    cache_forget(dir->data[i]);
+    bitmap_reset(&fs->sector_bitmap, dir->data[i]);
+  }
+  memcpy(dir->data, hashed.data, sizeof(hashed.data));
+  dir->type |= INODE_HASHED;
+  dprintf("... hashed directory of %d entries\n", dir->size);
+  return 0;
+}
+
+// return the child inode of the given file name 'fname' from the
+// parent inode; the function returns -1 if no such file is found; it
+// returns -2 is something else is wrong (such as parent is not
+// directory, or there's read error, etc.)
+static int find_child_inode(int parent_inode, char* fname) {
+
+  inode_t* parent = getNode(parent_inode);
+  dprintf("... load parent inode: %d (size=%d, type=%d)\n",
+	 parent_inode, parent->size, parent->type);
+  if(INODE_TYPE(parent) != 1) {
+    dprintf("... parent not a directory\n");
+    return -2;
+  }
+
+  int child_inode = dcache_lookup(parent_inode, fname);
+  if(child_inode >= -1) {
+    dprintf("... dcache has child_inode=%d\n", child_inode);
+    return child_inode;
+  }
+
+  if(parent->type&INODE_HASHED) {
+    child_inode = hashed_dir_lookup(parent, fname);
+    dprintf("... hashed lookup found child_inode=%d\n", child_inode);
+    if(child_inode >= -1) dcache_enter(parent_inode, fname, child_inode);
+    return child_inode;
+  }
+
+  int nentries = parent->size; // remaining number of directory entries 
+  int idx = 0;
+  while(nentries > 0) {
+    // scan the directory entries in place in the cache
+    cache_buf_t* buf = cache_get(parent->data[idx], 1);
+    if(!buf) return -2;
+    dirent_t* dirents = (dirent_t*)buf->data;
+    for(int i=0; i<DIRENTS_PER_SECTOR; i++) {
+      if(i>=nentries) break;
+      if(!strcmp(dirents[i].fname, fname)) {
+	// found the file/directory
+	child_inode = dirents[i].inode;
+	cache_put(buf, 0);
+	dcache_enter(parent_inode, fname, child_inode);
+	dprintf("... found child_inode=%d\n", child_inode);
+	return child_inode;
+      }
+    }
+    cache_put(buf, 0);
+    idx++; nentries -= DIRENTS_PER_SECTOR;
+  }
+  dprintf("... could not find child inode\n");
+  dcache_enter(parent_inode, fname, -1);
+  return -1; // not found
+}
+
+// follow the absolute path; if successful, return the inode of the
+// parent directory immediately before the last file/directory in the
+// path; for example, for '/a/b/c/d.txt', the parent is '/a/b/c' and
+// the child is 'd.txt'; the child's inode is returned through the
+// parameter 'last_inode' and its file name is returned through the
+// parameter 'last_fname' (both are references); it's possible that
+// the last file/directory is not in its parent directory, in which
+// case, 'last_inode' points to -1; if the function returns -1, it
+// means that we cannot follow the path; the directories on the path
+// are locked for reading on the way down, each one before letting go
+// of the one above it, and the parent returned is left locked (for
+// writing if 'write' is set) for the caller to unlock
+static int follow_path(char* path, int* last_inode, char* last_fname, int write)
+{
+  *last_inode = -1; // in case the path can't be followed
+  if(!path) {
+    dprintf("... invalid path\n");
+    return -1;
+  }
+  if(path[0] != '/') {
+    dprintf("... '%s' not absolute path\n", path);
+    return -1;
+  }
+  
+  // make a copy of the path (skip leading '/'); this is necessary
+  // since the path is going to be modified by strsep()
+  char pathstore[MAX_PATH]; 
+  strncpy(pathstore, path+1, MAX_PATH-1);
+  pathstore[MAX_PATH-1] = '\0'; // for safety
+  char* lpath = pathstore;
+
+  // split it up into file/directory names separated by '/' first, so
+  // that we know which directory is the last one to lock
+  char* tokens[MAX_PATH/2];
+  int ntokens = 0;
+  char* token;
+  while((token = strsep(&lpath, "/")) != NULL) {
+    dprintf("... process token: '%s'\n", token);
+    if(*token == '\0') continue; // multiple '/' ignored
+    if(illegal_filename(token)) {
+      dprintf("... illegal file name: '%s'\n", token);
+      return -1; 
+    }
+    tokens[ntokens++] = token;
+  }
+  
+  int parent_inode = 0, child_inode = 0; // start from root
+  inode_lock(0, write && ntokens <= 1);
+  for(int t=0; t<ntokens; t++) {
+    if(t > 0) {
+      if(child_inode < 0) {
+	// regardless whether child_inode was not found previously, or
+	// there was issues related to the parent (say, not a
+	// directory), or there was a read error, we abort
+	dprintf("... parent inode can't be established\n");
+	inode_unlock(parent_inode);
+	return -1;
+      }
+      inode_lock(child_inode, write && t == ntokens-1);
+      inode_unlock(parent_inode);
+      parent_inode = child_inode;
+    }
+    child_inode = find_child_inode(parent_inode, tokens[t]);
+    if(last_fname) strcpy(last_fname, tokens[t]);
+  }
+  if(child_inode < -1) { // if there was error, abort
+    inode_unlock(parent_inode);
+    return -1;
+  }
+  // there was no error, several possibilities:
+  // 1) '/': parent = child = 0 (as special case)
+  // 2) '/valid-dirs.../last-valid-dir/not-found': parent=last-valid-dir, child=-1
+  // 3) '/valid-dirs.../last-valid-dir/found: parent=last-valid-dir, child=found
+  dprintf("... found parent_inode=%d, child_inode=%d\n", parent_inode, child_inode);
+  *last_inode = child_inode;
+  return parent_inode;
+}
+
+// lock the child found by follow_path() for reading and let go of its
+// parent (unless the two are the same, as they are for the root)
+static void lock_child(int parent_inode, int child_inode)
+{
+  if(child_inode != parent_inode) {
+    inode_lock(child_inode, 0);
+    inode_unlock(parent_inode);
+  }
+}
+
+// add a new file or directory (determined by 'type') of given name
+// 'file' under parent directory represented by 'parent_inode'
+int add_inode(int type, int parent_inode, char* file)
+{
+  // get the parent inode
+  inode_t* parent = getNode(parent_inode);
+  dprintf("... get parent inode %d (size=%d, type=%d)\n",
+	 parent_inode, parent->size, parent->type);
+  if(INODE_TYPE(parent) != 1) {
+    dprintf("... error: parent inode is not directory\n");
+    return -2; // parent not directory
+  }
+  if(parent->size >= MAX_DIRENTS) {
+    dprintf("... error: parent directory is full\n");
+    return -1;
+  }
+
+  // a big directory is turned into a hashed one (if there's room)
+  if(!(parent->type&INODE_HASHED) && parent->size >= HASHED_DIR_THRESHOLD &&
+     hash_directory(parent) == 0)
+    inode_dirty(parent_inode);
+
+  // get a new inode for child
+  int child_inode = bitmap_first_unused(&fs->inode_bitmap);
+  if(child_inode < 0) {
+    dprintf("... error: inode table is full\n");
+    return -1; 
+  }
+  dprintf("... new child inode %d\n", child_inode);
+
+  // update the new child inode
+  inode_t* child = getNode(child_inode);
   memset(child, 0, sizeof(inode_t));
   child->type = type;
-  if(Disk_Write(inode_sector, inode_buffer) < 0) return -1;
-  dprintf("... update child inode %d (size=%d, type=%d), update disk sector %d\n",
-	 child_inode, child->size, child->type, inode_sector);
+  inode_dirty(child_inode);
+  dprintf("... update child inode %d (size=%d, type=%d)\n",
+	 child_inode, child->size, child->type);
+
+  dirent_t dirent;
+  memset(&dirent, 0, sizeof(dirent_t));
+  strncpy(dirent.fname, file, MAX_NAME-1);
+  dirent.inode = child_inode;
+
+  // (the child inode is given back if the dirent can't be added)
+  if(parent->type&INODE_HASHED) {
+    // add the dirent to its bucket
+    if(hashed_dir_insert(parent, &dirent) < 0) {
+      bitmap_reset(&fs->inode_bitmap, child_inode);
+      return -1;
+    }
+    dprintf("... add dirent %d (name='%s', inode=%d) to hashed directory\n",
+	    parent->size, dirent.fname, dirent.inode);
+  } else {
+    // get the dirent sector (in the cache, where it's changed in place)
+    int group = parent->size/DIRENTS_PER_SECTOR;
+    cache_buf_t* buf;
+    if(group*DIRENTS_PER_SECTOR == parent->size) {
+      // new disk sector is needed
+      int newsec = bitmap_first_unused(&fs->sector_bitmap);
+      if(newsec < 0) {
+	dprintf("... error: disk is full\n");
+	bitmap_reset(&fs->inode_bitmap, child_inode);
+	return -1;
+      }
+      if(!(buf = cache_get(newsec, 0))) {
+	bitmap_reset(&fs->sector_bitmap, newsec);
+	bitmap_reset(&fs->inode_bitmap, child_inode);
+	return -1;
+      }
+      parent->data[group] = newsec;
+      memset(buf->data, 0, fs->geo.sector_size);
+      dprintf("... new disk sector %d for dirent group %d\n", newsec, group);
+    } else {
+      if(!(buf = cache_get(parent->data[group], 1))) {
+	bitmap_reset(&fs->inode_bitmap, child_inode);
+	return -1;
+      }
+      dprintf("... load disk sector %d for dirent group %d\n", parent->data[group], group);
+    }
+
+    // add the dirent (it goes to disk with the cache)
+    int start_entry = group*DIRENTS_PER_SECTOR;
+    int offset = parent->size-start_entry;
+    ((dirent_t*)buf->data)[offset] = dirent;
+    cache_put(buf, 1);
+    dprintf("... append dirent %d (name='%s', inode=%d) to group %d, update disk sector %d\n",
+	    parent->size, dirent.fname, dirent.inode, group, parent->data[group]);
+  }
+  dcache_enter(parent_inode, dirent.fname, child_inode);
+
+  // update parent inode
+  parent->size++;
+  inode_dirty(parent_inode);
+  dprintf("... update parent inode %d\n", parent_inode);
+  
+  return 0;
+}
+
+// used by both File_Create() and Dir_Create(); type=0 is file, type=1
+// is directory
+int create_file_or_directory(int type, char* pathname)
+{
+  int child_inode;
+  char last_fname[MAX_NAME];
+  pthread_rwlock_rdlock(&fs->fs_lock);
+  int parent_inode = follow_path(pathname, &child_inode, last_fname, 1);
+  if(parent_inode >= 0) {
+    int status = 0;
+    if(child_inode >= 0) {
+      dprintf("... file/directory '%s' already exists, failed to create\n", pathname);
+      osErrno = E_CREATE;
+      status = -1;
+    } else {
+      if(add_inode(type, parent_inode, last_fname) >= 0) {
+	dprintf("... successfully created file/directory: '%s'\n", pathname);
+      } else {
+	dprintf("... error: something wrong with adding child inode\n");
+	osErrno = E_CREATE;
+	status = -1;
+      }
+    }
+    inode_unlock(parent_inode);
+    pthread_rwlock_unlock(&fs->fs_lock);
+    return status;
+  } else {
+    pthread_rwlock_unlock(&fs->fs_lock);
+    dprintf("... error: something wrong with the file/path: '%s'\n", pathname);
+    osErrno = E_CREATE;
+    return -1;
+  }
+}
+
+// remove the child (named 'fname') from parent; the function is
+// called by both File_Unlink() and Dir_Unlink(); the function returns
+// 0 if success, -1 if general error, -2 if directory not empty, -3 if
+// wrong type
+int remove_inode(int type, int parent_inode, int child_inode, char* fname) { //Made by: Stephan Belizaire
+
+  inode_t* child = getNode(child_inode);
+
+  if(INODE_TYPE(child) != type) {
+    dprintf("... error: inode %d has type %d, not %d\n", child_inode, child->type, type);
+    return -3;
+  }
+  if(type == 1 && child->size > 0) {
+    dprintf("... error: directory inode %d not empty\n", child_inode);
+    return -2;
+  }
+
+  // free the data blocks of the child, and then the child inode
+  file_free(child);
+  memset(child, 0, sizeof(inode_t));
+  inode_dirty(child_inode);
+  bitmap_reset(&fs->inode_bitmap, child_inode);
+  if(type == 1) dcache_purge(child_inode);
+  dprintf("... freed child inode %d\n", child_inode);
+
+  inode_t* parent = getNode(parent_inode);
+
+  if(parent->type&INODE_HASHED) {
+    if(hashed_dir_remove(parent, fname) < 0) {
+      dprintf("... error: child inode %d not in parent %d\n", child_inode, parent_inode);
+      return -1;
+    }
+    dcache_enter(parent_inode, fname, -1);
+    dprintf("... removed dirent '%s' from hashed parent %d\n", fname, parent_inode);
+
+    // once empty, the directory goes back to being a linear one
+    if(--parent->size == 0) {
+      for(int i=0; i<MAX_SECTORS_PER_FILE; i++) {
+	cache_forget(parent->data[i]);
+	bitmap_reset(&fs->sector_bitmap, parent->data[i]);
+	parent->data[i] = 0;
+      }
+      parent->type &= ~INODE_HASHED;
+    }
+    inode_dirty(parent_inode);
+    return 0;
+  }
+
+  // find the dirent of the child
+  int found = -1;
+  for(int idx=0; found<0 && idx*DIRENTS_PER_SECTOR<parent->size; idx++) {
+    char dirent_buffer[MAX_SECTOR_SIZE];
+    if(cache_read(parent->data[idx], dirent_buffer) < 0) return -1;
+    for(int k=0; k<DIRENTS_PER_SECTOR && idx*DIRENTS_PER_SECTOR+k<parent->size; k++) {
+      if(((dirent_t*)dirent_buffer)[k].inode == child_inode) {
+	found = idx*DIRENTS_PER_SECTOR+k;
+	break;
+      }
+    }
+  }
+  if(found < 0) {
+    dprintf("... error: child inode %d not in parent %d\n", child_inode, parent_inode);
+    return -1;
+  }
+
+  // move the last dirent into its place so that the entries stay packed
+  int last = parent->size-1;
+  cache_buf_t* lastbuf = cache_get(parent->data[last/DIRENTS_PER_SECTOR], 1);
+  if(!lastbuf) return -1;
+  dirent_t moved = ((dirent_t*)lastbuf->data)[last%DIRENTS_PER_SECTOR];
+  memset(&((dirent_t*)lastbuf->data)[last%DIRENTS_PER_SECTOR], 0, sizeof(dirent_t));
+  cache_put(lastbuf, 1);
+  if(found != last) {
+    cache_buf_t* buf = cache_get(parent->data[found/DIRENTS_PER_SECTOR], 1);
+    if(!buf) return -1;
+    dirent_t* hole = &((dirent_t*)buf->data)[found%DIRENTS_PER_SECTOR];
+    dcache_enter(parent_inode, hole->fname, -1);
+    *hole = moved;
+    cache_put(buf, 1);
+  } else dcache_enter(parent_inode, moved.fname, -1);
+  dprintf("... removed dirent %d from parent %d\n", found, parent_inode);
+
+  // the last dirent sector may now be empty and can be given back
+  parent->size--;
+  if(parent->size%DIRENTS_PER_SECTOR == 0) {
+    int group = parent->size/DIRENTS_PER_SECTOR;
+    cache_forget(parent->data[group]);
+    bitmap_reset(&fs->sector_bitmap, parent->data[group]);
+    parent->data[group] = 0;
+  }
+  inode_dirty(parent_inode);
+  dprintf("... update parent inode %d\n", parent_inode);
+  return 0;
+}
+
+
+// the table of open files is made of chunks of MAX_OPEN_FILES entries,
+// which never move once allocated, so that an fd can be used while
+// the table grows; the unused entries below the high-water mark
+// 'open_files_top' are kept on a free list, most recently closed
+// first; those at and above it have never been used; the table and
+// the free list are guarded by fd_table_lock
+#define OPEN_FILE(fd) (&fs->open_files[(fd)/MAX_OPEN_FILES][(fd)%MAX_OPEN_FILES])
+
+// forget all open files, and free what was kept for each inode
+static void open_files_release()
+{
+  for(int i=0; i<fs->open_files_top; i++) {
+    free(OPEN_FILE(i)->ra_buf);
+    free(OPEN_FILE(i)->wb_buf);
+  }
+  for(int c=0; c<MAX_OPEN_FILES_LIMIT/MAX_OPEN_FILES && fs->open_files[c]; c++) {
+    for(int i=0; i<MAX_OPEN_FILES; i++) pthread_mutex_destroy(&fs->open_files[c][i].lock);
+    free(fs->open_files[c]);
+    fs->open_files[c] = NULL;
+  }
+  fs->open_files_top = 0;
+  fs->open_files_free = -1;
+  for(int i=0; i<fs->inode_locks_size; i++) pthread_rwlock_destroy(&fs->inode_locks[i]);
+  fs->inode_locks_size = 0;
+  free(fs->inode_locks);
+  free(fs->open_count);
+  free(fs->writebehind_fds);
+  free(fs->inode_gen);
+  fs->inode_locks = NULL;
+  fs->open_count = NULL;
+  fs->writebehind_fds = NULL;
+  fs->inode_gen = NULL;
+}
+
+// forget all open files, and start counting afresh for each inode of
+// the file system just booted; return 0 if successful, -1 otherwise
+static int open_files_reset()
+{
+  open_files_release();
+  fs->inode_locks = (pthread_rwlock_t*)malloc(fs->geo.max_files*sizeof(pthread_rwlock_t));
+  fs->open_count = (int*)calloc(fs->geo.max_files, sizeof(int));
+  fs->writebehind_fds = (open_file_t**)calloc(fs->geo.max_files, sizeof(open_file_t*));
+  fs->inode_gen = (unsigned*)calloc(fs->geo.max_files, sizeof(unsigned));
+  if(!fs->inode_locks || !fs->open_count || !fs->writebehind_fds || !fs->inode_gen) return -1;
+  for(; fs->inode_locks_size<fs->geo.max_files; fs->inode_locks_size++)
+    pthread_rwlock_init(&fs->inode_locks[fs->inode_locks_size], NULL);
+  return 0;
+}
+
+// return true if the file pointed to by inode has already been open
+int is_file_open(int inode)
+{
+	pthread_mutex_lock(&fs->fd_table_lock);
+	int open = fs->open_count[inode] > 0;
+	pthread_mutex_unlock(&fs->fd_table_lock);
+	return open;
+}
+
+// return a new file descriptor open on the inode; -1 if full
+int new_file_fd(int inode)
+{
+  pthread_mutex_lock(&fs->fd_table_lock);
+  int fd = fs->open_files_free;
+  if(fd >= 0) fs->open_files_free = OPEN_FILE(fd)->next_free;
+  else {
+    if(fs->open_files_top%MAX_OPEN_FILES == 0) {
+      // the table is full, add another chunk to it
+      open_file_t* chunk = NULL;
+      if(fs->open_files_top < MAX_OPEN_FILES_LIMIT)
+	chunk = (open_file_t*)calloc(MAX_OPEN_FILES, sizeof(open_file_t));
+      if(!chunk) {
+	pthread_mutex_unlock(&fs->fd_table_lock);
+	return -1;
+      }
+      for(int i=0; i<MAX_OPEN_FILES; i++) pthread_mutex_init(&chunk[i].lock, NULL);
+      __atomic_store_n(&fs->open_files[fs->open_files_top/MAX_OPEN_FILES], chunk, __ATOMIC_RELEASE);
+      dprintf("... open file table grown to %d entries\n", fs->open_files_top+MAX_OPEN_FILES);
+    }
+    fd = fs->open_files_top++;
+  }
+  // nothing holds an unused entry's lock for more than a moment (to
+  // find out that the fd isn't open), so it can be taken here
+  open_file_t* of = OPEN_FILE(fd);
+  pthread_mutex_lock(&of->lock);
+  memset(of, 0, offsetof(open_file_t, lock));
+  of->inode = inode;
+  pthread_mutex_unlock(&of->lock);
+  fs->open_count[inode]++;
+  pthread_mutex_unlock(&fs->fd_table_lock);
+  return fd;
+}
+
+// take the fd off the list of those with writes buffered on its inode,
+// and give back the sectors reserved for them
+static void writebehind_unlist(open_file_t* of)
+{
+  open_file_t** link = &fs->writebehind_fds[of->inode];
+  while(*link != of) link = &(*link)->wb_next;
+  *link = of->wb_next;
+  pthread_mutex_lock(&fs->alloc_lock);
+  fs->sector_bitmap.reserved -= of->wb_reserved;
+  pthread_mutex_unlock(&fs->alloc_lock);
+  of->wb_reserved = 0;
+}
+
+// give the file descriptor back; the caller has the fd and its inode
+// locked for writing (see fd_enter()), and they're unlocked here
+static void free_file_fd(int fd)
+{
+  open_file_t* of = OPEN_FILE(fd);
+  int inode = of->inode;
+  if(of->wb_len > 0) writebehind_unlist(of);
+  free(of->ra_buf);
+  of->ra_buf = NULL;
+  free(of->wb_buf);
+  of->wb_buf = NULL;
+  of->inode = 0;
+  inode_unlock(inode);
+  pthread_mutex_unlock(&of->lock);
+
+  // nothing uses the entry any more, it can go on the free list
+  pthread_mutex_lock(&fs->fd_table_lock);
+  fs->open_count[inode]--;
+  of->next_free = fs->open_files_free;
+  fs->open_files_free = fd;
+  pthread_mutex_unlock(&fs->fd_table_lock);
+}
+
+// write out the buffered writes of all fds open on the inode, which
+// is locked for writing; return 0 if successful, -1 otherwise (with
+// osErrno set)
+static int writebehind_sync(int inode);
+
+// start a call on fd: lock the file system, the fd, and the inode the
+// fd is open on, for writing if 'write' is set, or else for reading
+// once the writes buffered on the inode have been written out (so that
+// they can be read back); return the entry of fd, or NULL if there's
+// an error (with osErrno set, and nothing left locked)
+static open_file_t* fd_enter(int fd, int write)
+{
+  pthread_rwlock_rdlock(&fs->fs_lock);
+  open_file_t* chunk = NULL;
+  if(fd >= 0 && fd < MAX_OPEN_FILES_LIMIT)
+    chunk = __atomic_load_n(&fs->open_files[fd/MAX_OPEN_FILES], __ATOMIC_ACQUIRE);
+  open_file_t* of = chunk ? &chunk[fd%MAX_OPEN_FILES] : NULL;
+  if(of) {
+    pthread_mutex_lock(&of->lock);
+    if(of->inode == 0) {
+      pthread_mutex_unlock(&of->lock);
+      of = NULL;
+    }
+  }
+  if(!of) {
+    dprintf("... fd=%d not an open file\n", fd);
+    pthread_rwlock_unlock(&fs->fs_lock);
+    osErrno = E_BAD_FD;
+    return NULL;
+  }
+
+  inode_lock(of->inode, write);
+  while(!write && fs->writebehind_fds[of->inode]) {
+    inode_unlock(of->inode);
+    inode_lock(of->inode, 1);
+    int status = writebehind_sync(of->inode);
+    inode_unlock(of->inode);
+    if(status < 0) {
+      pthread_mutex_unlock(&of->lock);
+      pthread_rwlock_unlock(&fs->fs_lock);
+      return NULL;
+    }
+    inode_lock(of->inode, 0);
+  }
+  return of;
+}
+
+// finish a call started with fd_enter()
+static void fd_leave(open_file_t* of)
+{
+  inode_unlock(of->inode);
+  pthread_mutex_unlock(&of->lock);
+  pthread_rwlock_unlock(&fs->fs_lock);
+}
+
+// reads that carry on where the last one on the fd left off are taken
+// to be sequential; they're served from a readahead window of the
+// file's sectors read in one go, which starts with READAHEAD_MIN
+// sectors and doubles each time it's refilled while the reads stay
+// sequential, up to READAHEAD_MAX sectors
+#define READAHEAD_MIN 2
+#define READAHEAD_MAX 32
+
+// return where the 'size' bytes at 'pos' of the file open at 'of' are
+// in its readahead window, refilling the window if the read is
+// sequential; return NULL if the read should go to the file directly
+static char* readahead(open_file_t* of, inode_t* file, int pos, int size)
+{
+  int sequential = (pos == of->ra_next);
+  of->ra_next = pos+size;
+
+  if(of->ra_buf && of->ra_gen == fs->inode_gen[of->inode] &&
+     pos >= of->ra_start && pos+size <= of->ra_start+of->ra_len) {
+    __atomic_fetch_add(&fs->stats.readahead_hits, 1, __ATOMIC_RELAXED);
+    return of->ra_buf+(pos-of->ra_start);
+  }
+  if(!sequential) {
+    of->ra_sectors = 0;
+    return NULL;
+  }
+
+  // read the window from the first sector of the read, enough for the
+  // whole read but no further than the end of the file
+  of->ra_sectors = of->ra_sectors ? 2*of->ra_sectors : READAHEAD_MIN;
+  if(of->ra_sectors > READAHEAD_MAX) of->ra_sectors = READAHEAD_MAX;
+  int start = pos/fs->geo.sector_size;
+  int n = (pos+size-1)/fs->geo.sector_size-start+1;
+  if(n > READAHEAD_MAX) return NULL; // big reads are fine as they are
+  if(n < of->ra_sectors) n = of->ra_sectors;
+  if(start+n > (file->size+fs->geo.sector_size-1)/fs->geo.sector_size)
+    n = (file->size+fs->geo.sector_size-1)/fs->geo.sector_size-start;
+
+  if(!of->ra_buf && !(of->ra_buf = (char*)malloc(READAHEAD_MAX*fs->geo.sector_size)))
+    return NULL;
+  disk_iovec_t iov[READAHEAD_MAX];
+  int sectors[READAHEAD_MAX];
+  if(block_map(file, start, n, sectors) < 0) return NULL;
+  for(int i=0; i<n; i++) {
+    iov[i].sector = sectors[i];
+    iov[i].buffer = of->ra_buf+i*fs->geo.sector_size;
+  }
+  of->ra_len = 0;
+  if(cache_readv(iov, n) < 0) return NULL;
+  of->ra_start = start*fs->geo.sector_size;
+  of->ra_len = file->size-of->ra_start;
+  if(of->ra_len > n*fs->geo.sector_size) of->ra_len = n*fs->geo.sector_size;
+  of->ra_gen = fs->inode_gen[of->inode];
+  __atomic_fetch_add(&fs->stats.readahead_fills, 1, __ATOMIC_RELAXED);
+  dprintf("... readahead of %d sectors at offset %d\n", n, of->ra_start);
+  return of->ra_buf+(pos-of->ra_start);
+}
+
+// file data is moved between the user's buffers and the sectors of
+// the file in batches of up to IO_BATCH sectors; the sectors that
+// can't go straight to or from the user's buffers (the partial ones at
+// either end of a request, or one split across two of the buffers) are
+// bounced through a buffer on the stack, which has room for IO_BOUNCE
+// of them, and a batch ends early when it's full
+#define IO_BATCH 32
+#define IO_BOUNCE 2
+
+// a position in a list of user buffers
+typedef struct _iov_cursor {
+  const struct iovec* iov;
+  int seg;    // the current buffer
+  size_t off; // and the position in it
+} iov_cursor_t;
+
+// return the total size of the list of user buffers, or -1 if the list
+// is no good (or too big)
+static int iov_total(const struct iovec* iov, int iovcnt)
+{
+  if(iovcnt < 0 || (iovcnt > 0 && iov == NULL)) return -1;
+  long total = 0;
+  for(int i=0; i<iovcnt; i++) {
+    if(iov[i].iov_len > 0 && iov[i].iov_base == NULL) return -1;
+    total += iov[i].iov_len;
+    if(iov[i].iov_len > INT_MAX || total > INT_MAX) return -1;
+  }
+  return (int)total;
+}
+
+// if the next 'len' bytes of the user buffers are all in one of them,
+// move past them and return where they are; NULL otherwise
+static char* iov_span(iov_cursor_t* c, int len)
+{
+  while(c->off == c->iov[c->seg].iov_len) { c->seg++; c->off = 0; }
+  if(c->iov[c->seg].iov_len-c->off < len) return NULL;
+  char* p = (char*)c->iov[c->seg].iov_base+c->off;
+  c->off += len;
+  return p;
+}
+
+// copy 'len' bytes from buf to the next of the user buffers ('out'),
+// or the other way round, and move past them (buf NULL just moves)
+static void iov_copy(iov_cursor_t* c, char* buf, int len, int out)
+{
+  while(len > 0) {
+    if(c->off == c->iov[c->seg].iov_len) { c->seg++; c->off = 0; continue; }
+    int n = c->iov[c->seg].iov_len-c->off;
+    if(n > len) n = len;
+    char* p = (char*)c->iov[c->seg].iov_base+c->off;
+    if(buf && out) memcpy(p, buf, n);
+    else if(buf) memcpy(buf, p, n);
+    if(buf) buf += n;
+    c->off += n;
+    len -= n;
+  }
+}
+
+// read 'size' bytes of the file at the given position (all within
+// the file) into the list of user buffers; return 0 if successful, -1
+// otherwise (with osErrno set)
+static int file_readv_at(int fileNode, int startingPos, const struct iovec* uiov, int size)
+{
+	inode_t* file = getNode(fileNode);
+	iov_cursor_t cur = { uiov, 0, 0 };
+	disk_iovec_t iov[IO_BATCH];
+	char bounce[IO_BOUNCE][MAX_SECTOR_SIZE];
+	iov_cursor_t at[IO_BOUNCE]; // where the bounced sectors go
+	int slot[IO_BATCH], lo[IO_BATCH], hi[IO_BATCH], sectors[IO_BATCH];
+
+	int i = startingPos / fs->geo.sector_size; // first sector read
+	int end = (startingPos + size - 1) / fs->geo.sector_size; // last sector read
+	while(i <= end) {
+		// collect the sectors covering the request; whole sectors are
+		// read straight into the caller's buffers (so runs of them are
+		// copied at once), only partial ones need bouncing
+		int k, count = 0, nb = 0;
+		if(block_map(file, i, (end - i + 1 < IO_BATCH) ? end - i + 1 : IO_BATCH, sectors) < 0)
+			return -1;
+		for(; i <= end && count < IO_BATCH; i++, count++) {
+			lo[count] = (i * fs->geo.sector_size < startingPos) ? startingPos - i * fs->geo.sector_size : 0; // first byte wanted
+			hi[count] = (i == end) ? (startingPos + size - 1) % fs->geo.sector_size + 1 : fs->geo.sector_size; // and one past the last
+			iov[count].sector = sectors[count];
+			slot[count] = -1;
+			if(lo[count] == 0 && hi[count] == fs->geo.sector_size &&
+			   (iov[count].buffer = iov_span(&cur, fs->geo.sector_size)))
+				continue;
+			if(nb == IO_BOUNCE)
+				break;
+			slot[count] = nb;
+			iov[count].buffer = bounce[nb];
+			at[nb++] = cur;
+			iov_copy(&cur, NULL, hi[count] - lo[count], 0);
+		}
+		if(cache_readv(iov, count) < 0) {
+			dprintf("Error\n");
+			osErrno = E_GENERAL;
+			return -1;
+		}
+
+		// and copy out the wanted parts of the partial sectors
+		for(k = 0; k < count; k++)
+			if(slot[k] >= 0)
+				iov_copy(&at[slot[k]], bounce[slot[k]] + lo[k], hi[k] - lo[k], 1);
+	}
+	return 0;
+}
+
+// read 'size' bytes of the file at the given position (all within
+// the file) into data; return 0 if successful, -1 otherwise
+static int file_read_at(int fileNode, int startingPos, char* data, int size)
+{
+  struct iovec v = { data, size };
+  return file_readv_at(fileNode, startingPos, &v, size);
+}
+
+// write 'size' bytes from the list of user buffers into the file at
+// the given position, allocating the sectors it grows into; the
+// position must be within the file; return 0 if successful, -1
+// otherwise (with osErrno set)
+static int file_writev_at(int fileNode, int startingPos, const struct iovec* uiov, int size)
+{
+	inode_t* inode = getNode(fileNode);
+	iov_cursor_t cur = { uiov, 0, 0 };
+	disk_iovec_t iov[IO_BATCH];
+	char bounce[IO_BOUNCE][MAX_SECTOR_SIZE];
+	int sectors[IO_BATCH];
+
+	int start = startingPos / fs->geo.sector_size; // first sector written
+	int end = (startingPos + size - 1) / fs->geo.sector_size; // last sector written
+	int i, k, n;
+
+	// files have no holes, so the sectors still missing are the ones
+	// past the end of the file (the file may have a few more than its
+	// size takes, from a write that ran out of space); allocate them in
+	// as few runs as the free space allows, each run continuing right
+	// after the last
+	int fresh = (inode->size + fs->geo.sector_size - 1) / fs->geo.sector_size; // first sector to allocate
+	int goal = -1; // and where it would best go
+	if(fresh < start) fresh = start;
+	while(fresh <= end) {
+		n = (end - fresh + 1 < IO_BATCH) ? end - fresh + 1 : IO_BATCH;
+		if(block_map(inode, fresh, n, sectors) < 0) return -1;
+		for(k = 0; k < n && sectors[k]; k++)
+			fresh++;
+		if(k < n) break;
+	}
+	if(fresh <= end && fresh > 0) {
+		if(block_map(inode, fresh - 1, 1, &goal) < 0) return -1;
+		goal++;
+	}
+	for(i = fresh; i <= end; ) {
+		int got, sector = bitmap_alloc_run(&fs->sector_bitmap, goal, end - i + 1, &got);
+		if(sector < 0) {
+			// keep whatever got allocated so far with the file
+			osErrno = E_NO_SPACE;
+			return -1;
+		}
+		for(; got > 0; got--, sector++, i++) {
+			if(block_set(fileNode, i, sector) < 0) {
+				// and give back the rest of the run
+				while(got-- > 0) bitmap_reset(&fs->sector_bitmap, sector++);
+				return -1;
+			}
+		}
+		goal = sector;
+	}
+
+	fs->inode_gen[fileNode]++; // readahead of the old contents is stale
+	for(i = start; i <= end; ) {
+		// collect the sectors to write; whole sectors are written
+		// straight from the caller's buffers, others are merged
+		int count = 0, nb = 0;
+		if(block_map(inode, i, (end - i + 1 < IO_BATCH) ? end - i + 1 : IO_BATCH, sectors) < 0)
+			return -1;
+		for(; i <= end && count < IO_BATCH; i++, count++) {
+			int lo = (i == start) ? startingPos % fs->geo.sector_size : 0; // first byte written in the sector
+			int hi = (i == end) ? (startingPos + size - 1) % fs->geo.sector_size + 1 : fs->geo.sector_size; // and one past the last
+			iov[count].sector = sectors[count];
+			if(lo == 0 && hi == fs->geo.sector_size &&
+			   (iov[count].buffer = iov_span(&cur, fs->geo.sector_size)))
+				continue;
+			if(nb == IO_BOUNCE)
+				break;
+			char* b = bounce[nb++];
+			if(lo > 0 || hi < fs->geo.sector_size) {
+				if(i >= fresh) memset(b, 0, fs->geo.sector_size);
+				else if(cache_read(sectors[count], b) < 0) {
+					osErrno = E_GENERAL;
+					return -1;
+				}
+			}
+			iov_copy(&cur, b + lo, hi - lo, 0);
+			iov[count].buffer = b;
+		}
+		if(cache_writev(iov, count) < 0) {
+			osErrno = E_GENERAL;
+			return -1;
+		}
+	}
 
-  // get the disk sector containing the parent inode
-  inode_sector = INODE_TABLE_START_SECTOR+parent_inode/INODES_PER_SECTOR;
-  if(Disk_Read(inode_sector, inode_buffer) < 0) return -1;
-  dprintf("... load inode table for parent inode %d from disk sector %d\n",
-	 parent_inode, inode_sector);
+	// the file may have grown
+	if(startingPos + size > inode->size)
+		inode->size = startingPos + size;
+	inode_dirty(fileNode);
 
-  // get the parent inode
-  inode_start_entry = (inode_sector-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
-  offset = parent_inode-inode_start_entry;
-  assert(0 <= offset && offset < INODES_PER_SECTOR);
-  inode_t* parent = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
-  dprintf("... get parent inode %d (size=%d, type=%d)\n",
-	 parent_inode, parent->size, parent->type);
+	return 0;
+}
 
-  // get the dirent sector
-  if(parent->type != 1) {
-    dprintf("... error: parent inode is not directory\n");
-    return -2; // parent not directory
-  }
-  int group = parent->size/DIRENTS_PER_SECTOR;
-  char dirent_buffer[SECTOR_SIZE];
-  if(group*DIRENTS_PER_SECTOR == parent->size) {
-    // new disk sector is needed
-    int newsec = bitmap_first_unused(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, SECTOR_BITMAP_SIZE);
-    if(newsec < 0) {
-      dprintf("... error: disk is full\n");
-      return -1;
-    }
-    parent->data[group] = newsec;
-    memset(dirent_buffer, 0, SECTOR_SIZE);
-    dprintf("... new disk sector %d for dirent group %d\n", newsec, group);
-  } else {
-    if(Disk_Read(parent->data[group], dirent_buffer) < 0)
-      return -1;
-    dprintf("... load disk sector %d for dirent group %d\n", parent->data[group], group);
-  }
+// write 'size' bytes of data into the file at the given position (as
+// file_writev_at() does); return 0 if successful, -1 otherwise
+static int file_write_at(int fileNode, int startingPos, char* data, int size)
+{
+  struct iovec v = { data, size };
+  return file_writev_at(fileNode, startingPos, &v, size);
+}
 
-  // add the dirent and write to disk
-  int start_entry = group*DIRENTS_PER_SECTOR;
-  offset = parent->size-start_entry;
-  dirent_t* dirent = (dirent_t*)(dirent_buffer+offset*sizeof(dirent_t));
-  strncpy(dirent->fname, file, MAX_NAME);
-  dirent->inode = child_inode;
-  if(Disk_Write(parent->data[group], dirent_buffer) < 0) return -1;
-  dprintf("... append dirent %d (name='%s', inode=%d) to group %d, update disk sector %d\n",
-	  parent->size, dirent->fname, dirent->inode, group, parent->data[group]);
+// small writes on an fd are gathered in its write-behind buffer, which
+// holds the bytes written from 'wb_start' on; when it fills up, only
+// the whole sectors in it are written out, keeping the partial last
+// sector for the writes to come; the rest is written out on
+// File_Seek(), File_Close(), and FS_Sync(), and before the file is
+// read; the buffers are guarded by the inode lock rather than the fd's
+// own, since a call on one fd writes out those of all the fds open on
+// the same inode; the buffers of different fds on an inode never
+// overlap (a write overlapping another fd's buffer has it written out
+// first), and they're listed, and written out, in the order they were
+// started
+#define WRITEBEHIND_SECTORS 16
+#define WRITEBEHIND_MAX ((WRITEBEHIND_SECTORS-1)*fs->geo.sector_size) // largest write gathered
+
+// write out the buffered writes of the fd at 'of': all of them, or
+// (unless 'all') only up to the last whole sector; return 0 if
+// successful, -1 otherwise (with osErrno set)
+static int writebehind_flush(open_file_t* of, int all)
+{
+  if(of->wb_len == 0) return 0;
+  int n = all ? of->wb_len : (of->wb_start+of->wb_len)/fs->geo.sector_size*fs->geo.sector_size-of->wb_start;
+  if(n <= 0) return 0;
+
+  // the sectors allocated come out of those reserved for the fd
+  wb_allowance = of->wb_reserved;
+  int status = file_write_at(of->inode, of->wb_start, of->wb_buf, n);
+  of->wb_reserved = wb_allowance;
+  wb_allowance = 0;
+  if(status < 0) return -1;
+  memmove(of->wb_buf, of->wb_buf+n, of->wb_len-n);
+  of->wb_start += n;
+  of->wb_len -= n;
+  if(of->wb_len == 0) writebehind_unlist(of);
+  return 0;
+}
 
-  // update parent inode and write to disk
-  parent->size++;
-  if(Disk_Write(inode_sector, inode_buffer) < 0) return -1;
-  dprintf("... update parent inode on disk sector %d\n", inode_sector);
-  
+static int writebehind_sync(int inode)
+{
+  while(fs->writebehind_fds[inode])
+    if(writebehind_flush(fs->writebehind_fds[inode], 1) < 0) return -1;
   return 0;
 }
 
-// used by both File_Create() and Dir_Create(); type=0 is file, type=1
-// is directory
-int create_file_or_directory(int type, char* pathname)
+// gather the write of 'size' bytes from the list of user buffers at
+// the current position of the fd at 'of'; return 0 if successful, -1
+// otherwise (with osErrno set)
+static int writebehind(open_file_t* of, const struct iovec* iov, int size)
 {
-  int child_inode;
-  char last_fname[MAX_NAME];
-  int parent_inode = follow_path(pathname, &child_inode, last_fname);
-  if(parent_inode >= 0) {
-    if(child_inode >= 0) {
-      dprintf("... file/directory '%s' already exists, failed to create\n", pathname);
-      osErrno = E_CREATE;
+  // the older writes of other fds to the same bytes go first
+  for(open_file_t* o = fs->writebehind_fds[of->inode]; o; ) {
+    open_file_t* next = o->wb_next;
+    if(o != of && o->wb_start < of->pos+size && of->pos < o->wb_start+o->wb_len &&
+       writebehind_flush(o, 1) < 0)
       return -1;
-    } else {
-      if(add_inode(type, parent_inode, last_fname) >= 0) {
-	dprintf("... successfully created file/directory: '%s'\n", pathname);
-	return 0;
-      } else {
-	dprintf("... error: something wrong with adding child inode\n");
-	osErrno = E_CREATE;
-	return -1;
-      }
-    }
-  } else {
-    dprintf("... error: something wrong with the file/path: '%s'\n", pathname);
-    osErrno = E_CREATE;
+    o = next;
+  }
+  if(of->wb_len+size > WRITEBEHIND_SECTORS*fs->geo.sector_size && writebehind_flush(of, 0) < 0)
+    return -1;
+  if(!of->wb_buf && !(of->wb_buf = (char*)malloc(WRITEBEHIND_SECTORS*fs->geo.sector_size))) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  if(of->wb_len == 0) of->wb_start = of->pos;
+
+  // the sectors the buffer will need that the file doesn't have yet
+  // (and the indirect blocks for them) are reserved, so that they're
+  // there when it's written out, whatever other writes come meanwhile
+  inode_t* inode = getNode(of->inode);
+  int sectors[WRITEBEHIND_SECTORS+1];
+  int first = of->wb_start/fs->geo.sector_size;
+  int n = (of->wb_start+of->wb_len+size-1)/fs->geo.sector_size-first+1;
+  if(block_map(inode, first, n, sectors) < 0) return -1;
+  int have = 0;
+  while(have < n && sectors[have]) have++;
+  int need = n-have;
+  if(need > 0) need += indirect_blocks(first+n)-indirect_blocks(first+have);
+  bitmap_t* bm = &fs->sector_bitmap;
+  pthread_mutex_lock(&fs->alloc_lock);
+  if(bitmap_avail(bm) < need-of->wb_reserved) bitmap_reclaim(bm);
+  if(bitmap_avail(bm) < need-of->wb_reserved) {
+    pthread_mutex_unlock(&fs->alloc_lock);
+    osErrno = E_NO_SPACE;
     return -1;
   }
+  bm->reserved += need-of->wb_reserved;
+  pthread_mutex_unlock(&fs->alloc_lock);
+  of->wb_reserved = need;
+
+  iov_cursor_t cur = { iov, 0, 0 };
+  iov_copy(&cur, of->wb_buf+of->wb_len, size, 0);
+  if(of->wb_len == 0) {
+    open_file_t** link = &fs->writebehind_fds[of->inode];
+    while(*link) link = &(*link)->wb_next;
+    of->wb_next = NULL;
+    *link = of;
+  }
+  of->wb_len += size;
+  return 0;
 }
 
-// returns specific node
-inode_t* getNode(int childNode) {
-	int sector = INODE_TABLE_START_SECTOR + (childNode / INODES_PER_SECTOR); 
-  	char buffer[SECTOR_SIZE]; 
+// write out the buffered writes of all fds (with the whole file system
+// locked); return 0 if successful, -1 otherwise (with osErrno set)
+static int writebehind_sync_all()
+{
+  for(int fd=0; fd<fs->open_files_top; fd++)
+    if(OPEN_FILE(fd)->inode > 0 && writebehind_flush(OPEN_FILE(fd), 1) < 0) return -1;
+  return 0;
+}
 
-  	Disk_Read(sector, buffer); 
+// a file system booted from the socket of fsd is served by the daemon
+// (see fsd.h): each call is sent to it and its reply waited for, one
+// call at a time
 
-  	int childLocation = childNode - ((sector - INODE_TABLE_START_SECTOR) * INODES_PER_SECTOR); 
-  	inode_t* child = (inode_t*)(buffer + childLocation * sizeof(inode_t));
-  
-	return child;
+// send (if 'out' is set) or receive exactly 'len' bytes on the socket;
+// return 0 if successful, -1 if the connection failed
+static int server_io(int sock, void* buf, int len, int out)
+{
+  char* p = (char*)buf;
+  while(len > 0) {
+    ssize_t n = out ? send(sock, p, len, MSG_NOSIGNAL) : recv(sock, p, len, 0);
+    if(n < 0 && errno == EINTR) continue;
+    if(n <= 0) return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
 }
 
+// make a call on the server, sending 'outlen' bytes from 'out' along
+// with it, and putting up to 'inlen' bytes of the reply in 'in'; return
+// what the call returned, with osErrno set if it failed
+static int server_call(int op, int a0, int a1, int a2, const void* out, int outlen,
+		       void* in, int inlen)
+{
+  fsd_request_t req = { op, { a0, a1, a2 }, outlen > 0 ? outlen : 0 };
+  fsd_reply_t rep;
+  pthread_mutex_lock(&fs->server_lock);
+  int ok = server_io(fs->server, &req, sizeof(req), 1) == 0 &&
+    server_io(fs->server, (void*)out, req.len, 1) == 0 &&
+    server_io(fs->server, &rep, sizeof(rep), 0) == 0 &&
+    rep.len >= 0 && rep.len <= (inlen > 0 ? inlen : 0) &&
+    server_io(fs->server, in, rep.len, 0) == 0;
+  pthread_mutex_unlock(&fs->server_lock);
+  if(!ok) {
+    dprintf("... lost the connection to the server\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  if(rep.ret < 0) osErrno = rep.err;
+  return rep.ret;
+}
 
-// remove the child from parent; the function is called by both
-// File_Unlink() and Dir_Unlink(); the function returns 0 if success,
-// -1 if general error, -2 if directory not empty, -3 if wrong type
-int remove_inode(int type, int parent_inode, int child_inode) { //Made by: Stephan Belizaire
-
-	int i, j, k;
-	char buffer[SECTOR_SIZE];
-	inode_t* child = getNode(child_inode);  //grabs the child node
-	inode_t* parent = getNode(parent_inode); //grabs the parent node
+// the number of bytes of a path sent to the server (none for NULL)
+static int path_len(char* path)
+{
+  return path ? strlen(path)+1 : 0;
+}
 
-	if(type == 0) { //checks if this is a file
+// connect to the server listening on the socket; return 0 if
+// successful, -1 otherwise
+static int server_connect(char* sockname)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(strlen(sockname) >= sizeof(addr.sun_path)) return -1;
+  strcpy(addr.sun_path, sockname);
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(sock < 0) return -1;
+  if(connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    close(sock);
+    return -1;
+  }
+  fs->server = sock;
+  return 0;
+}
 
-		for(i = 0; i < 30; i++) {
-			int childSector = (unsigned char)child->data[i];
-			
-			if(childSector != 0) {		
-				memset(buffer, 0, SECTOR_SIZE); 
-				Disk_Write(childSector, buffer); 
-				bitmap_reset(2, 3, childSector + 1); 
-			}
-		}
-		bitmap_reset(1, 1, child_inode + 1); 
-
-		for(j = 0; j < 30; j++) {
-			int parentSector = parent->data[j];
-			char sectorBuffer[SECTOR_SIZE];
-
-			Disk_Read(parentSector, sectorBuffer); 
-
-			for(k = 0; k < 25; k++) {
-				dirent_t * data = (dirent_t*)(sectorBuffer + (k * 20)); 
-				
-				if(data->inode == child_inode) {
-					memset(data, 0, sizeof(dirent_t));
-					Disk_Write(parentSector, sectorBuffer);
-					return 0;
-				}				
-			}
-		}
-		
-		return 0;
+// the vectored calls go to the server as plain reads and writes, through
+// a buffer of their own unless there's just the one
+static int server_readv(int fd, const struct iovec* iov, int iovcnt)
+{
+  int size = iov_total(iov, iovcnt);
+  if(size < 0) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  if(iovcnt == 1) return server_call(FSD_READ, fd, size, 0, NULL, 0, iov[0].iov_base, size);
+  char* buf = (char*)malloc(size);
+  if(!buf) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  int n = server_call(FSD_READ, fd, size, 0, NULL, 0, buf, size);
+  if(n > 0) {
+    iov_cursor_t c = { iov, 0, 0 };
+    iov_copy(&c, buf, n, 1);
+  }
+  free(buf);
+  return n;
+}
 
-	} else if(type == 1) {  //Checks if this is a directory
+static int server_writev(int fd, const struct iovec* iov, int iovcnt)
+{
+  int size = iov_total(iov, iovcnt);
+  if(size < 0) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  if(iovcnt == 1) return server_call(FSD_WRITE, fd, size, 0, iov[0].iov_base, size, NULL, 0);
+  char* buf = (char*)malloc(size);
+  if(!buf) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  iov_cursor_t c = { iov, 0, 0 };
+  iov_copy(&c, buf, size, 0);
+  int n = server_call(FSD_WRITE, fd, size, 0, buf, size, NULL, 0);
+  free(buf);
+  return n;
+}
 
-		for(j = 0; j < 30; j++) {
-			int parentSector = parent->data[j];
-			char sectorBuffer[SECTOR_SIZE];
+/* end of internal helper functions, start of API functions */
 
-			Disk_Read(parentSector, sectorBuffer); 
+// lay out a new file system on the (zero-filled) disk: superblock,
+// bitmaps, and an inode table holding only the root directory; return
+// 0 if successful, -1 otherwise
+static int format_disk()
+{
+  // format superblock
+  char buf[MAX_SECTOR_SIZE];
+  memset(buf, 0, fs->geo.sector_size);
+  superblock_t* sb = (superblock_t*)buf;
+  sb->magic = OS_MAGIC;
+  sb->sector_size = fs->geo.sector_size;
+  sb->total_sectors = fs->geo.total_sectors;
+  sb->max_files = fs->geo.max_files;
+  sb->journal_sectors = fs->geo.journal_sectors;
+  if(cache_write(SUPERBLOCK_START_SECTOR, buf) < 0) {
+    dprintf("... failed to format superblock\n");
+    return -1;
+  }
+  dprintf("... formatted superblock (sector %d)\n", SUPERBLOCK_START_SECTOR);
 
-			for(k = 0; k < 25; k++) {
-				dirent_t * data = (dirent_t*)(sectorBuffer + (k * 20)); 
-				
-				if(data->inode == child_inode){
-					memset(data, 0, sizeof(dirent_t));
-					Disk_Write(parentSector, sectorBuffer);
-					return 0;
-				}				
-			}
-		}
+  // format inode bitmap (reserve the first inode to root)
+  if(bitmap_init(&fs->inode_bitmap, INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS,
+		 fs->geo.max_files, 1) < 0) {
+    dprintf("... failed to format inode bitmap\n");
+    return -1;
+  }
+  dprintf("... formatted inode bitmap (start=%d, num=%d)\n",
+	 (int)INODE_BITMAP_START_SECTOR, (int)INODE_BITMAP_SECTORS);
+      
+  // format sector bitmap (reserve the first few sectors to
+  // superblock, inode bitmap, sector bitmap, inode table, and journal)
+  if(bitmap_init(&fs->sector_bitmap, SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS,
+		 fs->geo.total_sectors, DATABLOCK_START_SECTOR) < 0) {
+    dprintf("... failed to format sector bitmap\n");
+    return -1;
+  }
+  dprintf("... formatted sector bitmap (start=%d, num=%d)\n",
+	 (int)SECTOR_BITMAP_START_SECTOR, (int)SECTOR_BITMAP_SECTORS);
+      
+  // format inode tables (written out with the rest on the first sync)
+  if(inode_table_init() < 0) {
+    dprintf("... failed to format inode table\n");
+    return -1;
+  }
+  dprintf("... formatted inode table (start=%d, num=%d)\n",
+	 (int)INODE_TABLE_START_SECTOR, (int)INODE_TABLE_SECTORS);
+  return 0;
+}
 
-		return 0;
+// write everything the file system keeps in memory back to the disk
+// (this doesn't sync the disk with its backstore file); return 0 if
+// successful, -1 otherwise
+static int flush_all()
+{
+  if(inode_table_flush() < 0) return -1;
+  if(bitmap_flush(&fs->inode_bitmap) < 0) return -1;
+  if(bitmap_flush(&fs->sector_bitmap) < 0) return -1;
+  return cache_flush();
+}
 
-	} else if(type<=-1){ //Checks if wrong type
-		return -3; 
-	}
+// the journal is only written with the whole file system locked (but
+// the sectors changed are noted in cache_put())
 
-  	return -1;
+// forget the metadata changed so far, and have the changes from now on
+// noted if the disk has a journal; return 0 if successful, -1 otherwise
+static int journal_reset()
+{
+  free(fs->meta);
+  free(fs->freed);
+  free(fs->reused);
+  fs->meta = fs->freed = fs->reused = NULL;
+  if(fs->geo.journal_sectors == 0) return 0;
+  fs->meta = (uint64_t*)calloc((fs->geo.total_sectors+63)/64, sizeof(uint64_t));
+  fs->freed = (uint64_t*)calloc((fs->geo.total_sectors+63)/64, sizeof(uint64_t));
+  fs->reused = (uint64_t*)calloc((fs->geo.total_sectors+63)/64, sizeof(uint64_t));
+  return fs->meta && fs->freed && fs->reused ? 0 : -1;
 }
 
-// representing an open file
-typedef struct _open_file {
-  int inode; // pointing to the inode of the file (0 means entry not used)
-  int size;  // file size cached here for convenience
-  int pos;   // read/write position
-} open_file_t;
-static open_file_t open_files[MAX_OPEN_FILES];
+// return the checksum (FNV-1a) of the bytes, going on from 'sum'
+static uint32_t journal_sum(uint32_t sum, const char* p, int len)
+{
+  for(int i=0; i<len; i++) sum = (sum ^ (unsigned char)p[i])*16777619u;
+  return sum;
+}
 
-// return true if the file pointed to by inode has already been open
-int is_file_open(int inode)
+// write the journal header, saying the log starts at the next
+// transaction (it's on the disk after the next Disk_Sync()); return 0
+// if successful, -1 otherwise
+static int journal_write_header()
 {
-	int i;
-	for(i = 0; i < MAX_OPEN_FILES; i++) {
-		if(open_files[i].inode == inode)
-    		return 1;
-  	}
-  	return 0;
+  char buf[MAX_SECTOR_SIZE];
+  memset(buf, 0, fs->geo.sector_size);
+  journal_header_t* h = (journal_header_t*)buf;
+  h->magic = JOURNAL_MAGIC;
+  h->seq = fs->journal_seq;
+  h->tail = fs->journal_head;
+  return Disk_Write(JOURNAL_START_SECTOR, buf);
 }
 
-// return a new file descriptor not used; -1 if full
-int new_file_fd()
+// read the log block in the slot into the buffer and check that it's a
+// whole block of the given transaction: the sectors it holds copies of
+// are all outside the journal, the copies fit in the 'room' slots left
+// to look at, and its checksum is right; return 1 if it is, 0 if not
+static int journal_read_block(int slot, int seq, int room, char* buf)
 {
-  for(int i=0; i<MAX_OPEN_FILES; i++) {
-    if(open_files[i].inode <= 0)
-      return i;
+  journal_desc_t* d = (journal_desc_t*)buf;
+  if(Disk_Read(JOURNAL_SLOT_SECTOR(slot), buf) < 0) return 0;
+  if(d->magic != JOURNAL_MAGIC || d->seq != seq ||
+     d->count < 0 || d->count > JOURNAL_PER_DESC || d->count >= room)
+    return 0;
+  uint32_t sum = d->sum;
+  d->sum = 0;
+  uint32_t check = journal_sum(2166136261u, buf, fs->geo.sector_size);
+  d->sum = sum;
+  for(int k=0; k<d->count; k++) {
+    if(d->sectors[k] < 0 || d->sectors[k] >= fs->geo.total_sectors ||
+       (d->sectors[k] >= JOURNAL_START_SECTOR && d->sectors[k] < DATABLOCK_START_SECTOR))
+      return 0;
+    const char* copy = Disk_Addr(JOURNAL_SLOT_SECTOR((slot+1+k)%JOURNAL_SLOTS));
+    if(!copy) return 0;
+    check = journal_sum(check, copy, fs->geo.sector_size);
   }
-  return -1;
+  return check == sum;
 }
 
-/* end of internal helper functions, start of API functions */
-
-int FS_Boot(char* backstore_fname)
+// replay the transactions committed to the journal but maybe not all
+// written back in place when the file system was last used: each one
+// found whole, from the start of the log on, is copied to its place
+// and synced; return 0 if successful, -1 otherwise
+static int journal_replay()
 {
-  dprintf("FS_Boot('%s'):\n", backstore_fname);
-  // initialize a new disk (this is a simulated disk)
-  if(Disk_Init() < 0) {
-    dprintf("... disk init failed\n");
-    osErrno = E_GENERAL;
+  char buf[MAX_SECTOR_SIZE];
+  journal_header_t* h = (journal_header_t*)buf;
+  if(Disk_Read(JOURNAL_START_SECTOR, buf) < 0 || h->magic != JOURNAL_MAGIC ||
+     h->tail < 0 || h->tail >= JOURNAL_SLOTS) {
+    dprintf("... bad journal header\n");
     return -1;
   }
-  dprintf("... disk initialized\n");
-  
-  // we should copy the filename down; if not, the user may change the
-  // content pointed to by 'backstore_fname' after calling this function
-  strncpy(bs_filename, backstore_fname, 1024);
-  bs_filename[1023] = '\0'; // for safety
-  
-  // we first try to load disk from this file
-  if(Disk_Load(bs_filename) < 0) {
-    dprintf("... load disk from file '%s' failed\n", bs_filename);
-
-    // if we can't open the file; it means the file does not exist, we
-    // need to create a new file system on disk
-    if(diskErrno == E_OPENING_FILE) {
-      dprintf("... couldn't open file, create new file system\n");
-
-      // format superblock
-      char buf[SECTOR_SIZE];
-      memset(buf, 0, SECTOR_SIZE);
-      *(int*)buf = OS_MAGIC;
-      if(Disk_Write(SUPERBLOCK_START_SECTOR, buf) < 0) {
-	dprintf("... failed to format superblock\n");
-	osErrno = E_GENERAL;
-	return -1;
+  fs->journal_seq = h->seq;
+  fs->journal_tail = fs->journal_head = h->tail;
+
+  // look for the end of the last transaction committed, and replay
+  // each one as its commit block is found
+  journal_desc_t* d = (journal_desc_t*)buf;
+  int slot = fs->journal_head, seen = 0, replayed = 0;
+  while(journal_read_block(slot, fs->journal_seq, JOURNAL_SLOTS-seen, buf)) {
+    seen += 1+d->count;
+    slot = (slot+1+d->count)%JOURNAL_SLOTS;
+    if(!d->commit) continue;
+    for(int s=fs->journal_head; s!=slot; ) {
+      if(Disk_Read(JOURNAL_SLOT_SECTOR(s), buf) < 0) return -1;
+      for(int k=0; k<d->count; k++) {
+	if(Disk_Write(d->sectors[k], (char*)Disk_Addr(JOURNAL_SLOT_SECTOR((s+1+k)%JOURNAL_SLOTS))) < 0)
+	  return -1;
       }
-      dprintf("... formatted superblock (sector %d)\n", SUPERBLOCK_START_SECTOR);
+      s = (s+1+d->count)%JOURNAL_SLOTS;
+    }
+    fs->journal_head = slot;
+    fs->journal_seq++;
+    replayed++;
+  }
 
-      // format inode bitmap (reserve the first inode to root)
-      bitmap_init(INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, 1);
-      dprintf("... formatted inode bitmap (start=%d, num=%d)\n",
-	     (int)INODE_BITMAP_START_SECTOR, (int)INODE_BITMAP_SECTORS);
-      
-      // format sector bitmap (reserve the first few sectors to
-      // superblock, inode bitmap, sector bitmap, and inode table)
-      bitmap_init(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS,
-		  DATABLOCK_START_SECTOR);
-      dprintf("... formatted sector bitmap (start=%d, num=%d)\n",
-	     (int)SECTOR_BITMAP_START_SECTOR, (int)SECTOR_BITMAP_SECTORS);
-      
-      // format inode tables
-      for(int i=0; i<INODE_TABLE_SECTORS; i++) {
-	memset(buf, 0, SECTOR_SIZE);
-	if(i==0) {
-	  // the first inode table entry is the root directory
-	  ((inode_t*)buf)->size = 0;
-	  ((inode_t*)buf)->type = 1;
-	}
-	if(Disk_Write(INODE_TABLE_START_SECTOR+i, buf) < 0) {
-	  dprintf("... failed to format inode table\n");
-	  osErrno = E_GENERAL;
+  // the log stays as it is until the next transaction is written (a
+  // transaction replayed again is harmless), but its changes have to
+  // be on the disk by then
+  dprintf("... replayed %d transactions from the journal\n", replayed);
+  if(replayed && Disk_Sync() < 0) return -1;
+  return 0;
+}
+
+// write the metadata changed since the last sync through the journal:
+// the sectors (and those reused early) are held back while the file
+// data written goes to the disk, then their copies go to the log, and
+// only once that's synced they're let go and written in place, with
+// another sync (so that the metadata never points at data that isn't
+// there, and a crash halfway leaves either the old metadata or a whole
+// transaction to replay); more sectors than the log has room for are
+// written as several transactions, one after the other, each of them
+// logged and then written in place before the next (so a crash between
+// them leaves the first ones done, in sector order: bitmaps, inodes,
+// then directories and indirect blocks), with the sectors reused held
+// back till the last one; return 0 if successful, -1 otherwise
+static int journal_commit()
+{
+  int n = 0, per = JOURNAL_PER_DESC, words = (fs->geo.total_sectors+63)/64;
+  for(int w=0; w<words; w++) n += __builtin_popcountll(fs->meta[w]);
+  if(n == 0) {
+    memset(fs->reused, 0, words*sizeof(uint64_t));
+    return Disk_Sync();
+  }
+
+  // the data, and the header moved past the transaction of the last
+  // sync (which is all in place by now), so the whole log is free
+  for(int w=0; w<words; w++) {
+    for(uint64_t bits=fs->meta[w]|fs->reused[w]; bits; bits&=bits-1)
+      Disk_Hold(w*64+__builtin_ctzll(bits));
+  }
+  if((fs->journal_tail != fs->journal_head && journal_write_header() < 0) || Disk_Sync() < 0) {
+    Disk_Release();
+    return -1;
+  }
+  fs->journal_tail = fs->journal_head;
+
+  // the most copies a transaction can have, with their descriptors
+  int room = JOURNAL_SLOTS-(JOURNAL_SLOTS+per)/(per+1);
+  if(n > room) dprintf("... %d sectors changed, written in %d transactions\n", n, (n+room-1)/room);
+
+  char buf[MAX_SECTOR_SIZE];
+  journal_desc_t* d = (journal_desc_t*)buf;
+  int w = 0;
+  uint64_t bits = fs->meta[0];
+  while(n > 0) {
+    // the header moved past the transaction just written in place
+    if(fs->journal_tail != fs->journal_head && journal_write_header() < 0) {
+      Disk_Release();
+      return -1;
+    }
+    fs->journal_tail = fs->journal_head;
+
+    // the blocks of the transaction, with the copies of the sectors
+    int left = n < room ? n : room, slot = fs->journal_head;
+    n -= left;
+    while(left > 0) {
+      memset(buf, 0, fs->geo.sector_size);
+      d->magic = JOURNAL_MAGIC;
+      d->seq = fs->journal_seq;
+      d->count = left < per ? left : per;
+      d->commit = left <= per;
+      for(int k=0; k<d->count; k++) {
+	while(!bits) bits = fs->meta[++w];
+	d->sectors[k] = w*64+__builtin_ctzll(bits);
+	bits &= bits-1;
+      }
+      uint32_t sum = journal_sum(2166136261u, buf, fs->geo.sector_size);
+      for(int k=0; k<d->count; k++) {
+	char* copy = (char*)Disk_Addr(d->sectors[k]);
+	if(!copy || Disk_Write(JOURNAL_SLOT_SECTOR((slot+1+k)%JOURNAL_SLOTS), copy) < 0) {
+	  Disk_Release();
 	  return -1;
 	}
+	sum = journal_sum(sum, copy, fs->geo.sector_size);
       }
-      dprintf("... formatted inode table (start=%d, num=%d)\n",
-	     (int)INODE_TABLE_START_SECTOR, (int)INODE_TABLE_SECTORS);
-      
-      // we need to synchronize the disk to the backstore file (so
-      // that we don't lose the formatted disk)
-      if(Disk_Save(bs_filename) < 0) {
-	// if can't write to file, something's wrong with the backstore
-	dprintf("... failed to save disk to file '%s'\n", bs_filename);
-	osErrno = E_GENERAL;
+      d->sum = sum;
+      if(Disk_Write(JOURNAL_SLOT_SECTOR(slot), buf) < 0) {
+	Disk_Release();
 	return -1;
-      } else {
-	// everything's good now, boot is successful
-	dprintf("... successfully formatted disk, boot successful\n");
-	memset(open_files, 0, MAX_OPEN_FILES*sizeof(open_file_t));
-	return 0;
       }
-    } else {
-      // something wrong loading the file: invalid param or error reading
-      dprintf("... couldn't read file '%s', boot failed\n", bs_filename);
+      slot = (slot+1+d->count)%JOURNAL_SLOTS;
+      left -= d->count;
+    }
+
+    // the log, and then its sectors in place (the ones still to be
+    // logged, and those reused, stay held)
+    if(Disk_Sync() < 0) {
+      Disk_Release();
+      return -1;
+    }
+    fs->journal_head = slot;
+    fs->journal_seq++;
+    Disk_Release();
+    if(n > 0) {
+      for(int v=0; v<words; v++) {
+	uint64_t rest = v < w ? 0 : v == w ? bits : fs->meta[v];
+	for(uint64_t b=rest|fs->reused[v]; b; b&=b-1)
+	  Disk_Hold(v*64+__builtin_ctzll(b));
+      }
+    }
+    if(Disk_Sync() < 0) {
+      Disk_Release();
+      return -1;
+    }
+  }
+  memset(fs->meta, 0, words*sizeof(uint64_t));
+  memset(fs->reused, 0, words*sizeof(uint64_t));
+  return 0;
+}
+
+// open the disk image in the file, mapped if it can be and copied into
+// memory otherwise; if 'create' is set, a new zero-filled image of the
+// disk geometry is made instead; return 0 if successful, -1 otherwise
+// (with diskErrno telling why)
+static int disk_attach(char* file, int create)
+{
+  if(Disk_Open(file, create) == 0) return 0;
+  if(diskErrno != E_MEM_OP) return -1;
+
+  // the file can't be mapped, keep a copy of the disk in memory instead
+  dprintf("... couldn't map file '%s', keep disk in memory\n", file);
+  if(Disk_Init() < 0) return -1;
+  return create ? 0 : Disk_Load(file);
+}
+
+// boot from the disk image in the file; a new file system is formatted
+// with the given geometry if 'format' is set, or with the default one
+// if the file doesn't exist; return 0 if successful, -1 otherwise
+static int boot(char* backstore_fname, fs_geometry_t* format)
+{
+  // we should copy the filename down; if not, the user may change the
+  // content pointed to by 'backstore_fname' after calling this function
+  strncpy(fs->bs_filename, backstore_fname, 1024);
+  fs->bs_filename[1023] = '\0'; // for safety
+
+  // a file system served by fsd is booted by connecting to its socket
+  // (and formatted by the server)
+  struct stat st;
+  if(fs->server >= 0) {
+    close(fs->server);
+    fs->server = -1;
+  }
+  if(stat(fs->bs_filename, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    if(server_connect(fs->bs_filename) < 0) {
+      dprintf("... couldn't connect to server at '%s', boot failed\n", fs->bs_filename);
+      osErrno = E_GENERAL;
+      return -1;
+    }
+    dprintf("... connected to server at '%s'\n", fs->bs_filename);
+    if(!format) return 0;
+    return server_call(FSD_FORMAT, 0, 0, 0, format, sizeof(fs_geometry_t), NULL, 0);
+  }
+
+  // nothing cached from a previous boot is any good now
+  cache_init();
+  dcache_init();
+  free(fs->meta);
+  free(fs->freed);
+  free(fs->reused);
+  fs->meta = fs->freed = fs->reused = NULL;
+
+  // we first try to map the disk from this file; this doesn't read
+  // anything yet, sectors are paged in as we touch them; it's opened
+  // with the default sector size, which is enough to get at the
+  // geometry in the superblock (and ordered, as a disk with a journal
+  // has to be)
+  static fs_geometry_t defaults; // all zero
+  Disk_Close();
+  Disk_SetGeometry(SECTOR_SIZE, TOTAL_SECTORS);
+  Disk_SetOrdered(1);
+  if(!format && disk_attach(fs->bs_filename, 0) < 0) {
+    if(diskErrno != E_OPENING_FILE) {
+      // the file isn't a disk image
+      dprintf("... couldn't read disk from file '%s', boot failed\n", fs->bs_filename);
       osErrno = E_GENERAL; 
       return -1;
     }
-  } else {
-    dprintf("... load disk from file '%s' successful\n", bs_filename);
-    
-    // we successfully loaded the disk, we need to do two more checks,
-    // first the file size must be exactly the size as expected (thiis
-    // supposedly should be folded in Disk_Load(); and it's not)
-    int sz = 0;
-    FILE* f = fopen(bs_filename, "r");
-    if(f) {
-      fseek(f, 0, SEEK_END);
-      sz = ftell(f);
-      fclose(f);
+    // if we can't open the file; it means the file does not exist,
+    // we need to create a new file system on disk
+    dprintf("... couldn't open file, create new file system\n");
+    format = &defaults;
+  }
+
+  if(format) {
+    if(geometry_set(format) < 0) {
+      dprintf("... can't lay out a file system with this geometry\n");
+      osErrno = E_GENERAL;
+      return -1;
+    }
+    Disk_Close();
+    Disk_SetOrdered(fs->geo.journal_sectors > 0);
+    if(Disk_SetGeometry(fs->geo.sector_size, fs->geo.total_sectors) < 0 ||
+       disk_attach(fs->bs_filename, 1) < 0) {
+      dprintf("... couldn't create file '%s', boot failed\n", fs->bs_filename);
+      osErrno = E_GENERAL;
+      return -1;
+    }
+    if(format_disk() < 0 || flush_all() < 0) {
+      osErrno = E_GENERAL;
+      return -1;
+    }
+
+    // with an empty journal
+    fs->journal_tail = fs->journal_head = 0;
+    fs->journal_seq = 1;
+    if(fs->geo.journal_sectors > 0 && journal_write_header() < 0) {
+      osErrno = E_GENERAL;
+      return -1;
+    }
+      
+    // we need to synchronize the disk to the backstore file (so
+    // that we don't lose the formatted disk)
+    if(Disk_Save(fs->bs_filename) < 0) {
+      // if can't write to file, something's wrong with the backstore
+      dprintf("... failed to save disk to file '%s'\n", fs->bs_filename);
+      osErrno = E_GENERAL;
+      return -1;
     }
-    if(sz != SECTOR_SIZE*TOTAL_SECTORS) {
-      dprintf("... check size of file '%s' failed\n", bs_filename);
+    // everything's good now, boot is successful
+    dprintf("... successfully formatted disk, boot successful\n");
+    if(journal_reset() < 0 || open_files_reset() < 0) {
       osErrno = E_GENERAL;
       return -1;
     }
-    dprintf("... check size of file '%s' successful\n", bs_filename);
+    return 0;
+  }
+  dprintf("... map disk from file '%s' successful\n", fs->bs_filename);
     
-    // check magic
-    if(check_magic()) {
-      // everything's good by now, boot is successful
-      dprintf("... check magic successful\n");
-      memset(open_files, 0, MAX_OPEN_FILES*sizeof(open_file_t));
-      return 0;
-    } else {      
-      // mismatched magic number
-      dprintf("... check magic failed, boot failed\n");
+  // check magic
+  superblock_t sb;
+  if(!check_magic(&sb)) {
+    // mismatched magic number
+    dprintf("... check magic failed, boot failed\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  dprintf("... check magic successful\n");
+
+  // lay the disk out the way it was formatted; a disk with bigger
+  // sectors is opened again with its own sector size, and one with no
+  // journal is opened again unordered
+  fs_geometry_t g = { sb.sector_size, sb.total_sectors, sb.max_files, 0,
+		      sb.journal_sectors ? sb.journal_sectors : -1 };
+  if(geometry_set(&g) < 0) {
+    dprintf("... bad geometry in superblock, boot failed\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  if(fs->geo.sector_size != Disk_SectorSize() || fs->geo.journal_sectors == 0) {
+    Disk_Close();
+    Disk_SetOrdered(fs->geo.journal_sectors > 0);
+    if(Disk_SetGeometry(fs->geo.sector_size, fs->geo.total_sectors) < 0 ||
+       disk_attach(fs->bs_filename, 0) < 0) {
+      dprintf("... couldn't reopen file '%s', boot failed\n", fs->bs_filename);
       osErrno = E_GENERAL;
       return -1;
     }
   }
+  if(Disk_TotalSectors() != fs->geo.total_sectors) {
+    // the file isn't a disk image of the size it was formatted with
+    dprintf("... check size of file '%s' failed\n", fs->bs_filename);
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  dprintf("... geometry: %d sectors of %d bytes, %d inodes, %d journal sectors\n",
+	  fs->geo.total_sectors, fs->geo.sector_size, fs->geo.max_files, fs->geo.journal_sectors);
+
+  // finish what the last sync left halfway, before anything is read
+  if(fs->geo.journal_sectors > 0 && journal_replay() < 0) {
+    dprintf("... failed to replay journal, boot failed\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+
+  // keep the bitmaps in memory from now on
+  if(bitmap_load(&fs->inode_bitmap, INODE_BITMAP_START_SECTOR, INODE_BITMAP_SECTORS, fs->geo.max_files) < 0 ||
+     bitmap_load(&fs->sector_bitmap, SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, fs->geo.total_sectors) < 0) {
+    dprintf("... failed to load bitmaps, boot failed\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  dprintf("... loaded bitmaps (%d inodes and %d sectors free)\n",
+	  fs->inode_bitmap.nfree, fs->sector_bitmap.nfree);
+
+  // and the inode table as well
+  if(inode_table_load() < 0 || journal_reset() < 0 || open_files_reset() < 0) {
+    dprintf("... failed to load inode table, boot failed\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+
+  // everything's good by now, boot is successful
+  return 0;
+}
+
+/* FS_Boot() boots the file system from the disk image in the file, making a
+new one if there's no such file. If the path is the socket of fsd instead, the
+file system is the one fsd has booted, and every call is made by fsd. */
+int FS_Boot(char* backstore_fname)
+{
+  dprintf("FS_Boot('%s'):\n", backstore_fname);
+  pthread_rwlock_wrlock(&fs->fs_lock);
+  int status = boot(backstore_fname, NULL);
+  pthread_rwlock_unlock(&fs->fs_lock);
+  return status;
+}
+
+/* FS_Format() is like FS_Boot(), except that a new file system is always
+made in the file (overwriting whatever is there) with the given geometry:
+sector_size (a power of two from SECTOR_SIZE to MAX_SECTOR_SIZE bytes),
+total_sectors, max_files and journal_sectors, each one of them the default
+if zero (a journal of -1 sectors means the disk has none, and metadata is
+written in place on FS_Sync() with no protection from a crash); the
+max_file_size follows from the sector size and is ignored. A NULL geometry
+is the default one. The geometry is recorded in the superblock, and the disk
+is laid out the same way each time it's booted. If there's no room for a file
+system with this geometry, return -1 and set osErrno to E_GENERAL. */
+int FS_Format(char* backstore_fname, fs_geometry_t* geometry)
+{
+  static fs_geometry_t defaults; // all zero
+  dprintf("FS_Format('%s'):\n", backstore_fname);
+  pthread_rwlock_wrlock(&fs->fs_lock);
+  int status = boot(backstore_fname, geometry ? geometry : &defaults);
+  pthread_rwlock_unlock(&fs->fs_lock);
+  return status;
+}
+
+/* FS_Geometry() reports the geometry of the file system booted. */
+void FS_Geometry(fs_geometry_t* geometry)
+{
+  if(fs->server >= 0) {
+    fs_geometry_t g;
+    if(server_call(FSD_GEOMETRY, 0, 0, 0, NULL, 0, &g, sizeof(g)) >= 0 && geometry) *geometry = g;
+    return;
+  }
+  pthread_rwlock_rdlock(&fs->fs_lock);
+  if(geometry) *geometry = fs->geo;
+  pthread_rwlock_unlock(&fs->fs_lock);
+}
+
+// write everything out; return 0 if successful, -1 otherwise
+static int sync_all()
+{
+  // nothing else goes on while everything is written out
+  pthread_rwlock_wrlock(&fs->fs_lock);
+
+  // write back what we keep in memory, then only what has been written
+  // since the last sync goes to the file (the metadata through the
+  // journal, if there's one)
+  // (the sectors freed go back to the bitmap once the buffered writes
+  // have their sectors, so that none of those is one the metadata on
+  // the disk still points at)
+  int status = 0;
+  if(writebehind_sync_all() < 0 || (fs->freed && bitmap_release_freed(0) < 0) ||
+     flush_all() < 0 || (fs->meta ? journal_commit() : Disk_Sync()) < 0) {
+    // if can't write to file, something's wrong with the backstore
+    dprintf("FS_Sync():\n... failed to save disk to file '%s'\n", fs->bs_filename);
+    osErrno = E_GENERAL;
+    status = -1;
+  } else {
+    // everything's good now, sync is successful
+    dprintf("FS_Sync():\n... successfully saved disk to file '%s'\n", fs->bs_filename);
+  }
+  pthread_rwlock_unlock(&fs->fs_lock);
+  return status;
 }
 
+/* FS_Sync() makes sure everything written so far is in the disk image file. */
 int FS_Sync()
 {
-  if(Disk_Save(bs_filename) < 0) {
-    // if can't write to file, something's wrong with the backstore
-    dprintf("FS_Sync():\n... failed to save disk to file '%s'\n", bs_filename);
+  if(fs->server >= 0) return server_call(FSD_SYNC, 0, 0, 0, NULL, 0, NULL, 0);
+  return sync_all();
+}
+
+// return where the calling thread's entry on the list of transactions
+// open is (or would go), with txn_lock held
+static txn_t** txn_find()
+{
+  txn_t** t = &fs->txns;
+  while(*t && !pthread_equal((*t)->thread, pthread_self())) t = &(*t)->next;
+  return t;
+}
+
+/* FS_TxnBegin() and FS_TxnCommit() batch the calls made in between
+(File_Create(), Dir_Create(), File_Unlink() and the rest) into one sync: the
+metadata they change is kept in memory, each sector of it changed as many times
+as need be, and at commit it goes to the disk image file with everything else
+written so far, each sector written once. That's all they do: they defer the
+sync, and give no atomicity of their own. FS_Sync(), or a commit by another
+thread (or another client of fsd), writes out the changes of a transaction
+still open as they are, and a sync that changes more metadata than the journal
+holds goes through it in several parts (see journal_commit), so after a crash
+only some of a transaction may be there. Transactions can be nested, and only
+the outermost one writes anything when it's committed. Each thread has
+transactions of its own on each file system, and none waits for another's.
+FS_TxnBegin() returns -1 and sets osErrno to E_GENERAL if it runs out of memory;
+FS_TxnCommit() does if the calling thread has no transaction open, or if the
+changes can't be written; both return 0 upon success. */
+int FS_TxnBegin()
+{
+  if(fs->server >= 0) return server_call(FSD_TXNBEGIN, 0, 0, 0, NULL, 0, NULL, 0);
+
+  int status = 0;
+  pthread_mutex_lock(&fs->txn_lock);
+  txn_t** t = txn_find();
+  if(!*t && (*t = (txn_t*)calloc(1, sizeof(txn_t))) != NULL) (*t)->thread = pthread_self();
+  if(*t) (*t)->depth++;
+  else {
+    osErrno = E_GENERAL;
+    status = -1;
+  }
+  pthread_mutex_unlock(&fs->txn_lock);
+  return status;
+}
+
+int FS_TxnCommit()
+{
+  if(fs->server >= 0) return server_call(FSD_TXNCOMMIT, 0, 0, 0, NULL, 0, NULL, 0);
+
+  pthread_mutex_lock(&fs->txn_lock);
+  txn_t** p = txn_find();
+  txn_t* t = *p;
+  int depth = t ? --t->depth : -1;
+  if(depth == 0) *p = t->next;
+  pthread_mutex_unlock(&fs->txn_lock);
+  if(depth < 0) {
     osErrno = E_GENERAL;
     return -1;
-  } else {
-    // everything's good now, sync is successful
-    dprintf("FS_Sync():\n... successfully saved disk to file '%s'\n", bs_filename);
-    return 0;
   }
+  if(depth > 0) return 0;
+  free(t);
+  return sync_all();
+}
+
+void FS_Stats(fs_stats_t* st)
+{
+  if(!st) return;
+  if(fs->server >= 0) {
+    fs_stats_t s;
+    if(server_call(FSD_STATS, 0, 0, 0, NULL, 0, &s, sizeof(s)) >= 0) *st = s;
+    return;
+  }
+
+  // each counter is kept under the lock of what it counts
+  pthread_rwlock_rdlock(&fs->fs_lock);
+  pthread_mutex_lock(&fs->cache_lock);
+  st->cache_hits = fs->stats.cache_hits;
+  st->cache_misses = fs->stats.cache_misses;
+  st->cache_evictions = fs->stats.cache_evictions;
+  st->cache_writebacks = fs->stats.cache_writebacks;
+  pthread_mutex_unlock(&fs->cache_lock);
+  pthread_mutex_lock(&fs->dcache_lock);
+  st->dcache_hits = fs->stats.dcache_hits;
+  st->dcache_negative_hits = fs->stats.dcache_negative_hits;
+  st->dcache_misses = fs->stats.dcache_misses;
+  pthread_mutex_unlock(&fs->dcache_lock);
+  st->readahead_fills = __atomic_load_n(&fs->stats.readahead_fills, __ATOMIC_RELAXED);
+  st->readahead_hits = __atomic_load_n(&fs->stats.readahead_hits, __ATOMIC_RELAXED);
+  pthread_rwlock_unlock(&fs->fs_lock);
 }
 
 int File_Create(char* file)
 {
   dprintf("File_Create('%s'):\n", file);
+  if(fs->server >= 0) return server_call(FSD_CREATE, 0, 0, 0, file, path_len(file), NULL, 0);
   return create_file_or_directory(0, file);
 }
 
@@ -800,192 +3238,312 @@ osErrno to E_FILE_IN_USE (and do NOT delete the file). Upon success, return
 
 int File_Unlink(char* pathname) { //Made by: Stephan Belizaire
 
+	if(fs->server >= 0)
+		return server_call(FSD_UNLINK, 0, 0, 0, pathname, path_len(pathname), NULL, 0);
+
 	char fileName[MAX_NAME];
-  	int child; 
-  	int parent = follow_path(pathname, &child, fileName);
+  	int child, status = -1; 
+	pthread_rwlock_rdlock(&fs->fs_lock);
+  	int parent = follow_path(pathname, &child, fileName, 1); //the directory is locked, so the file can't be opened meanwhile
 
 	if(child < 1) { //Chekcs of the file exists
 		osErrno = E_NO_SUCH_FILE; 
-		return -1; 
 	} else if(is_file_open(child) == 1) { //Chekcs if the file is in use
 		osErrno = E_FILE_IN_USE;
-		return -1; 
-	} else if(remove_inode(0, parent, child) >= 0) { //If the file exists and is not in use, Delete it
-		return 0;
+	} else if(remove_inode(0, parent, child, fileName) >= 0) { //If the file exists and is not in use, Delete it
+		status = 0;
 	}
 
- 	return -1;
+	if(parent >= 0)
+		inode_unlock(parent);
+	pthread_rwlock_unlock(&fs->fs_lock);
+ 	return status;
 }
 
 int File_Open(char* file)
 {
   dprintf("File_Open('%s'):\n", file);
-  int fd = new_file_fd();
-  if(fd < 0) {
-    dprintf("... max open files reached\n");
-    osErrno = E_TOO_MANY_OPEN_FILES;
-    return -1;
-  }
-
-  int child_inode;
-  follow_path(file, &child_inode, NULL);
+  if(fs->server >= 0) return server_call(FSD_OPEN, 0, 0, 0, file, path_len(file), NULL, 0);
+  int child_inode, fd = -1;
+  pthread_rwlock_rdlock(&fs->fs_lock);
+  int parent_inode = follow_path(file, &child_inode, NULL, 0);
   if(child_inode >= 0) { // child is the one
-    // load the disk sector containing the inode
-    int inode_sector = INODE_TABLE_START_SECTOR+child_inode/INODES_PER_SECTOR;
-    char inode_buffer[SECTOR_SIZE];
-    if(Disk_Read(inode_sector, inode_buffer) < 0) { osErrno = E_GENERAL; return -1; }
-    dprintf("... load inode table for inode from disk sector %d\n", inode_sector);
-
     // get the inode
-    int inode_start_entry = (inode_sector-INODE_TABLE_START_SECTOR)*INODES_PER_SECTOR;
-    int offset = child_inode-inode_start_entry;
-    assert(0 <= offset && offset < INODES_PER_SECTOR);
-    inode_t* child = (inode_t*)(inode_buffer+offset*sizeof(inode_t));
+    inode_t* child = getNode(child_inode);
     dprintf("... inode %d (size=%d, type=%d)\n",
 	    child_inode, child->size, child->type);
 
-    if(child->type != 0) {
+    if(INODE_TYPE(child) != 0) {
       dprintf("... error: '%s' is not a file\n", file);
       osErrno = E_GENERAL;
-      return -1;
+    } else if((fd = new_file_fd(child_inode)) < 0) {
+      // initialize open file entry and return its index
+      dprintf("... max open files reached\n");
+      osErrno = E_TOO_MANY_OPEN_FILES;
     }
-
-    // initialize open file entry and return its index
-    open_files[fd].inode = child_inode;
-    open_files[fd].size = child->size;
-    open_files[fd].pos = 0;
-    return fd;
   } else {
     dprintf("... file '%s' is not found\n", file);
     osErrno = E_NO_SUCH_FILE;
-    return -1;
-  }  
+  }
+
+  // once open, the file can't be unlinked, so its directory can be let
+  // go of
+  if(parent_inode >= 0) inode_unlock(parent_inode);
+  pthread_rwlock_unlock(&fs->fs_lock);
+  return fd;
 }
 
 int File_Read(int fd, void* buffer, int size) { //Made by: Ricardo Casilimas
- 	int fileNode = open_files[fd].inode;
-	int i, j;
-	int counter = 0;
 
-	if(!fileNode) {
+	if(size < 0) {
 		dprintf("Error\n");
-		osErrno = E_BAD_FD;
+		osErrno = E_GENERAL;
 		return -1;
 	}
+	struct iovec v = { buffer, size };
+	return File_ReadV(fd, &v, 1);
+}
 
-	int nodeSector = INODE_TABLE_START_SECTOR + fileNode / INODES_PER_SECTOR;
-	char nodeBuffer[SECTOR_SIZE];
-
-	if(Disk_Read(nodeSector, nodeBuffer) < 0) {
-		dprintf("Error\n");
+/* File_Write() should write size bytes from buffer and write them into the
+file referenced by fd. All writes should begin at the current location of
+the file pointer and the file pointer should be updated after the write to
+its current location plus size. Note that writes are the only way to extend
+the size of a file. If the file is not open, return -1 and set osErrno to
+E_BAD_FD. Upon success of the write, the value of size should be returned;
+small writes may be buffered for a while before they're written out to disk
+(the latest by File_Close(), File_Seek() or FS_Sync()), but the disk space for
+them is set aside right away, so writing them out won't run out of space. If
+the write cannot complete (due to a lack of space on disk), return -1 and set
+osErrno to E_NO_SPACE.
+Finally, if the file exceeds the maximum file size, you should return -1 and
+set osErrno to E_FILE_TOO_BIG. */
+int File_Write(int fd, void* buffer, int size) //Made by: Ricardo Casilimas
+{ 
+	if(size < 0)
+	{
+		osErrno = E_GENERAL;
 		return -1;
 	}
+	struct iovec v = { buffer, size };
+	return File_WriteV(fd, &v, 1);
+}
 
-	int nodeIndex = (nodeSector - INODE_TABLE_START_SECTOR) * INODES_PER_SECTOR;
-	int offset = fileNode - nodeIndex;
+// the calls on an fd below are done by these functions, with the fd
+// and its inode locked by fd_enter()
 
-	assert(0 <= offset && offset < INODES_PER_SECTOR);
-	inode_t* file = (inode_t*)(nodeBuffer+ offset * sizeof(inode_t));
+static int file_readv(open_file_t* of, const struct iovec* iov, int iovcnt)
+{
+  int size = iov_total(iov, iovcnt);
+  if(size < 0) {
+    dprintf("... bad buffers\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
 
-	
-	char fileBuffer[SECTOR_SIZE];
-	char* data = (char*)buffer;
-	
+  // never read past the end of the file
+  inode_t* file = getNode(of->inode);
+  int pos = of->pos;
+  if(size > file->size-pos) size = file->size-pos;
+  if(size <= 0) return 0;
+
+  // sequential reads are served from the readahead window
+  char* window = readahead(of, file, pos, size);
+  if(window) {
+    iov_cursor_t cur = { iov, 0, 0 };
+    iov_copy(&cur, window, size, 1);
+  } else if(file_readv_at(of->inode, pos, iov, size) < 0)
+    return -1;
 
-	int index1 = open_files[fd].pos / SECTOR_SIZE;
-	int index2 = open_files[fd].pos % SECTOR_SIZE;
+  of->pos = pos+size;
+  return size;
+}
 
-	for(i = index1; i < MAX_SECTORS_PER_FILE; i++) {
+static int file_writev(open_file_t* of, const struct iovec* iov, int iovcnt)
+{
+  int size = iov_total(iov, iovcnt);
+  if(size < 0) {
+    dprintf("... bad buffers\n");
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  if(size == 0) return 0;
 
-		if(file->data[i]) {
-			Disk_Read(file->data[i], fileBuffer);
-			dprintf("File: %s", fileBuffer);
+  int pos = of->pos;
+  if(size > fs->geo.max_file_size-pos) {
+    osErrno = E_FILE_TOO_BIG;
+    return -1;
+  }
 
-			for(j = index2; j < SECTOR_SIZE; j++) {	
-				if ((counter + (open_files[fd].pos)) < file->size && counter < size) {
-					data[counter++] = fileBuffer[j];
-				}
-			}
-			index2 = 0;
-		}
-	}
+  // small writes are gathered in the write-behind buffer, big ones go
+  // straight to the file (after what's been gathered so far on any fd)
+  if(size <= WRITEBEHIND_MAX) {
+    if(writebehind(of, iov, size) < 0) return -1;
+  } else if(writebehind_sync(of->inode) < 0 ||
+	    file_writev_at(of->inode, pos, iov, size) < 0)
+    return -1;
 
-	open_files[fd].pos += counter;
-	return counter;
+  of->pos = pos+size;
+  return size;
 }
 
-/* File_Write() should write size bytes from buffer and write them into the
-file referenced by fd. All writes should begin at the current location of
-the file pointer and the file pointer should be updated after the write to
-its current location plus size. Note that writes are the only way to extend
-the size of a file. If the file is not open, return -1 and set osErrno to
-E_BAD_FD. Upon success of the write, all the data should be written out to
-disk and the value of size should be returned. If the write cannot complete
-(due to a lack of space on disk), return -1 and set osErrno to E_NO_SPACE.
-Finally, if the file exceeds the maximum file size, you should return -1 and
-set osErrno to E_FILE_TOO_BIG. */
-int File_Write(int fd, void* buffer, int size) //Made by: Ricardo Casilimas
-{ 
+static int file_pread(open_file_t* of, void* buffer, int size, int offset)
+{
+  if(size < 0 || (size > 0 && buffer == NULL)) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  int fsize = getNode(of->inode)->size;
+  if(offset < 0 || offset > fsize) {
+    osErrno = E_SEEK_OUT_OF_BOUNDS;
+    return -1;
+  }
+  if(size > fsize-offset) size = fsize-offset;
+  if(size > 0 && file_read_at(of->inode, offset, buffer, size) < 0) return -1;
+  return size;
+}
+
+static int file_pwrite(open_file_t* of, void* buffer, int size, int offset)
+{
+  if(size < 0 || (size > 0 && buffer == NULL)) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
 
-	int startingPos = open_files[fd].pos; // initial position to start write
-	int start = open_files[fd].pos / SECTOR_SIZE; // current location of file pointer
-	int end = start + ((size+open_files[fd].pos+SECTOR_SIZE-1)/SECTOR_SIZE); // end point after write
+  // buffered writes go first, so that they don't overwrite this one later
+  if(writebehind_sync(of->inode) < 0) return -1;
 
-	// error checking
-	if(fd<0 && fd>MAX_OPEN_FILES) //Checks if there is spaces
-	{ 
-		osErrno = E_NO_SPACE;
-		return -1;
-	} 
-	else if(open_files[fd].inode < 1) //makes sure that the file is open
-	{
-		osErrno = E_BAD_FD;
-		return -1;
-	} 
-	else if(end >= MAX_FILE_SIZE) //checks if this would exceed the max file size
-	{
-		osErrno = E_FILE_TOO_BIG;
-		return -1;
-	}
-	
-	inode_t* inode = getNode(open_files[fd].inode);
-
-	int bytesLeft = size;
-	int i; 
-	for(i=start; i<end; i++) { 
-		char dataBuff[SECTOR_SIZE];
-		char diskBuff[SECTOR_SIZE];
-
-		int sector = inode->data[i]; 
-		if(sector==0) 
-			sector = bitmap_first_unused(SECTOR_BITMAP_START_SECTOR, SECTOR_BITMAP_SECTORS, SECTOR_BITMAP_SIZE);
-
-		if(open_files[fd].pos == 0)
-		{ 
-			if(bytesLeft >= SECTOR_SIZE)
-			{ 
-				memcpy(diskBuff, (dataBuff + i*SECTOR_SIZE), SECTOR_SIZE);
-				bytesLeft -= SECTOR_SIZE;
-			} 
-			else
-			{ 
-				memcpy(diskBuff, (dataBuff + i*SECTOR_SIZE), bytesLeft);
-				bytesLeft = 0;				
-			}
-			Disk_Write(sector, diskBuff);
-		} 
-		else
-		{
-			Disk_Read(sector, diskBuff);
-			memcpy(diskBuff, (diskBuff+open_files[fd].size), SECTOR_SIZE-open_files[fd].size);
-			Disk_Write(sector, diskBuff);
-			bytesLeft -= SECTOR_SIZE-open_files[fd].size;
-			open_files[fd].pos = 0;	
-		}	
-	}
+  if(offset < 0 || offset > getNode(of->inode)->size) {
+    osErrno = E_SEEK_OUT_OF_BOUNDS;
+    return -1;
+  }
+  if(size > fs->geo.max_file_size-offset) {
+    osErrno = E_FILE_TOO_BIG;
+    return -1;
+  }
+  if(size > 0 && file_write_at(of->inode, offset, buffer, size) < 0) return -1;
+  return size;
+}
+
+static int file_map(open_file_t* of, int offset, int len, fs_span_t* spans, int maxspans)
+{
+  if(len < 0 || maxspans < 0 || (maxspans > 0 && spans == NULL)) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+
+  // the disk has to hold the latest contents of the file: buffered
+  // writes have been written out already, and cached sectors not yet
+  // on disk are written back
+  inode_t* file = getNode(of->inode);
+  if(offset < 0 || offset > file->size) {
+    osErrno = E_SEEK_OUT_OF_BOUNDS;
+    return -1;
+  }
+  if(len > file->size-offset) len = file->size-offset;
+
+  int n = 0;
+  while(len > 0) {
+    int sector, lo = offset%fs->geo.sector_size;
+    if(block_map(file, offset/fs->geo.sector_size, 1, &sector) < 0) return -1;
+    if(cache_clean(sector) < 0) {
+      osErrno = E_GENERAL;
+      return -1;
+    }
+    const char* addr = Disk_Addr(sector);
+    if(!addr) {
+      osErrno = E_GENERAL;
+      return -1;
+    }
+    int got = fs->geo.sector_size-lo;
+    if(got > len) got = len;
+
+    // a sector following on from the last span just makes it longer
+    if(n > 0 && (const char*)spans[n-1].base+spans[n-1].len == addr+lo)
+      spans[n-1].len += got;
+    else if(n == maxspans)
+      break;
+    else {
+      spans[n].base = addr+lo;
+      spans[n].len = got;
+      n++;
+    }
+    offset += got;
+    len -= got;
+  }
+  return n;
+}
+
+/* File_ReadV() and File_WriteV() read and write the same as File_Read() and
+File_Write(), only scattering the data read over, or gathering the data written
+from, the iovcnt buffers of iov, in order. The buffers are mapped straight onto
+the sectors of the file, without copying them together first. */
+int File_ReadV(int fd, const struct iovec* iov, int iovcnt)
+{
+  if(fs->server >= 0) return server_readv(fd, iov, iovcnt);
+  open_file_t* of = fd_enter(fd, 0);
+  if(!of) return -1;
+  int size = file_readv(of, iov, iovcnt);
+  fd_leave(of);
+  return size;
+}
+
+int File_WriteV(int fd, const struct iovec* iov, int iovcnt)
+{
+  if(fs->server >= 0) return server_writev(fd, iov, iovcnt);
+  open_file_t* of = fd_enter(fd, 1);
+  if(!of) return -1;
+  int size = file_writev(of, iov, iovcnt);
+  fd_leave(of);
+  return size;
+}
+
+/* File_PRead() and File_PWrite() read and write the same as File_Read()
+and File_Write(), only at the given offset rather than at the file pointer,
+which is neither used nor updated. The offset has to be in the file (as for
+File_Seek()), otherwise return -1 and set osErrno to E_SEEK_OUT_OF_BOUNDS. */
+int File_PRead(int fd, void* buffer, int size, int offset)
+{
+  dprintf("File_PRead(%d, %d, %d):\n", fd, size, offset);
+  if(fs->server >= 0) return server_call(FSD_PREAD, fd, size, offset, NULL, 0, buffer, size);
+  open_file_t* of = fd_enter(fd, 0);
+  if(!of) return -1;
+  size = file_pread(of, buffer, size, offset);
+  fd_leave(of);
+  return size;
+}
+
+int File_PWrite(int fd, void* buffer, int size, int offset)
+{
+  dprintf("File_PWrite(%d, %d, %d):\n", fd, size, offset);
+  if(fs->server >= 0) return server_call(FSD_PWRITE, fd, size, offset, buffer, size, NULL, 0);
+  open_file_t* of = fd_enter(fd, 1);
+  if(!of) return -1;
+  size = file_pwrite(of, buffer, size, offset);
+  fd_leave(of);
+  return size;
+}
 
-	open_files[fd].pos = startingPos+size;
-	return size;
+/* File_Map() gives read-only views of len bytes of the file from offset on
+(no further than the end of the file), pointing straight into the disk, so
+they can be read with no copying: one span for each run of consecutive
+sectors, filled into spans in file order. At most maxspans are filled, and
+the number filled is returned; if that's not the whole range, map again from
+where the last span ends. The views stay good until the file is written or
+removed, or the file system is synced or booted again. The offset has to be in
+the file, otherwise return -1 and set osErrno to E_SEEK_OUT_OF_BOUNDS. A file
+system served by fsd can't be mapped (E_GENERAL). */
+int File_Map(int fd, int offset, int len, fs_span_t* spans, int maxspans)
+{
+  dprintf("File_Map(%d, %d, %d):\n", fd, offset, len);
+  if(fs->server >= 0) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  open_file_t* of = fd_enter(fd, 0);
+  if(!of) return -1;
+  int n = file_map(of, offset, len, spans, maxspans);
+  fd_leave(of);
+  return n;
 }
 
 /* File_Seek() should update the current location of the file pointer. The
@@ -996,44 +3554,89 @@ osErrno to E_BAD_FD. Upon success, return the new location of the file
 pointer. */
 int File_Seek(int fd, int offset) { //Made by: Stephan Belizaire
 
-	if(is_file_open(open_files[fd].inode) != 1) //checks if the file is open
-	{ 
-		osErrno = E_BAD_FD;
+	if(fs->server >= 0)
+		return server_call(FSD_SEEK, fd, offset, 0, NULL, 0, NULL, 0);
+
+	open_file_t* of = fd_enter(fd, 0); //checks if the file is open, and writes out buffered writes (they may grow the file)
+	if(!of)
 		return -1; 
-	} 
 
-	if(offset > open_files[fd].size || offset < 0) //If offset is larger than the size of the file or negative
+	if(offset > getNode(of->inode)->size || offset < 0) //If offset is larger than the size of the file or negative
 	{ 
 		osErrno = E_SEEK_OUT_OF_BOUNDS;
+		fd_leave(of);
 		return -1;
 	}
 	  
-	open_files[fd].pos = offset;
-	return open_files[fd].pos;  
+	of->pos = offset;
+	fd_leave(of);
+	return offset;  
 }
 
 int File_Close(int fd)
 {
   dprintf("File_Close(%d):\n", fd);
-  if(0 > fd || fd > MAX_OPEN_FILES) {
-    dprintf("... fd=%d out of bound\n", fd);
-    osErrno = E_BAD_FD;
+  if(fs->server >= 0) return server_call(FSD_CLOSE, fd, 0, 0, NULL, 0, NULL, 0);
+  open_file_t* of = fd_enter(fd, 1);
+  if(!of) return -1;
+
+  // the fd goes away even if its buffered writes can't be written
+  int status = writebehind_flush(of, 1);
+  free_file_fd(fd);
+  pthread_rwlock_unlock(&fs->fs_lock);
+  if(status < 0) {
+    dprintf("... failed to write buffered writes of fd=%d\n", fd);
     return -1;
   }
-  if(open_files[fd].inode <= 0) {
-    dprintf("... fd=%d not an open file\n", fd);
-    osErrno = E_BAD_FD;
-    return -1;
+  dprintf("... file closed successfully\n");
+  return 0;
+}
+
+/* File_Stat() tells whether the path is a file or a directory, and its size:
+the bytes in the file (including those written but still buffered), or in the
+entries of the directory (as Dir_Size() reports). If there's no such file or
+directory, return -1 and set osErrno to E_NO_SUCH_FILE. Upon success, return
+0. */
+int File_Stat(char* path, fs_stat_t* stat)
+{
+  dprintf("File_Stat('%s'):\n", path);
+  if(fs->server >= 0) {
+    fs_stat_t st;
+    if(server_call(FSD_STAT, 0, 0, 0, path, path_len(path), &st, sizeof(st)) < 0) return -1;
+    if(stat) *stat = st;
+    return 0;
   }
 
-  dprintf("... file closed successfully\n");
-  open_files[fd].inode = 0;
+  int child = -1;
+  char fname[MAX_NAME];
+  pthread_rwlock_rdlock(&fs->fs_lock);
+  int locked = follow_path(path, &child, fname, 0);
+  if(locked >= 0 && child >= 0) {
+    lock_child(locked, child);
+    locked = child;
+    inode_t* inode = getNode(child);
+    if(stat && inode) {
+      stat->is_dir = INODE_TYPE(inode) ? 1 : 0;
+      stat->size = stat->is_dir ? inode->size*(int)sizeof(dirent_t) : inode->size;
+      // the buffers are guarded by the inode lock held
+      for(open_file_t* of = fs->writebehind_fds[child]; of && !stat->is_dir; of = of->wb_next)
+	if(of->wb_start+of->wb_len > stat->size) stat->size = of->wb_start+of->wb_len;
+    }
+  }
+  if(locked >= 0) inode_unlock(locked);
+  pthread_rwlock_unlock(&fs->fs_lock);
+  if(child < 0) {
+    dprintf("... no such file or directory\n");
+    osErrno = E_NO_SUCH_FILE;
+    return -1;
+  }
   return 0;
 }
 
 int Dir_Create(char* path)
 {
   dprintf("Dir_Create('%s'):\n", path);
+  if(fs->server >= 0) return server_call(FSD_MKDIR, 0, 0, 0, path, path_len(path), NULL, 0);
   return create_file_or_directory(1, path);
 }
 
@@ -1043,12 +3646,12 @@ int path_type_resolver(char* pathname)
 	int last_inode; 
 	char last_fname[MAX_NAME];
 
-	follow_path(pathname, &last_inode, last_fname); 
+	int parent = follow_path(pathname, &last_inode, last_fname, 0); 
+	int type = (last_inode == -1) ? -1 : INODE_TYPE(getNode(last_inode));
 
-	if(last_inode == -1)
-		return -1;
-
-	return getNode(last_inode)->type; 
+	if(parent >= 0)
+		inode_unlock(parent);
+	return type; 
 }
 
 /* Dir_Unlink() removes a directory referred to by path, freeing up its
@@ -1061,6 +3664,8 @@ allowed to remove the root directory ("/"), in which case the function
 should return -1 and set osErrno to E_ROOT_DIR. */
 int Dir_Unlink(char* path) //Made by: George Barroso
 {
+	if(fs->server >= 0)
+		return server_call(FSD_RMDIR, 0, 0, 0, path, path_len(path), NULL, 0);
 	
 	int last_inode;
   	char last_fname[MAX_NAME];
@@ -1079,23 +3684,29 @@ int Dir_Unlink(char* path) //Made by: George Barroso
 		return -1;
 	}
 
+	int status = -1;
+	pthread_rwlock_rdlock(&fs->fs_lock);
 	if(path_type_resolver(path) == 1) //if the path is actually a directory
 	{
 		dprintf("... Path is a directory, continuing\n");
 		
-  		int parent = follow_path(path, &last_inode, last_fname);
-		inode_t* inode = getNode(last_inode);
-
-		if(inode->size > 0) //checks if the directory is empty
+  		int parent = follow_path(path, &last_inode, last_fname, 1);
+		if(parent >= 0 && last_inode > 0) //it may have gone meanwhile
 		{
-			osErrno = E_DIR_NOT_EMPTY;
-			return -1;
-		} 
-		else if(remove_inode(1, parent, last_inode) >= 0){  //other whise removes the directory
-			return 0;
+			inode_lock(last_inode, 1); //waits for those still reading the directory
+			inode_t* inode = getNode(last_inode);
+
+			if(inode->size > 0 && INODE_TYPE(inode) == 1) //checks if the directory is empty
+				osErrno = E_DIR_NOT_EMPTY;
+			else if(remove_inode(1, parent, last_inode, last_fname) >= 0)  //other whise removes the directory
+				status = 0;
+			inode_unlock(last_inode);
 		}
+		if(parent >= 0)
+			inode_unlock(parent);
 	}
-	return -1;
+	pthread_rwlock_unlock(&fs->fs_lock);
+	return status;
 }
 
 /* Dir_Size() returns the number of bytes in the directory referred to by
@@ -1104,42 +3715,93 @@ calling Dir_Read() (described below) to find the contents of the directory. */
 int Dir_Size(char* path) //Made by: George Barroso
 {
 	dprintf("... Dir_Size('%s')\n", path);
+	if(fs->server >= 0)
+		return server_call(FSD_DIRSIZE, 0, 0, 0, path, path_len(path), NULL, 0);
 
-	char tempBuffer[SECTOR_SIZE];
+	int last_inode = -1, size = -1;
+	char last_fname[MAX_NAME];
 
-	if(path_type_resolver(path)==1) //checks that this is a directory
+	// entries are kept packed, so the size follows from their number
+	pthread_rwlock_rdlock(&fs->fs_lock);
+	int locked = follow_path(path, &last_inode, last_fname, 0);
+	if(locked >= 0 && last_inode >= 0)
 	{
-		dprintf("... Path is a directory, continuing\n");
-		int byteCounter = 0;
-		int last_inode;
-  		char last_fname[MAX_NAME];
-
-		follow_path(path, &last_inode, last_fname);
-
+		lock_child(locked, last_inode);
+		locked = last_inode;
 		inode_t* inodeDir = getNode(last_inode);
-		
-		int i;
-		int j;
-		for(i=0; i<30; i++)
-		{ 
-			int sect = (unsigned char)inodeDir->data[i]; 
-			Disk_Read(sect, tempBuffer); //read data
-
-			for(j = 0;j < 25;j++)
-			{ 
-				dirent_t* dirEntry = (dirent_t*)(tempBuffer + (j*20));
-				if(dirEntry->inode > 0)
-					byteCounter+=20;
-			}			
+		if(inodeDir && INODE_TYPE(inodeDir) == 1) //checks that this is a directory
+		{
+			dprintf("... Path is a directory, %d entries\n", inodeDir->size);
+			size = inodeDir->size * sizeof(dirent_t);
 		}
-		dprintf("... byte counter returning\n");
-		return byteCounter; 
 	}
+	if(locked >= 0)
+		inode_unlock(locked);
+	pthread_rwlock_unlock(&fs->fs_lock);
+	if(size >= 0)
+		return size;
 	dprintf("... Path is NOT a directory, returning\n");
   return 0;
 }
 
 
+// read the entries of the directory (locked for reading) into the
+// buffer, as Dir_Read() does
+static int dir_read(inode_t* directory, void* buffer, int size)
+{
+	int i, j;
+	int counter = 0;
+	
+	if(!INODE_TYPE(directory)) {
+		dprintf("Error\n");
+		osErrno = E_GENERAL;
+		return -1;
+	}
+
+
+	if(directory->size * sizeof(dirent_t) > size) {
+		dprintf("Error\n");
+		osErrno = E_BUFFER_TOO_SMALL;
+		return -1;
+	}
+
+	// read all dirent sectors in one go (into a buffer on the heap, as
+	// a whole directory can be too big for the stack); the entries in
+	// them are packed (for a hashed directory, at the front of every
+	// bucket)
+	int hashed = directory->type & INODE_HASHED;
+	int nsectors = hashed ? MAX_SECTORS_PER_FILE :
+		(directory->size + DIRENTS_PER_SECTOR - 1) / DIRENTS_PER_SECTOR;
+	if(nsectors == 0)
+		return 0;
+
+	char* dirBuffer = (char*)malloc(nsectors * fs->geo.sector_size);
+	disk_iovec_t iov[MAX_SECTORS_PER_FILE];
+	for(i = 0; i < nsectors && dirBuffer; i++) {
+		iov[i].sector = directory->data[i];
+		iov[i].buffer = dirBuffer + i * fs->geo.sector_size;
+	}
+	if(!dirBuffer || cache_readv(iov, nsectors) < 0) {
+		dprintf("Error\n");
+		free(dirBuffer);
+		osErrno = E_GENERAL;
+		return -1;
+	}
+
+	for(i = 0; i < nsectors; i++) {
+		char* sector = dirBuffer + i * fs->geo.sector_size;
+		j = directory->size - i * DIRENTS_PER_SECTOR; // entries in this sector
+		if(j > DIRENTS_PER_SECTOR) j = DIRENTS_PER_SECTOR;
+		if(hashed) j = DIR_BUCKET(sector)->count;
+		memcpy((char*)buffer + counter, sector, j * sizeof(dirent_t));
+		counter += j * sizeof(dirent_t);
+	}
+	free(dirBuffer);
+
+	dprintf("%d\n", directory->size);
+	return directory->size;
+}
+
 /* Dir_Read() can be used to read the contents of a directory. It should
 return in the buffer a set of directory entries. Each entry is of size 20
 bytes and contains 16-byte names of the files (or directories) within the
@@ -1151,61 +3813,163 @@ and return the number of directory entries that are in the directory (e.g.,
 
 int Dir_Read(char* path, void* buffer, int size) { //Made by: George Barroso
 
-	int dirNode;
+	if(fs->server >= 0)
+		return server_call(FSD_DIRREAD, size, 0, 0, path, path_len(path), buffer, size);
+
+	int dirNode = -1;
 	char file[MAX_NAME];
-	int i, j;
-	int counter = 0;
 	
-	follow_path(path, &dirNode, file);
-
-	int nodeSector = INODE_TABLE_START_SECTOR + dirNode / INODES_PER_SECTOR;
-	char nodeBuffer[SECTOR_SIZE];
-
-
-	if(Disk_Read(nodeSector, nodeBuffer) < 0) {
+	pthread_rwlock_rdlock(&fs->fs_lock);
+	int parent = follow_path(path, &dirNode, file, 0);
+	if(parent < 0 || dirNode < 0) {
+		if(parent >= 0)
+			inode_unlock(parent);
+		pthread_rwlock_unlock(&fs->fs_lock);
 		dprintf("Error\n");
+		osErrno = E_NO_SUCH_DIR;
 		return -1;
 	}
 
+	lock_child(parent, dirNode);
+	int count = dir_read(getNode(dirNode), buffer, size);
+	inode_unlock(dirNode);
+	pthread_rwlock_unlock(&fs->fs_lock);
+	return count;
+}
 
-	int nodeIndex = (nodeSector - INODE_TABLE_START_SECTOR) * INODES_PER_SECTOR;
-	int offset = dirNode - nodeIndex;
-
-	assert(0 <= offset && offset < INODES_PER_SECTOR);
-	inode_t* directory = (inode_t*)(nodeBuffer + offset * sizeof(inode_t));
-
-	
-	if(!directory->type) {
-		dprintf("Error\n");
-		osErrno = E_GENERAL;
-		return -1;
-	}
+/* the calls on a file system of a handle */
 
+// make the calling thread work on the file system (and its disk);
+// return the one it worked on before
+static fs_t* fs_use(fs_t* h)
+{
+  fs_t* old = fs;
+  fs = h ? h : &fs_default;
+  Disk_Use(fs->disk);
+  return old;
+}
 
-	if(directory->size * sizeof(dirent_t) > size) {
-		dprintf("Error\n");
-		osErrno = E_BUFFER_TOO_SMALL;
-		return -1;
-	}
+// free everything the file system the thread works on keeps in memory,
+// and the file system itself (the thread goes back to the default one)
+static void fs_free()
+{
+  fs_t* h = fs;
+  if(h->server >= 0) close(h->server);
+  open_files_release();
+  free(h->inode_bitmap.words);
+  free(h->inode_bitmap.dirty);
+  free(h->sector_bitmap.words);
+  free(h->sector_bitmap.dirty);
+  free(h->inodes);
+  free(h->inodes_dirty);
+  free(h->meta);
+  free(h->freed);
+  free(h->reused);
+  fs_use(NULL);
+  Disk_Free(h->disk);
+  pthread_rwlock_destroy(&h->fs_lock);
+  pthread_mutex_destroy(&h->fd_table_lock);
+  pthread_mutex_destroy(&h->alloc_lock);
+  pthread_mutex_destroy(&h->dcache_lock);
+  pthread_mutex_destroy(&h->cache_lock);
+  pthread_mutex_destroy(&h->server_lock);
+  pthread_mutex_destroy(&h->txn_lock);
+  while(h->txns) {
+    txn_t* t = h->txns;
+    h->txns = t->next;
+    free(t);
+  }
+  free(h);
+}
 
-	char dirBuffer[SECTOR_SIZE];
+fs_t* FS_Mount(char* path)
+{
+  dprintf("FS_Mount('%s'):\n", path);
+  fs_t* h = (fs_t*)calloc(1, sizeof(fs_t));
+  if(!h || !(h->disk = Disk_New())) {
+    free(h);
+    osErrno = E_GENERAL;
+    return NULL;
+  }
+  pthread_rwlock_init(&h->fs_lock, NULL);
+  pthread_mutex_init(&h->fd_table_lock, NULL);
+  pthread_mutex_init(&h->alloc_lock, NULL);
+  pthread_mutex_init(&h->dcache_lock, NULL);
+  pthread_mutex_init(&h->cache_lock, NULL);
+  pthread_mutex_init(&h->server_lock, NULL);
+  pthread_mutex_init(&h->txn_lock, NULL);
+  h->server = -1;
+  h->open_files_free = -1;
+
+  fs_t* old = fs_use(h);
+  if(boot(path, NULL) < 0) {
+    fs_free();
+    h = NULL;
+  }
+  fs_use(old);
+  return h;
+}
 
-	for(i = 0; i < MAX_SECTORS_PER_FILE; i++) {
+int FS_Unmount(fs_t* h)
+{
+  if(!h || h == &fs_default) {
+    osErrno = E_GENERAL;
+    return -1;
+  }
+  // the file system is freed even if it can't be synced
+  fs_t* old = fs_use(h);
+  int status = FS_Sync();
+  fs_free();
+  fs_use(old == h ? NULL : old);
+  return status;
+}
 
-		if(directory->data[i]) {
-			Disk_Read(directory->data[i], dirBuffer);
+void FS_Use(fs_t* h)
+{
+  fs_use(h);
+}
 
-			for(j = 0; j < DIRENTS_PER_SECTOR; j++) {
-				dirent_t* dirent = (dirent_t*)(dirBuffer +j * sizeof(dirent_t));
+void FS_Geometry_r(fs_t* h, fs_geometry_t* geometry)
+{
+  fs_t* old = fs_use(h);
+  FS_Geometry(geometry);
+  fs_use(old);
+}
 
-				if(dirent->inode) {
-					memcpy(buffer + counter, (void*)dirent, sizeof(dirent_t));
-					counter += sizeof(dirent_t);
-				}
-			}
-		}
-	}
+void FS_Stats_r(fs_t* h, fs_stats_t* st)
+{
+  fs_t* old = fs_use(h);
+  FS_Stats(st);
+  fs_use(old);
+}
 
-	dprintf("%d\n", directory->size);
-	return directory->size;
-}
\ No newline at end of file
+// the body of a call made on the file system 'h': the call is made
+// with the thread working on it, and what it returns is returned
+#define ON_FS(h, call) { fs_t* old = fs_use(h); int r = call; fs_use(old); return r; }
+
+int FS_Format_r(fs_t* h, char* path, fs_geometry_t* geometry) ON_FS(h, FS_Format(path, geometry))
+int FS_Sync_r(fs_t* h) ON_FS(h, FS_Sync())
+int FS_TxnBegin_r(fs_t* h) ON_FS(h, FS_TxnBegin())
+int FS_TxnCommit_r(fs_t* h) ON_FS(h, FS_TxnCommit())
+int File_Create_r(fs_t* h, char* file) ON_FS(h, File_Create(file))
+int File_Open_r(fs_t* h, char* file) ON_FS(h, File_Open(file))
+int File_Read_r(fs_t* h, int fd, void* buffer, int size) ON_FS(h, File_Read(fd, buffer, size))
+int File_Write_r(fs_t* h, int fd, void* buffer, int size) ON_FS(h, File_Write(fd, buffer, size))
+int File_PRead_r(fs_t* h, int fd, void* buffer, int size, int offset)
+  ON_FS(h, File_PRead(fd, buffer, size, offset))
+int File_PWrite_r(fs_t* h, int fd, void* buffer, int size, int offset)
+  ON_FS(h, File_PWrite(fd, buffer, size, offset))
+int File_ReadV_r(fs_t* h, int fd, const struct iovec* iov, int iovcnt)
+  ON_FS(h, File_ReadV(fd, iov, iovcnt))
+int File_WriteV_r(fs_t* h, int fd, const struct iovec* iov, int iovcnt)
+  ON_FS(h, File_WriteV(fd, iov, iovcnt))
+int File_Map_r(fs_t* h, int fd, int offset, int len, fs_span_t* spans, int maxspans)
+  ON_FS(h, File_Map(fd, offset, len, spans, maxspans))
+int File_Seek_r(fs_t* h, int fd, int offset) ON_FS(h, File_Seek(fd, offset))
+int File_Close_r(fs_t* h, int fd) ON_FS(h, File_Close(fd))
+int File_Unlink_r(fs_t* h, char* file) ON_FS(h, File_Unlink(file))
+int File_Stat_r(fs_t* h, char* path, fs_stat_t* stat) ON_FS(h, File_Stat(path, stat))
+int Dir_Create_r(fs_t* h, char* path) ON_FS(h, Dir_Create(path))
+int Dir_Unlink_r(fs_t* h, char* path) ON_FS(h, Dir_Unlink(path))
+int Dir_Size_r(fs_t* h, char* path) ON_FS(h, Dir_Size(path))
+int Dir_Read_r(fs_t* h, char* path, void* buffer, int size) ON_FS(h, Dir_Read(path, buffer, size))
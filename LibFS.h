@@ -5,6 +5,8 @@
 #ifndef __LibFS_h__
 #define __LibFS_h__
 
+#include <sys/uio.h> // struct iovec
+
 // error types
 typedef enum {
     E_GENERAL,      // general
@@ -22,8 +24,8 @@ typedef enum {
     E_BUFFER_TOO_SMALL, 
 } FS_Error_t;
     
-// used for errors
-extern int osErrno;
+// used for errors (each thread has its own)
+extern __thread int osErrno;
 
 // a few file system parameters
 
@@ -31,25 +33,82 @@ extern int osErrno;
 // maximum limit of 1000
 #define MAX_FILES 1000
 
-// each file can have a maximum of 30 sectors; we treat the data
-// blocks of the file/director the same as sectors
+// each inode has room for 30 sectors; we treat the data blocks of
+// the file/director the same as sectors; a directory can have a
+// maximum of 30 sectors, a bigger file uses some of them as indirect
+// blocks
 #define MAX_SECTORS_PER_FILE 30
 
-// the size of a file or directory is limited
+// the size of a directory is limited, and so is that of a file with
+// no indirect blocks (a file can grow to the max_file_size reported by
+// FS_Geometry)
 #define MAX_FILE_SIZE (MAX_SECTORS_PER_FILE*SECTOR_SIZE)
 
-// file system generic calls
+// the numbers above are for the default geometry; a file system can
+// be formatted with bigger sectors, more of them, and more files (see
+// FS_Format)
+typedef struct _fs_geometry {
+    int sector_size;   // bytes in a sector (SECTOR_SIZE to MAX_SECTOR_SIZE)
+    int total_sectors; // sectors on the disk
+    int max_files;     // files and directories the file system can hold
+    int max_file_size; // bytes a file can hold (reported, not set)
+    int journal_sectors; // sectors of the metadata journal (-1 for none)
+} fs_geometry_t;
+
+// counters describing how the file system has been working since it
+// was booted (see FS_Stats)
+typedef struct _fs_stats {
+    long cache_hits;           // sector lookups served by the sector cache
+    long cache_misses;         // sector lookups that had to go to the disk
+    long cache_evictions;      // cached sectors reclaimed for other sectors
+    long cache_writebacks;     // dirty cached sectors written to the disk
+    long dcache_hits;          // name lookups answered by the dcache
+    long dcache_negative_hits; // ...with the answer that there's no such name
+    long dcache_misses;        // name lookups that had to scan the directory
+    long readahead_fills;      // readahead windows read for sequential reads
+    long readahead_hits;       // reads served from a readahead window
+} fs_stats_t;
+
+// what a path is, as reported by File_Stat
+typedef struct _fs_stat {
+    int is_dir; // 1 for a directory, 0 for a file
+    int size;   // bytes in the file, or in the directory (as Dir_Size reports)
+} fs_stat_t;
+
+// a read-only view of part of a file, straight into the disk (see File_Map)
+typedef struct _fs_span {
+    const void *base; // where the bytes are
+    int len;          // and how many of them
+} fs_span_t;
+
+// file system generic calls; all the calls can be made from several
+// threads at once; booting from the socket of fsd (a daemon serving a
+// file system it has booted) has fsd make all the calls
 int FS_Boot(char *path);
+int FS_Format(char *path, fs_geometry_t *geometry);
+void FS_Geometry(fs_geometry_t *geometry);
 int FS_Sync();
+void FS_Stats(fs_stats_t *stats);
+
+// the calls between these two are batched into one sync at commit,
+// each sector of metadata written once (it's not atomic: see LibFS.c)
+int FS_TxnBegin();
+int FS_TxnCommit();
 
 // file ops
 int File_Create(char *file);
 int File_Open(char *file);
 int File_Read(int fd, void *buffer, int size);
 int File_Write(int fd, void *buffer, int size);
+int File_PRead(int fd, void *buffer, int size, int offset);
+int File_PWrite(int fd, void *buffer, int size, int offset);
+int File_ReadV(int fd, const struct iovec *iov, int iovcnt);
+int File_WriteV(int fd, const struct iovec *iov, int iovcnt);
+int File_Map(int fd, int offset, int len, fs_span_t *spans, int maxspans);
 int File_Seek(int fd, int offset);
 int File_Close(int fd);
 int File_Unlink(char *file);
+int File_Stat(char *path, fs_stat_t *stat);
 
 // directory ops
 int Dir_Create(char *path);
@@ -57,4 +116,40 @@ int Dir_Unlink(char *path);
 int Dir_Size(char *path);
 int Dir_Read(char *path, void *buffer, int size);
 
+// a process can have several file systems at once: FS_Mount() boots
+// one from its own disk image (as FS_Boot() would) and returns a handle
+// to it, or NULL with osErrno set; the calls ending in _r do the same
+// as those above on the file system given, and FS_Use() makes the calls
+// above work on it from then on in the calling thread (on the one
+// booted by FS_Boot() if NULL); a file descriptor belongs to the file
+// system it was opened on; FS_Unmount() syncs the file system and frees
+// it along with its open files
+typedef struct _fs fs_t;
+fs_t *FS_Mount(char *path);
+int FS_Unmount(fs_t *fs);
+void FS_Use(fs_t *fs);
+int FS_Format_r(fs_t *fs, char *path, fs_geometry_t *geometry);
+void FS_Geometry_r(fs_t *fs, fs_geometry_t *geometry);
+int FS_Sync_r(fs_t *fs);
+int FS_TxnBegin_r(fs_t *fs);
+int FS_TxnCommit_r(fs_t *fs);
+void FS_Stats_r(fs_t *fs, fs_stats_t *stats);
+int File_Create_r(fs_t *fs, char *file);
+int File_Open_r(fs_t *fs, char *file);
+int File_Read_r(fs_t *fs, int fd, void *buffer, int size);
+int File_Write_r(fs_t *fs, int fd, void *buffer, int size);
+int File_PRead_r(fs_t *fs, int fd, void *buffer, int size, int offset);
+int File_PWrite_r(fs_t *fs, int fd, void *buffer, int size, int offset);
+int File_ReadV_r(fs_t *fs, int fd, const struct iovec *iov, int iovcnt);
+int File_WriteV_r(fs_t *fs, int fd, const struct iovec *iov, int iovcnt);
+int File_Map_r(fs_t *fs, int fd, int offset, int len, fs_span_t *spans, int maxspans);
+int File_Seek_r(fs_t *fs, int fd, int offset);
+int File_Close_r(fs_t *fs, int fd);
+int File_Unlink_r(fs_t *fs, char *file);
+int File_Stat_r(fs_t *fs, char *path, fs_stat_t *stat);
+int Dir_Create_r(fs_t *fs, char *path);
+int Dir_Unlink_r(fs_t *fs, char *path);
+int Dir_Size_r(fs_t *fs, char *path);
+int Dir_Read_r(fs_t *fs, char *path, void *buffer, int size);
+
 #endif /* __LibFS_h__ */
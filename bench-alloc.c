@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "LibDisk.h"
+#include "LibFS.h"
+
+// measures what it costs to allocate sectors as the disk fills up: at
+// each fill level, files of MAX_FILE_SIZE are repeatedly created,
+// written, and unlinked, and the time per allocated sector is reported
+
+#define ROUNDS 200
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [disk]\n(the disk image is overwritten)\n", prog);
+  exit(1);
+}
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+// create a file and fill it up to MAX_FILE_SIZE; return 0 if
+// successful, -1 otherwise
+static int make_file(char* path, char* buf)
+{
+  if(File_Create(path) < 0) return -1;
+  int fd = File_Open(path);
+  if(fd < 0) return -1;
+  int sz = File_Write(fd, buf, MAX_FILE_SIZE);
+  File_Close(fd);
+  return (sz == MAX_FILE_SIZE) ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile;
+  if(argc != 1 && argc != 2) usage(argv[0]);
+  if(argc == 2) diskfile = argv[1];
+  else diskfile = "bench-disk";
+
+  unlink(diskfile);
+  if(FS_Boot(diskfile) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+
+  static char buf[MAX_FILE_SIZE];
+  memset(buf, 'x', MAX_FILE_SIZE);
+
+  // the probe gets a directory of its own, created first, so finding
+  // it costs the same however many files fill the disk
+  if(Dir_Create("/probe") < 0) {
+    printf("ERROR: can't create directory '/probe'\n");
+    return -2;
+  }
+
+  // the disk holds this many files of the maximum size when full
+  int capacity = TOTAL_SECTORS/MAX_SECTORS_PER_FILE;
+  int levels[] = { 0, 25, 50, 75, 90 };
+  int nfiles = 0;
+  char path[64];
+
+  printf("%-8s %-10s %s\n", "FILL", "SECTORS", "USEC/SECTOR");
+  for(int l=0; l<sizeof(levels)/sizeof(levels[0]); l++) {
+    // fill the disk up to the next level
+    while(nfiles < capacity*levels[l]/100) {
+      sprintf(path, "/fill%d", nfiles);
+      if(make_file(path, buf) < 0) {
+	printf("ERROR: can't fill disk at %d files\n", nfiles);
+	return -2;
+      }
+      nfiles++;
+    }
+
+    // and measure allocating and freeing a file's worth of sectors
+    double t = now();
+    for(int r=0; r<ROUNDS; r++) {
+      if(make_file("/probe/file", buf) < 0 || File_Unlink("/probe/file") < 0) {
+	printf("ERROR: can't allocate at %d%% full\n", levels[l]);
+	return -3;
+      }
+    }
+    t = now()-t;
+    printf("%-8d %-10d %.3f\n", levels[l], nfiles*MAX_SECTORS_PER_FILE,
+	   t*1e6/(ROUNDS*MAX_SECTORS_PER_FILE));
+  }
+
+  if(FS_Sync() < 0) {
+    printf("ERROR: can't sync disk '%s'\n", diskfile);
+    return -4;
+  }
+  return 0;
+}
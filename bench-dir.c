@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "LibDisk.h"
+#include "LibFS.h"
+
+// measures what it costs to create, look up, and unlink a name as a
+// directory fills up to its 750 entries; lookups are of names that
+// aren't there (each one new, so it's the directory that's searched
+// rather than the dcache), and the cost is reported both in time and
+// in the number of sectors the file system had to look at (the names
+// are all different, so that the costs are averaged over buckets)
+
+#define ROUNDS 500
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [disk]\n(the disk image is overwritten)\n", prog);
+  exit(1);
+}
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+// the number of sectors looked up in the sector cache so far
+static long sectors()
+{
+  fs_stats_t st;
+  FS_Stats(&st);
+  return st.cache_hits + st.cache_misses;
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile;
+  if(argc != 1 && argc != 2) usage(argv[0]);
+  if(argc == 2) diskfile = argv[1];
+  else diskfile = "bench-disk";
+
+  unlink(diskfile);
+  if(FS_Boot(diskfile) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+  if(Dir_Create("/dir") < 0) {
+    printf("ERROR: can't create directory '/dir'\n");
+    return -2;
+  }
+
+  // the directory is filled to each size, leaving room for the probe
+  int levels[] = { 25, 50, 100, 250, 500, 600, 700, 749 };
+  int nfiles = 0, nmiss = 0;
+  char path[64];
+
+  printf("%-8s %-10s %-10s %-10s %-10s %-10s %s\n", "ENTRIES",
+	 "CREATE", "(SECTORS)", "LOOKUP", "(SECTORS)", "UNLINK", "(SECTORS)");
+  for(int l=0; l<sizeof(levels)/sizeof(levels[0]); l++) {
+    while(nfiles < levels[l]) {
+      sprintf(path, "/dir/file%d", nfiles);
+      if(File_Create(path) < 0) {
+	printf("ERROR: can't create '%s'\n", path);
+	return -2;
+      }
+      nfiles++;
+    }
+
+    double t[3] = { 0, 0, 0 };
+    long n[3] = { 0, 0, 0 };
+    for(int r=0; r<ROUNDS; r++) {
+      char probe[64];
+      sprintf(probe, "/dir/probe%d", r);
+      double t0 = now(); long n0 = sectors();
+      if(File_Create(probe) < 0) {
+	printf("ERROR: can't create '%s' with %d entries\n", probe, nfiles);
+	return -3;
+      }
+      double t1 = now(); long n1 = sectors();
+      sprintf(path, "/dir/miss%d", nmiss++);
+      if(File_Open(path) >= 0) {
+	printf("ERROR: found '%s'\n", path);
+	return -3;
+      }
+      double t2 = now(); long n2 = sectors();
+      if(File_Unlink(probe) < 0) {
+	printf("ERROR: can't unlink '%s' with %d entries\n", probe, nfiles);
+	return -3;
+      }
+      double t3 = now(); long n3 = sectors();
+      t[0] += t1-t0; t[1] += t2-t1; t[2] += t3-t2;
+      n[0] += n1-n0; n[1] += n2-n1; n[2] += n3-n2;
+    }
+    printf("%-8d", nfiles);
+    for(int k=0; k<3; k++)
+      printf(" %-10.3f %-10.1f", t[k]*1e6/ROUNDS, (double)n[k]/ROUNDS);
+    printf("\n");
+  }
+
+  if(FS_Sync() < 0) {
+    printf("ERROR: can't sync disk '%s'\n", diskfile);
+    return -4;
+  }
+  return 0;
+}
@@ -0,0 +1,146 @@
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "LibDisk.h"
+#include "LibFS.h"
+
+// measures how many operations a second the slow-* tools get done when
+// each one boots the disk image and syncs it back, and when they go to
+// fsd instead, which has the image booted already; then how many calls
+// a second one program gets done through fsd, which is what the socket
+// costs without starting a process for each one (run from the directory
+// with the tools and fsd)
+
+#define ROUNDS 200
+
+extern char **environ;
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [disk [socket]]\n(the disk image is overwritten)\n", prog);
+  exit(1);
+}
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+// start the program with the arguments (its output thrown away); return
+// its pid, or -1 if it can't be started
+static pid_t start(char* argv[])
+{
+  posix_spawn_file_actions_t fa;
+  posix_spawn_file_actions_init(&fa);
+  posix_spawn_file_actions_addopen(&fa, 1, "/dev/null", O_WRONLY, 0);
+  pid_t pid;
+  int err = posix_spawn(&pid, argv[0], &fa, NULL, argv, environ);
+  posix_spawn_file_actions_destroy(&fa);
+  return err ? -1 : pid;
+}
+
+// run the program to the end; return 0 if it succeeded
+static int run(char* argv[])
+{
+  int status;
+  pid_t pid = start(argv);
+  if(pid < 0 || waitpid(pid, &status, 0) < 0) return -1;
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+// run ROUNDS of the tool on the disk (or socket), with the path made
+// from the format and the round; return the operations a second, or -1
+// if one fails
+static double ops(char* tool, char* disk, char* format)
+{
+  char path[64];
+  char* argv[] = { tool, disk, path, NULL };
+  double t = now();
+  for(int r=0; r<ROUNDS; r++) {
+    sprintf(path, format, r);
+    if(run(argv) < 0) {
+      printf("ERROR: '%s %s %s' failed\n", tool, disk, path);
+      return -1;
+    }
+  }
+  return ROUNDS/(now()-t);
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile, *sockname;
+  if(argc > 3) usage(argv[0]);
+  diskfile = argc >= 2 ? argv[1] : "bench-disk";
+  sockname = argc == 3 ? argv[2] : "bench-fsd.sock";
+
+  if(FS_Format(diskfile, NULL) < 0) {
+    printf("ERROR: can't format file system in file '%s'\n", diskfile);
+    return -1;
+  }
+
+  // the tools one-shot, on the disk image
+  double direct[3], served[3];
+  direct[0] = ops("./slow-touch.exe", diskfile, "/a%d");
+  direct[1] = ops("./slow-ls.exe", diskfile, "/");
+  direct[2] = ops("./slow-rm.exe", diskfile, "/a%d");
+  if(direct[0] < 0 || direct[1] < 0 || direct[2] < 0) return -2;
+
+  // and through fsd; it's up once its socket can be booted from
+  char* fsd[] = { "./fsd.exe", diskfile, sockname, NULL };
+  pid_t pid = start(fsd);
+  int up = 0;
+  for(int i=0; pid > 0 && i<500 && !up; i++) {
+    usleep(10000);
+    up = FS_Boot(sockname) == 0;
+  }
+  if(!up) {
+    printf("ERROR: can't start '%s'\n", fsd[0]);
+    if(pid > 0) kill(pid, SIGTERM);
+    return -3;
+  }
+  served[0] = ops("./slow-touch.exe", sockname, "/b%d");
+  served[1] = ops("./slow-ls.exe", sockname, "/");
+  served[2] = ops("./slow-rm.exe", sockname, "/b%d");
+  if(served[0] < 0 || served[1] < 0 || served[2] < 0) {
+    kill(pid, SIGTERM);
+    return -4;
+  }
+
+  char* names[] = { "touch", "ls", "rm" };
+  printf("%-8s %-16s %s\n", "TOOL", "ONE-SHOT OPS/S", "FSD OPS/S");
+  for(int k=0; k<3; k++) printf("%-8s %-16.1f %.1f\n", names[k], direct[k], served[k]);
+
+  // the calls themselves: create, open, write, close, unlink
+  char path[64], buf[SECTOR_SIZE];
+  memset(buf, 'x', sizeof(buf));
+  double t = now();
+  for(int r=0; r<ROUNDS*10; r++) {
+    sprintf(path, "/c%d", r);
+    int fd;
+    if(File_Create(path) < 0 || (fd = File_Open(path)) < 0 ||
+       File_Write(fd, buf, sizeof(buf)) != sizeof(buf) || File_Close(fd) < 0 ||
+       File_Unlink(path) < 0) {
+      printf("ERROR: can't make '%s' through fsd\n", path);
+      kill(pid, SIGTERM);
+      return -4;
+    }
+  }
+  printf("%-8s %.1f\n", "CALLS/S", 5*ROUNDS*10/(now()-t));
+
+  int status = 0;
+  if(FS_Sync() < 0) {
+    printf("ERROR: can't sync disk '%s' through fsd\n", diskfile);
+    status = -5;
+  }
+  kill(pid, SIGTERM);
+  waitpid(pid, NULL, 0);
+  return status;
+}
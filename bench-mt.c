@@ -0,0 +1,116 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "LibDisk.h"
+#include "LibFS.h"
+
+// measures how reads scale with the number of threads reading at
+// once: each thread opens a file of its own (or all of them the same
+// file) and reads it from start to end over and over, and the
+// throughput of all the threads together is reported
+
+#define NTHREADS 8       // the most threads
+#define FILE_SECTORS 2048 // the size of each file
+#define PASSES 50
+#define READ_SIZE 4096
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [disk]\n(the disk image is overwritten)\n", prog);
+  exit(1);
+}
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+static int filesize;
+
+// read the file in 'arg' PASSES times; return NULL if successful
+static void* reader(void* arg)
+{
+  char buf[READ_SIZE];
+  int fd = File_Open((char*)arg);
+  if(fd < 0) return "can't open";
+  for(int p=0; p<PASSES; p++) {
+    if(File_Seek(fd, 0) < 0) return "can't seek";
+    int n, total = 0;
+    while((n = File_Read(fd, buf, READ_SIZE)) > 0) total += n;
+    if(n < 0 || total != filesize) return "can't read";
+  }
+  File_Close(fd);
+  return NULL;
+}
+
+// run 'nthreads' readers, of different files or all of the same one;
+// return the throughput in MB/s, or -1 if there's an error
+static double run(int nthreads, int same)
+{
+  pthread_t threads[NTHREADS];
+  char paths[NTHREADS][64];
+  double t = now();
+  for(int i=0; i<nthreads; i++) {
+    sprintf(paths[i], "/file%d", same ? 0 : i);
+    if(pthread_create(&threads[i], NULL, reader, paths[i]) != 0) return -1;
+  }
+  int failed = 0;
+  for(int i=0; i<nthreads; i++) {
+    void* err;
+    pthread_join(threads[i], &err);
+    if(err) {
+      printf("ERROR: thread %d %s '%s'\n", i, (char*)err, paths[i]);
+      failed = 1;
+    }
+  }
+  t = now()-t;
+  return failed ? -1 : (double)nthreads*PASSES*filesize/t/1e6;
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile;
+  if(argc != 1 && argc != 2) usage(argv[0]);
+  if(argc == 2) diskfile = argv[1];
+  else diskfile = "bench-disk";
+
+  // room for all the files
+  fs_geometry_t geo = { 0, 2*NTHREADS*FILE_SECTORS, 0, 0 };
+  if(FS_Format(diskfile, &geo) < 0) {
+    printf("ERROR: can't format file system in file '%s'\n", diskfile);
+    return -1;
+  }
+  FS_Geometry(&geo);
+  filesize = FILE_SECTORS*geo.sector_size;
+
+  static char buf[FILE_SECTORS*MAX_SECTOR_SIZE];
+  memset(buf, 'x', filesize);
+  char path[64];
+  for(int f=0; f<NTHREADS; f++) {
+    sprintf(path, "/file%d", f);
+    int fd;
+    if(File_Create(path) < 0 || (fd = File_Open(path)) < 0 ||
+       File_Write(fd, buf, filesize) != filesize || File_Close(fd) < 0) {
+      printf("ERROR: can't create '%s'\n", path);
+      return -2;
+    }
+  }
+
+  printf("%-8s %-16s %s\n", "THREADS", "DIFFERENT MB/S", "SAME MB/S");
+  for(int n=1; n<=NTHREADS; n*=2) {
+    double diff = run(n, 0), same = run(n, 1);
+    if(diff < 0 || same < 0) return -3;
+    printf("%-8d %-16.1f %.1f\n", n, diff, same);
+  }
+
+  if(FS_Sync() < 0) {
+    printf("ERROR: can't sync disk '%s'\n", diskfile);
+    return -4;
+  }
+  return 0;
+}
@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "LibDisk.h"
+#include "LibFS.h"
+
+// measures how fast files are read back: a set of files of
+// MAX_SECTORS_PER_FILE sectors, and then one big file going through
+// indirect blocks, is read from start to end over and over, with reads
+// of different sizes, and the throughput is reported for each size;
+// the disk can be formatted with bigger sectors to see what they save
+
+#define NFILES 64
+#define PASSES 200
+#define BIG_SECTORS 4096 // the size of the big file
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [disk [sector-size]]\n(the disk image is overwritten)\n", prog);
+  exit(1);
+}
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile;
+  fs_geometry_t geo = { 0, 0, 0, 0 };
+  if(argc > 3) usage(argv[0]);
+  if(argc >= 2) diskfile = argv[1];
+  else diskfile = "bench-disk";
+  if(argc == 3) geo.sector_size = atoi(argv[2]);
+
+  if(FS_Format(diskfile, &geo) < 0) {
+    printf("ERROR: can't format file system in file '%s'\n", diskfile);
+    return -1;
+  }
+  FS_Geometry(&geo);
+  int filesize = MAX_SECTORS_PER_FILE*geo.sector_size;
+  int bigsize = BIG_SECTORS*geo.sector_size;
+
+  static char buf[BIG_SECTORS*MAX_SECTOR_SIZE];
+  memset(buf, 'x', bigsize);
+
+  int fds[NFILES+1];
+  char path[64];
+  for(int f=0; f<NFILES; f++) {
+    sprintf(path, "/file%d", f);
+    if(File_Create(path) < 0 || (fds[f] = File_Open(path)) < 0 ||
+       File_Write(fds[f], buf, filesize) != filesize) {
+      printf("ERROR: can't create '%s'\n", path);
+      return -2;
+    }
+  }
+  if(File_Create("/big") < 0 || (fds[NFILES] = File_Open("/big")) < 0 ||
+     File_Write(fds[NFILES], buf, bigsize) != bigsize) {
+    printf("ERROR: can't create '/big'\n");
+    return -2;
+  }
+
+  int sizes[] = { 100, SECTOR_SIZE, 4096, filesize };
+  printf("%-10s %s\n", "READ SIZE", "MB/S");
+  for(int s=0; s<sizeof(sizes)/sizeof(sizes[0]); s++) {
+    double t = now();
+    for(int p=0; p<PASSES; p++) {
+      for(int f=0; f<NFILES; f++) {
+	if(File_Seek(fds[f], 0) < 0) {
+	  printf("ERROR: can't seek file %d\n", f);
+	  return -3;
+	}
+	int n, total = 0;
+	while((n = File_Read(fds[f], buf, sizes[s])) > 0) total += n;
+	if(n < 0 || total != filesize) {
+	  printf("ERROR: can't read file %d\n", f);
+	  return -3;
+	}
+      }
+    }
+    t = now()-t;
+    printf("%-10d %.1f\n", sizes[s], (double)PASSES*NFILES*filesize/t/1e6);
+  }
+
+  // the big file is read until about as many bytes have been read as
+  // from the small files
+  int bigsizes[] = { SECTOR_SIZE, 4096, 65536, bigsize };
+  printf("%-10s %s\n", "BIG READ", "MB/S");
+  for(int s=0; s<sizeof(bigsizes)/sizeof(bigsizes[0]); s++) {
+    int passes = (int)((long long)PASSES*NFILES*filesize/bigsize);
+    double t = now();
+    for(int p=0; p<passes; p++) {
+      if(File_Seek(fds[NFILES], 0) < 0) {
+	printf("ERROR: can't seek '/big'\n");
+	return -3;
+      }
+      int n, total = 0;
+      while((n = File_Read(fds[NFILES], buf, bigsizes[s])) > 0) total += n;
+      if(n < 0 || total != bigsize) {
+	printf("ERROR: can't read '/big'\n");
+	return -3;
+      }
+    }
+    t = now()-t;
+    printf("%-10d %.1f\n", bigsizes[s], (double)passes*bigsize/t/1e6);
+  }
+
+  for(int f=0; f<=NFILES; f++) File_Close(fds[f]);
+  return 0;
+}
@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "LibDisk.h"
+#include "LibFS.h"
+
+// measures what it costs to provision a tree of directories full of
+// files, and to remove it, when each call is synced on its own, when
+// each directory is a transaction, and when the whole tree is one; the
+// cost is reported in time and in the bytes written to the disk image
+// file (as counted by the kernel for the process, so Linux only)
+
+#define DIRS 8
+#define FILES 200
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [disk]\n(the disk image is overwritten)\n", prog);
+  exit(1);
+}
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+// the bytes the process has written so far
+static long written()
+{
+  long wchar = 0;
+  char line[128];
+  FILE* f = fopen("/proc/self/io", "r");
+  if(!f) return 0;
+  while(fgets(line, sizeof(line), f))
+    if(sscanf(line, "wchar: %ld", &wchar) == 1) break;
+  fclose(f);
+  return wchar;
+}
+
+// make (or remove, if 'rm' is set) the tree, syncing after each call
+// (mode 0), committing a transaction for each directory (1), or one
+// for the whole tree (2); return 0 if successful, -1 otherwise
+static int tree(int mode, int rm)
+{
+  char path[64];
+  if(mode == 2 && FS_TxnBegin() < 0) return -1;
+  for(int d=0; d<DIRS; d++) {
+    if(mode == 1 && FS_TxnBegin() < 0) return -1;
+    sprintf(path, "/dir%d", d);
+    if(!rm && (Dir_Create(path) < 0 || (mode == 0 && FS_Sync() < 0))) return -1;
+    for(int f=0; f<FILES; f++) {
+      sprintf(path, "/dir%d/file%d", d, f);
+      if((rm ? File_Unlink(path) : File_Create(path)) < 0) return -1;
+      if(mode == 0 && FS_Sync() < 0) return -1;
+    }
+    sprintf(path, "/dir%d", d);
+    if(rm && (Dir_Unlink(path) < 0 || (mode == 0 && FS_Sync() < 0))) return -1;
+    if(mode == 1 && FS_TxnCommit() < 0) return -1;
+  }
+  if(mode == 2 && FS_TxnCommit() < 0) return -1;
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile;
+  if(argc != 1 && argc != 2) usage(argv[0]);
+  if(argc == 2) diskfile = argv[1];
+  else diskfile = "bench-disk";
+
+  // room for all the files
+  fs_geometry_t geo = { 0, 0, 2*DIRS*FILES, 0, 0 };
+  if(FS_Format(diskfile, &geo) < 0) {
+    printf("ERROR: can't format file system in file '%s'\n", diskfile);
+    return -1;
+  }
+
+  char* names[] = { "SYNC EACH", "TXN/DIR", "TXN/TREE" };
+  int ops = DIRS*(FILES+1);
+  printf("%-10s %-12s %-12s %-12s %s\n", "MODE", "CREATE OPS/S", "(KB)", "UNLINK OPS/S", "(KB)");
+  for(int mode=0; mode<3; mode++) {
+    double t[2];
+    long kb[2];
+    for(int rm=0; rm<2; rm++) {
+      double t0 = now(); long w0 = written();
+      if(tree(mode, rm) < 0) {
+	printf("ERROR: can't %s the tree (%s)\n", rm ? "remove" : "make", names[mode]);
+	return -2;
+      }
+      t[rm] = now()-t0; kb[rm] = (written()-w0)/1024;
+    }
+    printf("%-10s %-12.1f %-12ld %-12.1f %ld\n", names[mode], ops/t[0], kb[0], ops/t[1], kb[1]);
+  }
+  return 0;
+}
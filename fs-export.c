@@ -0,0 +1,154 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "LibFS.h"
+
+// copies a file of the file system out to the host, or with -r a whole
+// directory tree (made into host directories as it goes), all in one
+// boot; files are read in big chunks, and the throughput is reported
+
+// the most bytes asked of one File_Read()
+#define CHUNK (1<<20)
+
+static char* buf;
+
+// what has been exported so far
+static long nbytes;
+static int nfiles, ndirs, nerrors;
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [disk|socket] [-r] path to_unix_path\n(a socket is that of fsd; with neither, $FSD_SOCKET or else default-disk)\n", prog);
+  exit(1);
+}
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+// copy the open file of the file system into a new host file (or one
+// truncated); return 0 if successful, -1 otherwise (with the error
+// printed); the fd is closed
+static int export_file(int fd, char* path, char* fname)
+{
+  int status = -1;
+  int hfd = open(fname, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+  if(hfd < 0) printf("ERROR: can't open file '%s' to export\n", fname);
+  else {
+    long size = 0;
+    int sz;
+    while((sz = File_Read(fd, buf, CHUNK)) > 0) {
+      if(write(hfd, buf, sz) != sz) break;
+      size += sz;
+    }
+    if(sz < 0) printf("ERROR: can't read file '%s'\n", path);
+    else if(sz > 0) printf("ERROR: can't write file '%s'\n", fname);
+    else {
+      nbytes += size;
+      nfiles++;
+      status = 0;
+    }
+    if(close(hfd) < 0 && status == 0) {
+      printf("ERROR: can't write file '%s'\n", fname);
+      status = -1;
+    }
+  }
+  File_Close(fd);
+  return status;
+}
+
+// copy the directory tree of the file system into the host directory
+// (made if it isn't there); errors are printed and counted, and the
+// rest is copied all the same
+static void export_dir(char* path, char* dname)
+{
+  if(mkdir(dname, 0777) == 0) ndirs++;
+  else if(errno != EEXIST) {
+    printf("ERROR: can't create directory '%s' to export\n", dname);
+    nerrors++;
+    return;
+  }
+
+  int sz = Dir_Size(path);
+  char* ents = sz > 0 ? malloc(sz) : NULL;
+  int entries = sz > 0 ? (ents ? Dir_Read(path, ents, sz) : -1) : sz;
+  if(entries < 0) {
+    printf("ERROR: can't list '%s'\n", path);
+    nerrors++;
+    free(ents);
+    return;
+  }
+  for(int i=0; i<entries; i++) {
+    // a name from the image becomes a host path, so one that would
+    // lead out of the directory (or isn't a name at all) is refused
+    char name[17], child[1024], hchild[4096];
+    memcpy(name, &ents[i*20], 16);
+    name[16] = '\0';
+    if(!name[0] || !strcmp(name, ".") || !strcmp(name, "..") || strchr(name, '/')) {
+      printf("ERROR: bad name '%s' in '%s'\n", name, path);
+      nerrors++;
+      continue;
+    }
+    snprintf(child, sizeof(child), "%s/%s", strcmp(path, "/") ? path : "", name);
+    snprintf(hchild, sizeof(hchild), "%s/%s", dname, name);
+    fs_stat_t st;
+    int fd;
+    if(File_Stat(child, &st) == 0 && st.is_dir) export_dir(child, hchild);
+    else if((fd = File_Open(child)) < 0) {
+      printf("ERROR: can't open file '%s'\n", child);
+      nerrors++;
+    } else if(export_file(fd, child, hchild) < 0) nerrors++;
+  }
+  free(ents);
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile, *path, *fname;
+  int recursive = 0;
+  if(argc > 1 && !strcmp(argv[1], "-r")) { recursive = 1; argv++; argc--; }
+  else if(argc > 2 && !strcmp(argv[2], "-r")) { recursive = 1; argv[2] = argv[1]; argv++; argc--; }
+  if(argc != 3 && argc != 4) usage(argv[0]);
+  if(argc == 4) { diskfile = argv[1]; path = argv[2]; fname = argv[3]; }
+  else { diskfile = getenv("FSD_SOCKET") ? getenv("FSD_SOCKET") : "default-disk"; path = argv[1]; fname = argv[2]; }
+
+  buf = malloc(CHUNK);
+  if(!buf) {
+    printf("ERROR: out of memory\n");
+    return -1;
+  }
+
+  double t = now();
+  if(FS_Boot(diskfile) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+
+  // nothing is changed, so there's nothing to sync
+  if(recursive) export_dir(path, fname);
+  else {
+    int fd = File_Open(path);
+    if(fd < 0) {
+      printf("ERROR: can't open file '%s'\n", path);
+      return -2;
+    }
+    if(export_file(fd, path, fname) < 0) nerrors++;
+  }
+
+  t = now()-t;
+  printf("exported %d files and %d directories, %.1f MB in %.3f s: %.1f MB/s, %.1f files/s\n",
+	 nfiles, ndirs, nbytes/1e6, t, nbytes/1e6/t, nfiles/t);
+  if(nerrors) {
+    printf("ERROR: %d files or directories couldn't be exported\n", nerrors);
+    return -2;
+  }
+  return 0;
+}
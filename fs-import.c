@@ -0,0 +1,160 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "LibFS.h"
+
+// copies a host file into the file system, or with -r a whole host
+// directory tree (made into directories as it goes), all in one boot;
+// host files are mapped and written in big chunks, everything is
+// synced once at the end (in a transaction, which only batches the
+// syncs: a crash midway can leave part of the import), and the
+// throughput is reported
+
+// the most bytes handed to one File_Write()
+#define CHUNK (1<<20)
+
+// what has been imported so far
+static long nbytes;
+static int nfiles, ndirs, nerrors;
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [disk|socket] [-r] path from_unix_path\n(a socket is that of fsd; with neither, $FSD_SOCKET or else default-disk)\n", prog);
+  exit(1);
+}
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+// copy the host file into a new file of the file system (replacing
+// one that's there); return 0 if successful, -1 otherwise (with the
+// error printed)
+static int import_file(char* path, char* fname)
+{
+  int hfd = open(fname, O_RDONLY);
+  struct stat st;
+  if(hfd < 0 || fstat(hfd, &st) < 0) {
+    printf("ERROR: can't open file '%s' to import\n", fname);
+    if(hfd >= 0) close(hfd);
+    return -1;
+  }
+  char* data = NULL;
+  if(st.st_size > 0) {
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, hfd, 0);
+    if(data == MAP_FAILED) {
+      printf("ERROR: can't read file '%s' to import\n", fname);
+      close(hfd);
+      return -1;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+  }
+  close(hfd);
+
+  // a file that's there already is replaced (there's no truncating one)
+  int status = -1, fd = -1;
+  if(File_Create(path) < 0 && (File_Unlink(path) < 0 || File_Create(path) < 0))
+    printf("ERROR: can't create file '%s'\n", path);
+  else if((fd = File_Open(path)) < 0) printf("ERROR: can't open file '%s'\n", path);
+  else {
+    off_t off = 0;
+    while(off < st.st_size) {
+      int n = st.st_size-off < CHUNK ? st.st_size-off : CHUNK;
+      if(File_Write(fd, data+off, n) != n) break;
+      off += n;
+    }
+    if(off < st.st_size) printf("ERROR: can't write file '%s'\n", path);
+    else {
+      nbytes += st.st_size;
+      nfiles++;
+      status = 0;
+    }
+  }
+  if(fd >= 0) File_Close(fd);
+  if(data) munmap(data, st.st_size);
+  return status;
+}
+
+// copy the host directory tree into the directory of the file system
+// (made if it isn't there); errors are printed and counted, and the
+// rest is copied all the same
+static void import_dir(char* path, char* dname)
+{
+  // a directory that's there already is imported into
+  fs_stat_t st;
+  if(Dir_Create(path) == 0) ndirs++;
+  else if(File_Stat(path, &st) < 0 || !st.is_dir) {
+    printf("ERROR: can't create directory '%s'\n", path);
+    nerrors++;
+    return;
+  }
+
+  DIR* dir = opendir(dname);
+  if(!dir) {
+    printf("ERROR: can't open directory '%s' to import\n", dname);
+    nerrors++;
+    return;
+  }
+  struct dirent* ent;
+  while((ent = readdir(dir)) != NULL) {
+    if(!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) continue;
+    char child[1024], hchild[4096];
+    struct stat st;
+    snprintf(child, sizeof(child), "%s/%s", strcmp(path, "/") ? path : "", ent->d_name);
+    snprintf(hchild, sizeof(hchild), "%s/%s", dname, ent->d_name);
+    if(lstat(hchild, &st) < 0) {
+      printf("ERROR: can't open '%s' to import\n", hchild);
+      nerrors++;
+    } else if(S_ISDIR(st.st_mode)) import_dir(child, hchild);
+    else if(S_ISREG(st.st_mode)) {
+      if(import_file(child, hchild) < 0) nerrors++;
+    } else printf("skipping '%s' (not a file or directory)\n", hchild);
+  }
+  closedir(dir);
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile, *path, *fname;
+  int recursive = 0;
+  if(argc > 1 && !strcmp(argv[1], "-r")) { recursive = 1; argv++; argc--; }
+  else if(argc > 2 && !strcmp(argv[2], "-r")) { recursive = 1; argv[2] = argv[1]; argv++; argc--; }
+  if(argc != 3 && argc != 4) usage(argv[0]);
+  if(argc == 4) { diskfile = argv[1]; path = argv[2]; fname = argv[3]; }
+  else { diskfile = getenv("FSD_SOCKET") ? getenv("FSD_SOCKET") : "default-disk"; path = argv[1]; fname = argv[2]; }
+
+  double t = now();
+  if(FS_Boot(diskfile) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+  if(FS_TxnBegin() < 0) {
+    printf("ERROR: can't begin a transaction on disk '%s'\n", diskfile);
+    return -1;
+  }
+
+  if(recursive) import_dir(path, fname);
+  else if(import_file(path, fname) < 0) nerrors++;
+
+  if(FS_TxnCommit() < 0) {
+    printf("ERROR: can't sync disk '%s'\n", diskfile);
+    return -3;
+  }
+  t = now()-t;
+  printf("imported %d files and %d directories, %.1f MB in %.3f s: %.1f MB/s, %.1f files/s\n",
+	 nfiles, ndirs, nbytes/1e6, t, nbytes/1e6/t, nfiles/t);
+  if(nerrors) {
+    printf("ERROR: %d files or directories couldn't be imported\n", nerrors);
+    return -2;
+  }
+  return 0;
+}
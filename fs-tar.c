@@ -0,0 +1,592 @@
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "LibFS.h"
+
+// streams a subtree of the file system to stdout as a POSIX ustar
+// archive (-c), or takes one from stdin into a directory of the file
+// system (-x), with no temporary files; the archive goes through a ring
+// of buffers between the file system calls and a thread writing stdout
+// (or reading stdin), so that the two overlap and each file's content
+// is read just once; messages go to stderr
+
+// the size of a buffer of the ring, and how many there are
+#define CHUNK (1<<20)
+#define NBUF 4
+
+// the blocks of an archive, and how many of them make a record (an
+// archive is a whole number of records)
+#define BLOCK 512
+#define RECORD 20
+
+// a ustar header
+typedef struct _tar_header {
+  char name[100];
+  char mode[8];
+  char uid[8];
+  char gid[8];
+  char size[12];
+  char mtime[12];
+  char chksum[8];
+  char typeflag;
+  char linkname[100];
+  char magic[6];
+  char version[2];
+  char uname[32];
+  char gname[32];
+  char devmajor[8];
+  char devminor[8];
+  char prefix[155];
+  char pad[12];
+} tar_header_t;
+
+// the buffers between the file system and stdout (or stdin); the
+// producer fills the one at 'head', the consumer drains the one at 'tail'
+typedef struct _ring {
+  char* buf[NBUF];
+  int len[NBUF];
+  int head, tail;
+  int full;   // buffers filled and not drained yet
+  int eof;    // nothing more is coming
+  int err;    // stdout (or stdin) failed
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} ring_t;
+
+static ring_t ring = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+// the buffer being filled (-c) or drained (-x), and where in it
+static char* cur;
+static int pos, curlen;
+
+// -c: the bytes of the archive so far
+static long total;
+
+static time_t mtime;
+
+// what has been archived (or extracted) so far
+static long nbytes;
+static int nfiles, ndirs, nerrors;
+
+void usage(char *prog)
+{
+  fprintf(stderr, "USAGE: %s [disk|socket] -c|-x path\n(-c writes the tree at path to stdout, -x reads one from stdin into it;\na socket is that of fsd; with neither, $FSD_SOCKET or else default-disk)\n", prog);
+  exit(1);
+}
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+// wait for a buffer to fill
+static char* ring_empty()
+{
+  pthread_mutex_lock(&ring.lock);
+  while(ring.full == NBUF) pthread_cond_wait(&ring.cond, &ring.lock);
+  char* b = ring.buf[ring.head];
+  pthread_mutex_unlock(&ring.lock);
+  return b;
+}
+
+// hand the buffer filled with 'len' bytes to the consumer
+static void ring_push(int len)
+{
+  pthread_mutex_lock(&ring.lock);
+  ring.len[ring.head] = len;
+  ring.head = (ring.head+1)%NBUF;
+  ring.full++;
+  pthread_cond_broadcast(&ring.cond);
+  pthread_mutex_unlock(&ring.lock);
+}
+
+// nothing more is coming (if 'err' is set, because something failed)
+static void ring_close(int err)
+{
+  pthread_mutex_lock(&ring.lock);
+  ring.eof = 1;
+  if(err) ring.err = 1;
+  pthread_cond_broadcast(&ring.cond);
+  pthread_mutex_unlock(&ring.lock);
+}
+
+// wait for a filled buffer to drain, and return it with its length;
+// NULL once there are no more
+static char* ring_next(int* len)
+{
+  pthread_mutex_lock(&ring.lock);
+  while(ring.full == 0 && !ring.eof) pthread_cond_wait(&ring.cond, &ring.lock);
+  char* b = NULL;
+  if(ring.full > 0) {
+    b = ring.buf[ring.tail];
+    *len = ring.len[ring.tail];
+  }
+  pthread_mutex_unlock(&ring.lock);
+  return b;
+}
+
+// the buffer returned by ring_next() is drained
+static void ring_pop()
+{
+  pthread_mutex_lock(&ring.lock);
+  ring.tail = (ring.tail+1)%NBUF;
+  ring.full--;
+  pthread_cond_broadcast(&ring.cond);
+  pthread_mutex_unlock(&ring.lock);
+}
+
+// the thread writing the archive to stdout; once that fails, the rest
+// is thrown away
+static void* writer_thread(void* arg)
+{
+  char* b;
+  int len;
+  while((b = ring_next(&len)) != NULL) {
+    for(int done=0; done < len && !ring.err; ) {
+      ssize_t n = write(1, b+done, len-done);
+      if(n <= 0) ring.err = 1;
+      else done += n;
+    }
+    ring_pop();
+  }
+  return NULL;
+}
+
+// the thread reading the archive from stdin
+static void* reader_thread(void* arg)
+{
+  int len = CHUNK, err = 0;
+  while(len == CHUNK) {
+    char* b = ring_empty();
+    for(len=0; len < CHUNK; ) {
+      ssize_t n = read(0, b+len, CHUNK-len);
+      if(n < 0) err = 1;
+      if(n <= 0) break;
+      len += n;
+    }
+    if(len > 0) ring_push(len);
+  }
+  ring_close(err);
+  return NULL;
+}
+
+// -c: the room left in the buffer being filled (one is waited for if
+// needed), and handing it over when it's full
+static char* out_room(int* room)
+{
+  if(!cur) {
+    cur = ring_empty();
+    pos = 0;
+  }
+  *room = CHUNK-pos;
+  return cur+pos;
+}
+
+static void out_done(int len)
+{
+  pos += len;
+  total += len;
+  if(pos == CHUNK) {
+    ring_push(pos);
+    cur = NULL;
+  }
+}
+
+// -c: add the bytes (zeros if 'p' is NULL) to the archive
+static void out(const void* p, int len)
+{
+  while(len > 0) {
+    int room;
+    char* b = out_room(&room);
+    if(room > len) room = len;
+    if(p) {
+      memcpy(b, p, room);
+      p = (const char*)p+room;
+    } else memset(b, 0, room);
+    out_done(room);
+    len -= room;
+  }
+}
+
+// -x: up to 'max' bytes of the archive, where they are in the buffer
+// being drained (valid until the next call); return how many, or 0 at
+// the end of it
+static int in_take(char** p, int max)
+{
+  if(cur && pos == curlen) {
+    ring_pop();
+    cur = NULL;
+  }
+  if(!cur) {
+    cur = ring_next(&curlen);
+    pos = 0;
+    if(!cur) return 0;
+  }
+  int n = curlen-pos < max ? curlen-pos : max;
+  *p = cur+pos;
+  pos += n;
+  return n;
+}
+
+// -x: copy the next bytes of the archive (or skip them if 'p' is NULL);
+// return 0 if they were all there, -1 otherwise
+static int in(void* p, long len)
+{
+  while(len > 0) {
+    char* b;
+    int n = in_take(&b, len < CHUNK ? len : CHUNK);
+    if(n == 0) return -1;
+    if(p) {
+      memcpy(p, b, n);
+      p = (char*)p+n;
+    }
+    len -= n;
+  }
+  return 0;
+}
+
+// fill the numeric field of a header in octal
+static void tar_number(char* field, int size, long value)
+{
+  char s[32];
+  snprintf(s, sizeof(s), "%0*lo", size-1, value);
+  memcpy(field, s, size-1);
+}
+
+// read the numeric field of a header; -1 if it isn't octal
+static long tar_parse(const char* field, int size)
+{
+  long value = 0;
+  int i = 0;
+  while(i < size && field[i] == ' ') i++;
+  if(i == size || field[i] < '0' || field[i] > '7') return -1;
+  for(; i < size && field[i] >= '0' && field[i] <= '7'; i++) value = value*8+field[i]-'0';
+  return value;
+}
+
+// the checksum of a header, its own field counted as spaces
+static long tar_sum(const tar_header_t* h)
+{
+  const unsigned char* p = (const unsigned char*)h;
+  long sum = 0;
+  for(int i=0; i<BLOCK; i++)
+    sum += i >= offsetof(tar_header_t, chksum) && i < offsetof(tar_header_t, typeflag) ? ' ' : p[i];
+  return sum;
+}
+
+// -c: add the header of the entry to the archive; return -1 if its name
+// can't be put in one
+static int tar_header(char* name, char type, long size)
+{
+  tar_header_t h;
+  memset(&h, 0, sizeof(h));
+  int len = strlen(name);
+  if(len <= sizeof(h.name)) memcpy(h.name, name, len);
+  else {
+    // the name is split between the prefix and the name at a '/'
+    char* slash = name+len-sizeof(h.name)-1;
+    while(*slash && *slash != '/') slash++;
+    if(!*slash || slash-name > sizeof(h.prefix)) return -1;
+    memcpy(h.prefix, name, slash-name);
+    memcpy(h.name, slash+1, len-(slash+1-name));
+  }
+  tar_number(h.mode, sizeof(h.mode), type == '5' ? 0755 : 0644);
+  tar_number(h.uid, sizeof(h.uid), 0);
+  tar_number(h.gid, sizeof(h.gid), 0);
+  tar_number(h.size, sizeof(h.size), size);
+  tar_number(h.mtime, sizeof(h.mtime), mtime);
+  h.typeflag = type;
+  memcpy(h.magic, "ustar", 6);
+  memcpy(h.version, "00", 2);
+  tar_number(h.chksum, 7, tar_sum(&h));
+  h.chksum[7] = ' ';
+  out(&h, sizeof(h));
+  return 0;
+}
+
+// -c: add the file, which File_Stat() says has 'size' bytes, to the
+// archive under the name
+static void tar_file(char* path, char* name, long size)
+{
+  int fd = File_Open(path);
+  if(fd < 0) {
+    fprintf(stderr, "ERROR: can't open file '%s'\n", path);
+    nerrors++;
+  } else if(tar_header(name, '0', size) < 0) {
+    fprintf(stderr, "ERROR: name '%s' is too long for the archive\n", name);
+    nerrors++;
+  } else {
+    long done = 0;
+    while(done < size) {
+      int room;
+      char* b = out_room(&room);
+      if(room > size-done) room = size-done;
+      int got = File_Read(fd, b, room);
+      if(got <= 0) break;
+      out_done(got);
+      done += got;
+    }
+    if(done < size) {
+      // the archive has the size in the header already
+      fprintf(stderr, "ERROR: can't read file '%s'\n", path);
+      nerrors++;
+      out(NULL, size-done);
+    } else {
+      nbytes += size;
+      nfiles++;
+    }
+    out(NULL, (BLOCK-size%BLOCK)%BLOCK);
+  }
+  if(fd >= 0) File_Close(fd);
+}
+
+// -c: add the directory tree to the archive, with names starting with
+// 'name' (which is "" or ends with a '/')
+static void tar_dir(char* path, char* name)
+{
+  int sz = Dir_Size(path);
+  char* ents = sz > 0 ? malloc(sz) : NULL;
+  int entries = sz > 0 ? (ents ? Dir_Read(path, ents, sz) : -1) : sz;
+  if(entries < 0) {
+    fprintf(stderr, "ERROR: can't list '%s'\n", path);
+    nerrors++;
+    free(ents);
+    return;
+  }
+  for(int i=0; i<entries; i++) {
+    char* ent = &ents[i*20];
+    char child[1024], cname[1024];
+    snprintf(child, sizeof(child), "%s/%s", strcmp(path, "/") ? path : "", ent);
+    snprintf(cname, sizeof(cname), "%s%s", name, ent);
+    fs_stat_t st;
+    if(File_Stat(child, &st) < 0) {
+      fprintf(stderr, "ERROR: can't open '%s'\n", child);
+      nerrors++;
+    } else if(st.is_dir) {
+      strcat(cname, "/");
+      if(tar_header(cname, '5', 0) < 0) {
+	fprintf(stderr, "ERROR: name '%s' is too long for the archive\n", cname);
+	nerrors++;
+	continue;
+      }
+      ndirs++;
+      tar_dir(child, cname);
+    } else tar_file(child, cname, st.size);
+  }
+  free(ents);
+}
+
+// -x: make the directory if it isn't there; return 0 if it's there
+static int make_dir(char* path)
+{
+  if(Dir_Create(path) == 0) {
+    ndirs++;
+    return 0;
+  }
+  fs_stat_t st;
+  return File_Stat(path, &st) == 0 && st.is_dir ? 0 : -1;
+}
+
+// -x: make the directories the path is in, those that aren't there
+static void make_parents(char* path)
+{
+  for(char* slash = strchr(path+1, '/'); slash; slash = strchr(slash+1, '/')) {
+    *slash = '\0';
+    make_dir(path);
+    *slash = '/';
+  }
+}
+
+// -x: make the file (one that's there is replaced) and copy the next
+// 'size' bytes of the archive into it; return -1 if the archive ends
+// before they do
+static int untar_file(char* path, long size)
+{
+  int fd = -1;
+  if(File_Create(path) < 0) {
+    make_parents(path);
+    if(File_Create(path) < 0 && (File_Unlink(path) < 0 || File_Create(path) < 0)) {
+      fprintf(stderr, "ERROR: can't create file '%s'\n", path);
+      nerrors++;
+      return in(NULL, size);
+    }
+  }
+  if((fd = File_Open(path)) < 0) {
+    fprintf(stderr, "ERROR: can't open file '%s'\n", path);
+    nerrors++;
+    return in(NULL, size);
+  }
+  long done = 0;
+  while(done < size) {
+    char* b;
+    int n = in_take(&b, size-done < CHUNK ? size-done : CHUNK);
+    if(n == 0) break;
+    if(File_Write(fd, b, n) != n) {
+      fprintf(stderr, "ERROR: can't write file '%s'\n", path);
+      nerrors++;
+      File_Close(fd);
+      return in(NULL, size-done-n);
+    }
+    done += n;
+  }
+  File_Close(fd);
+  if(done < size) return -1;
+  nbytes += size;
+  nfiles++;
+  return 0;
+}
+
+// -x: take the archive into the directory; return 0 if it was all there
+// (the entries that can't be made are counted as errors)
+static int untar(char* path)
+{
+  tar_header_t h;
+  for(;;) {
+    if(in(&h, sizeof(h)) < 0) return -1;
+    // the archive ends with zero blocks
+    int zero = 1;
+    for(int i=0; i<BLOCK && zero; i++) zero = !((char*)&h)[i];
+    if(zero) return 0;
+    long size = tar_parse(h.size, sizeof(h.size));
+    if(tar_parse(h.chksum, sizeof(h.chksum)) != tar_sum(&h) || size < 0) {
+      fprintf(stderr, "ERROR: the archive is damaged\n");
+      return -1;
+    }
+    long skip = (BLOCK-size%BLOCK)%BLOCK;
+
+    // the name, without a leading '/' or "./" or a trailing '/'
+    char name[300], target[1024];
+    snprintf(name, sizeof(name), "%.*s%s%.*s",
+	     (int)strnlen(h.prefix, sizeof(h.prefix)), h.prefix, h.prefix[0] ? "/" : "",
+	     (int)strnlen(h.name, sizeof(h.name)), h.name);
+    char* p = name;
+    while(*p == '/' || (p[0] == '.' && p[1] == '/')) p += *p == '/' ? 1 : 2;
+    int len = strlen(p);
+    while(len > 0 && p[len-1] == '/') p[--len] = '\0';
+    snprintf(target, sizeof(target), "%s/%s", strcmp(path, "/") ? path : "", p);
+
+    if(len == 0 || !strcmp(p, ".")) {
+      if(in(NULL, size+skip) < 0) return -1;
+    } else if(!strcmp(p, "..") || !strncmp(p, "../", 3) || strstr(p, "/../") ||
+	      (len >= 3 && !strcmp(p+len-3, "/.."))) {
+      fprintf(stderr, "skipping '%s' (outside the directory)\n", name);
+      if(in(NULL, size+skip) < 0) return -1;
+    } else if(h.typeflag == '0' || h.typeflag == '\0' || h.typeflag == '7') {
+      if(untar_file(target, size) < 0 || in(NULL, skip) < 0) return -1;
+    } else if(h.typeflag == '5') {
+      if(make_dir(target) < 0) {
+	make_parents(target);
+	if(make_dir(target) < 0) {
+	  fprintf(stderr, "ERROR: can't create directory '%s'\n", target);
+	  nerrors++;
+	}
+      }
+      if(in(NULL, size+skip) < 0) return -1;
+    } else {
+      fprintf(stderr, "skipping '%s' (not a file or directory)\n", name);
+      if(in(NULL, size+skip) < 0) return -1;
+    }
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  char *diskfile, *path;
+  int create;
+  if(argc == 3) diskfile = getenv("FSD_SOCKET") ? getenv("FSD_SOCKET") : "default-disk";
+  else if(argc == 4) diskfile = argv[1];
+  else usage(argv[0]);
+  if(!strcmp(argv[argc-2], "-c")) create = 1;
+  else if(!strcmp(argv[argc-2], "-x")) create = 0;
+  else usage(argv[0]);
+  path = argv[argc-1];
+
+  for(int i=0; i<NBUF; i++) {
+    ring.buf[i] = malloc(CHUNK);
+    if(!ring.buf[i]) {
+      fprintf(stderr, "ERROR: out of memory\n");
+      return -1;
+    }
+  }
+  mtime = time(NULL);
+
+  double t = now();
+  if(FS_Boot(diskfile) < 0) {
+    fprintf(stderr, "ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+
+  pthread_t thread;
+  if(pthread_create(&thread, NULL, create ? writer_thread : reader_thread, NULL) != 0) {
+    fprintf(stderr, "ERROR: can't start\n");
+    return -1;
+  }
+
+  int status = 0;
+  if(create) {
+    // a file is archived under its own name; nothing is changed, so
+    // there's nothing to sync
+    fs_stat_t st;
+    if(File_Stat(path, &st) < 0) {
+      fprintf(stderr, "ERROR: can't open '%s'\n", path);
+      nerrors++;
+    } else if(st.is_dir) tar_dir(path, "");
+    else {
+      char* base = strrchr(path, '/');
+      tar_file(path, base ? base+1 : path, st.size);
+    }
+    out(NULL, 2*BLOCK);
+    out(NULL, (RECORD*BLOCK-total%(RECORD*BLOCK))%(RECORD*BLOCK));
+    if(pos > 0) ring_push(pos);
+    ring_close(0);
+    pthread_join(thread, NULL);
+    if(ring.err) {
+      fprintf(stderr, "ERROR: can't write the archive\n");
+      return -2;
+    }
+  } else {
+    // the whole archive is synced once, at the commit of a transaction
+    // (which only batches the syncs: a crash midway leaves part of it)
+    if(FS_TxnBegin() < 0) {
+      fprintf(stderr, "ERROR: can't begin a transaction on disk '%s'\n", diskfile);
+      return -1;
+    }
+    if(strcmp(path, "/") && make_dir(path) < 0) {
+      make_parents(path);
+      if(make_dir(path) < 0) {
+	fprintf(stderr, "ERROR: can't create directory '%s'\n", path);
+	return -2;
+      }
+    }
+    if(untar(path) < 0) {
+      pthread_mutex_lock(&ring.lock);
+      fprintf(stderr, ring.err ? "ERROR: can't read the archive\n" : "ERROR: the archive ends too soon\n");
+      pthread_mutex_unlock(&ring.lock);
+      status = -2;
+    } else {
+      // what comes after the end of it (the rest of its record) is
+      // read all the same, so that whoever writes it doesn't fail
+      char* b;
+      while(in_take(&b, CHUNK) > 0);
+    }
+    if(FS_TxnCommit() < 0) {
+      fprintf(stderr, "ERROR: can't sync disk '%s'\n", diskfile);
+      return -3;
+    }
+  }
+
+  t = now()-t;
+  fprintf(stderr, "%s %d files and %d directories, %.1f MB in %.3f s: %.1f MB/s, %.1f files/s\n",
+	  create ? "archived" : "extracted", nfiles, ndirs, nbytes/1e6, t, nbytes/1e6/t, nfiles/t);
+  if(nerrors) {
+    fprintf(stderr, "ERROR: %d files or directories couldn't be %s\n", nerrors, create ? "archived" : "extracted");
+    return -2;
+  }
+  return status;
+}
@@ -0,0 +1,328 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "LibFS.h"
+#include "fsd.h"
+
+// fsd boots a file system once and serves it over a UNIX-domain socket
+// (see fsd.h), so that the slow-* tools, and any other program booting
+// from the socket, don't each load the disk image and save it back; each
+// connection is served by a thread of its own; the file system is synced
+// whenever a client asks, and once more when fsd is stopped (with
+// SIGINT, SIGTERM or SIGHUP); clients may format the disk only if fsd
+// is started with -f
+
+void usage(char *prog)
+{
+  printf("USAGE: %s [-f] [disk [socket]]\n(-f lets clients format the disk)\n", prog);
+  exit(1);
+}
+
+static char *diskfile, *sockname;
+static int allow_format;
+
+// the file system is formatted again this many times; fds opened
+// before that are gone; each request is served with boot_lock held for
+// reading, and a format with it held for writing, so that the fds of a
+// request are still those it was checked against
+static int boot_gen;
+static pthread_rwlock_t boot_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// a connection, and the fds it has open (closed when it goes)
+typedef struct _client {
+  int sock;
+  int gen;     // boot_gen when the fds were opened
+  int* fds;
+  int nfds, maxfds;
+  int txns;    // transactions open (committed when it goes)
+  char* in;    // the data of a request
+  char* out;   // and of a reply
+  int insize, outsize;
+} client_t;
+
+// send (if 'out' is set) or receive exactly 'len' bytes on the socket;
+// return 0 if successful, -1 if the connection failed
+static int sock_io(int sock, void* buf, int len, int out)
+{
+  char* p = (char*)buf;
+  while(len > 0) {
+    ssize_t n = out ? send(sock, p, len, MSG_NOSIGNAL) : recv(sock, p, len, 0);
+    if(n < 0 && errno == EINTR) continue;
+    if(n <= 0) return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// make sure the buffer holds 'len' bytes; return 0 if it does
+static int grow(char** buf, int* size, int len)
+{
+  if(len <= *size) return 0;
+  char* b = realloc(*buf, len);
+  if(!b) return -1;
+  *buf = b;
+  *size = len;
+  return 0;
+}
+
+// return where the fd is in the list of the client; -1 if it isn't
+static int client_fd(client_t* c, int fd)
+{
+  if(c->gen != __atomic_load_n(&boot_gen, __ATOMIC_RELAXED)) {
+    c->nfds = 0;
+    c->gen = __atomic_load_n(&boot_gen, __ATOMIC_RELAXED);
+  }
+  for(int i=0; i<c->nfds; i++)
+    if(c->fds[i] == fd) return i;
+  return -1;
+}
+
+// add the fd to the list of the client; return 0 if successful
+static int client_open(client_t* c, int fd)
+{
+  if(c->nfds == c->maxfds) {
+    int n = c->maxfds ? 2*c->maxfds : 16;
+    int* fds = realloc(c->fds, n*sizeof(int));
+    if(!fds) return -1;
+    c->fds = fds;
+    c->maxfds = n;
+  }
+  c->fds[c->nfds++] = fd;
+  return 0;
+}
+
+// serve the next request of the client; return -1 if the connection
+// is gone or can't be made sense of
+static int serve(client_t* c)
+{
+  fsd_request_t req;
+  if(sock_io(c->sock, &req, sizeof(req), 0) < 0) return -1;
+  if(req.len < 0 || req.len > FSD_MAX_DATA) return -1;
+
+  // the request data (a path gets its '\0' here, in case it was left out)
+  if(grow(&c->in, &c->insize, req.len+1) < 0 ||
+     sock_io(c->sock, c->in, req.len, 0) < 0) return -1;
+  c->in[req.len] = '\0';
+  char* path = req.len > 0 ? c->in : NULL;
+
+  // the reply data
+  int want = 0;
+  if(req.op == FSD_READ || req.op == FSD_PREAD) want = req.arg[1];
+  else if(req.op == FSD_DIRREAD) want = req.arg[0];
+  else if(req.op == FSD_GEOMETRY) want = sizeof(fs_geometry_t);
+  else if(req.op == FSD_STATS) want = sizeof(fs_stats_t);
+  else if(req.op == FSD_STAT) want = sizeof(fs_stat_t);
+  if(want < 0) want = 0;
+
+  fsd_reply_t rep = { -1, E_GENERAL, 0 };
+  int fd = req.arg[0], isfd = 0, i = -1;
+  switch(req.op) {
+  case FSD_READ: case FSD_WRITE: case FSD_PREAD: case FSD_PWRITE:
+  case FSD_SEEK: case FSD_CLOSE:
+    isfd = 1;
+  }
+  int format = (req.op == FSD_FORMAT && allow_format);
+  if(format) pthread_rwlock_wrlock(&boot_lock);
+  else pthread_rwlock_rdlock(&boot_lock);
+  if(isfd) i = client_fd(c, fd);
+  if(want > FSD_MAX_DATA || grow(&c->out, &c->outsize, want) < 0) {
+    // refused
+  } else if(req.op == FSD_FORMAT && !format) {
+    // refused (fsd wasn't started with -f)
+  } else if(isfd && i < 0) {
+    rep.err = E_BAD_FD;
+  } else if((req.op == FSD_WRITE || req.op == FSD_PWRITE) &&
+	    req.arg[1] >= 0 && req.arg[1] != req.len) {
+    // the data isn't all there
+  } else {
+    fs_geometry_t geo;
+    fs_stats_t st;
+    switch(req.op) {
+    case FSD_FORMAT:
+      rep.ret = FS_Format(diskfile, req.len == sizeof(geo) ? (fs_geometry_t*)c->in : NULL);
+      __atomic_fetch_add(&boot_gen, 1, __ATOMIC_RELAXED);
+      break;
+    case FSD_GEOMETRY:
+      FS_Geometry(&geo);
+      memcpy(c->out, &geo, sizeof(geo));
+      rep.ret = 0;
+      rep.len = sizeof(geo);
+      break;
+    case FSD_SYNC: rep.ret = FS_Sync(); break;
+    case FSD_STATS:
+      FS_Stats(&st);
+      memcpy(c->out, &st, sizeof(st));
+      rep.ret = 0;
+      rep.len = sizeof(st);
+      break;
+    case FSD_CREATE: rep.ret = File_Create(path); break;
+    case FSD_OPEN:
+      rep.ret = File_Open(path);
+      if(rep.ret >= 0 && client_open(c, rep.ret) < 0) {
+	File_Close(rep.ret);
+	rep.ret = -1;
+	osErrno = E_TOO_MANY_OPEN_FILES;
+      }
+      break;
+    case FSD_READ:
+      rep.ret = File_Read(fd, c->out, req.arg[1]);
+      if(rep.ret > 0) rep.len = rep.ret;
+      break;
+    case FSD_WRITE: rep.ret = File_Write(fd, c->in, req.arg[1]); break;
+    case FSD_PREAD:
+      rep.ret = File_PRead(fd, c->out, req.arg[1], req.arg[2]);
+      if(rep.ret > 0) rep.len = rep.ret;
+      break;
+    case FSD_PWRITE: rep.ret = File_PWrite(fd, c->in, req.arg[1], req.arg[2]); break;
+    case FSD_SEEK: rep.ret = File_Seek(fd, req.arg[1]); break;
+    case FSD_CLOSE:
+      rep.ret = File_Close(fd);
+      c->fds[i] = c->fds[--c->nfds];
+      break;
+    case FSD_UNLINK: rep.ret = File_Unlink(path); break;
+    case FSD_MKDIR: rep.ret = Dir_Create(path); break;
+    case FSD_RMDIR: rep.ret = Dir_Unlink(path); break;
+    case FSD_DIRSIZE: rep.ret = Dir_Size(path); break;
+    case FSD_STAT:
+      rep.ret = File_Stat(path, (fs_stat_t*)c->out);
+      if(rep.ret == 0) rep.len = sizeof(fs_stat_t);
+      break;
+    case FSD_DIRREAD:
+      rep.ret = Dir_Read(path, c->out, req.arg[0]);
+      if(rep.ret > 0) rep.len = rep.ret*FSD_DIRENT_SIZE;
+      break;
+    case FSD_TXNBEGIN:
+      rep.ret = FS_TxnBegin();
+      if(rep.ret == 0) c->txns++;
+      break;
+    case FSD_TXNCOMMIT:
+      if(c->txns == 0) {
+	osErrno = E_GENERAL;
+	break;
+      }
+      c->txns--;
+      rep.ret = FS_TxnCommit();
+      break;
+    default:
+      osErrno = E_GENERAL;
+    }
+    rep.err = rep.ret < 0 ? osErrno : 0;
+  }
+  pthread_rwlock_unlock(&boot_lock);
+
+  if(sock_io(c->sock, &rep, sizeof(rep), 1) < 0 ||
+     sock_io(c->sock, c->out, rep.len, 1) < 0) return -1;
+  return 0;
+}
+
+// serve a connection until it goes
+static void* client_thread(void* arg)
+{
+  client_t c;
+  memset(&c, 0, sizeof(c));
+  c.sock = (int)(long)arg;
+  c.gen = __atomic_load_n(&boot_gen, __ATOMIC_RELAXED);
+  while(serve(&c) == 0);
+  pthread_rwlock_rdlock(&boot_lock);
+  client_fd(&c, -1); // forget the fds of an older file system
+  for(int i=0; i<c.nfds; i++) File_Close(c.fds[i]);
+  while(c.txns-- > 0) FS_TxnCommit();
+  pthread_rwlock_unlock(&boot_lock);
+  close(c.sock);
+  free(c.fds);
+  free(c.in);
+  free(c.out);
+  return NULL;
+}
+
+// wait to be stopped, then sync the file system and go
+static void* stop_thread(void* arg)
+{
+  sigset_t* sigs = (sigset_t*)arg;
+  int sig;
+  sigwait(sigs, &sig);
+  int status = 0;
+  if(FS_Sync() < 0) {
+    printf("ERROR: can't sync disk '%s'\n", diskfile);
+    status = -4;
+  }
+  unlink(sockname);
+  exit(status);
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc > 1 && !strcmp(argv[1], "-f")) { allow_format = 1; argv++; argc--; }
+  if(argc > 3) usage(argv[0]);
+  diskfile = argc >= 2 ? argv[1] : "default-disk";
+  sockname = argc == 3 ? argv[2] : FSD_SOCKET;
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(strlen(sockname) >= sizeof(addr.sun_path)) {
+    printf("ERROR: socket name '%s' is too long\n", sockname);
+    return -1;
+  }
+  strcpy(addr.sun_path, sockname);
+
+  if(FS_Boot(diskfile) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", diskfile);
+    return -1;
+  }
+
+  // a socket left behind by an fsd that's gone is taken over
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(sock >= 0 && connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+    printf("ERROR: '%s' is being served already\n", sockname);
+    return -2;
+  }
+  if(sock >= 0) close(sock);
+  unlink(sockname);
+  sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(sock < 0 || bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+     listen(sock, 64) < 0) {
+    printf("ERROR: can't listen on socket '%s'\n", sockname);
+    return -2;
+  }
+
+  // the signals that stop fsd are only taken by the thread waiting for
+  // them (the others inherit the mask)
+  static sigset_t sigs;
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGINT);
+  sigaddset(&sigs, SIGTERM);
+  sigaddset(&sigs, SIGHUP);
+  pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+  pthread_t t;
+  if(pthread_create(&t, NULL, stop_thread, &sigs) != 0) {
+    printf("ERROR: can't start\n");
+    return -3;
+  }
+
+  printf("serving '%s' on '%s'\n", diskfile, sockname);
+  fflush(stdout);
+  for(;;) {
+    int client = accept(sock, NULL, NULL);
+    if(client < 0) {
+      if(errno == EINTR || errno == ECONNABORTED) continue;
+      printf("ERROR: can't accept connections on '%s'\n", sockname);
+      break;
+    }
+    if(pthread_create(&t, NULL, client_thread, (void*)(long)client) != 0) {
+      close(client);
+      continue;
+    }
+    pthread_detach(t);
+  }
+  FS_Sync();
+  unlink(sockname);
+  return -3;
+}
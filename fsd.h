@@ -0,0 +1,73 @@
+//
+// fsd.h
+//
+// The protocol spoken between fsd, which boots a disk image once and
+// serves the LibFS API over a UNIX-domain socket, and LibFS booted from
+// that socket (see FS_Boot). Each call is a request followed by its
+// reply, on a stream socket, in the byte order of the host:
+//
+//   request: fsd_request_t, then 'len' bytes (a path with its '\0',
+//            the data written, or a geometry)
+//   reply:   fsd_reply_t, then 'len' bytes (the data read, the
+//            entries of a directory, or a geometry, stats or stat)
+//
+// 'ret' is what the call returned, and 'err' the osErrno it left if it
+// failed. A file descriptor belongs to the connection it was opened on,
+// and is closed when the connection goes.
+//
+
+#ifndef __fsd_h__
+#define __fsd_h__
+
+#include <stdint.h>
+
+// the socket fsd listens on unless told otherwise
+#define FSD_SOCKET "fsd.sock"
+
+// the calls
+enum {
+  FSD_FORMAT,   // len = a geometry, or 0 for the default one (refused,
+                // with E_GENERAL, unless fsd was started with -f)
+  FSD_GEOMETRY, // reply = a geometry
+  FSD_SYNC,
+  FSD_STATS,    // reply = the stats
+  FSD_CREATE,   // len = path
+  FSD_OPEN,     // len = path
+  FSD_READ,     // arg = fd, size; reply = the data
+  FSD_WRITE,    // arg = fd, size; len = the data
+  FSD_PREAD,    // arg = fd, size, offset; reply = the data
+  FSD_PWRITE,   // arg = fd, size, offset; len = the data
+  FSD_SEEK,     // arg = fd, offset
+  FSD_CLOSE,    // arg = fd
+  FSD_UNLINK,   // len = path
+  FSD_MKDIR,    // len = path
+  FSD_RMDIR,    // len = path
+  FSD_DIRSIZE,  // len = path
+  FSD_DIRREAD,  // arg = size; len = path; reply = the entries
+  FSD_TXNBEGIN,
+  FSD_TXNCOMMIT,
+  FSD_STAT,     // len = path; reply = what File_Stat reports
+  FSD_NCALLS
+};
+
+// the most bytes a request or a reply carries; bigger reads and writes
+// are refused (E_GENERAL)
+#define FSD_MAX_DATA (16<<20)
+
+// the size of each entry returned by Dir_Read (a 16-byte name and the
+// inode)
+#define FSD_DIRENT_SIZE 20
+
+typedef struct _fsd_request {
+  int32_t op;     // one of the calls above
+  int32_t arg[3]; // its integer arguments
+  int32_t len;    // bytes following
+} fsd_request_t;
+
+typedef struct _fsd_reply {
+  int32_t ret; // what the call returned
+  int32_t err; // osErrno if it failed
+  int32_t len; // bytes following
+} fsd_reply_t;
+
+#endif /* __fsd_h__ */
@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "LibFS.h"
+
+// writes to the same bytes of a file through several fds have to land
+// in the order they were made, however each of them is buffered
+
+void usage(char *prog)
+{
+  printf("USAGE: %s <disk_image_file>\n", prog);
+  exit(1);
+}
+
+static char* fn = "/multi-fd-file";
+static int errors;
+
+// open the file afresh (empty) on two fds
+static void open_two(int* a, int* b)
+{
+  File_Unlink(fn);
+  if(File_Create(fn) < 0 || (*a = File_Open(fn)) < 0 || (*b = File_Open(fn)) < 0) {
+    printf("ERROR: can't create and open file '%s'\n", fn);
+    exit(-1);
+  }
+}
+
+// check that the file starts with 'len' bytes of 'c', reading it
+// through a third fd
+static void check(char* test, char c, int len)
+{
+  static char buf[100000];
+  int fd = File_Open(fn);
+  int n = fd < 0 ? -1 : File_Read(fd, buf, len);
+  if(fd >= 0) File_Close(fd);
+  int i = 0;
+  while(i < n && buf[i] == c) i++;
+  if(n != len || i != len) {
+    printf("ERROR: %s: expected %d bytes of '%c', got %d (%d matching)\n", test, len, c, n, i);
+    errors++;
+  } else printf("%s: ok\n", test);
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc != 2) usage(argv[0]);
+
+  if(FS_Boot(argv[1]) < 0) {
+    printf("ERROR: can't boot file system from file '%s'\n", argv[1]);
+    return -1;
+  } else printf("file system booted from file '%s'\n", argv[1]);
+
+  int a, b;
+  static char big[100000];
+
+  // two small writes, both buffered
+  open_two(&a, &b);
+  File_Write(a, "AAAA", 4);
+  File_Write(b, "BBBB", 4);
+  check("small write after small write", 'B', 4);
+  File_Close(a);
+  File_Close(b);
+
+  // a small write buffered, then a big one that isn't
+  open_two(&a, &b);
+  File_Write(a, "AAAA", 4);
+  memset(big, 'C', sizeof(big));
+  File_Write(b, big, sizeof(big));
+  File_Close(a);
+  File_Close(b);
+  check("big write after small write", 'C', sizeof(big));
+
+  // the first fd writes again over the second one's write
+  open_two(&a, &b);
+  File_Write(a, "AAAA", 4);
+  File_Write(b, "BBBB", 4);
+  File_Seek(a, 0);
+  File_Write(a, "DDDD", 4);
+  File_Close(b);
+  File_Close(a);
+  check("small write after small writes", 'D', 4);
+
+  File_Unlink(fn);
+  if(FS_Sync() < 0) {
+    printf("ERROR: can't sync file system to file '%s'\n", argv[1]);
+    return -1;
+  }
+  if(errors) return -1;
+  printf("all writes landed in order\n");
+  return 0;
+}
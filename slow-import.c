@@ -7,7 +7,7 @@
 
 void usage(char *prog)
 {
-  printf("USAGE: %s [disk] file from_unix_file\n", prog);
+  printf("USAGE: %s [disk|socket] file from_unix_file\n(a socket is that of fsd; with neither, $FSD_SOCKET or else default-disk)\n", prog);
   exit(1);
 }
 
@@ -16,7 +16,7 @@ int main(int argc, char *argv[])
   char *diskfile, *path, *fname;
   if(argc != 3 && argc != 4) usage(argv[0]);
   if(argc == 4) { diskfile = argv[1]; path = argv[2]; fname = argv[3]; }
-  else { diskfile = "default-disk"; path = argv[1]; fname = argv[2]; }
+  else { diskfile = getenv("FSD_SOCKET") ? getenv("FSD_SOCKET") : "default-disk"; path = argv[1]; fname = argv[2]; }
 
   if(FS_Boot(diskfile) < 0) {
     printf("ERROR: can't boot file system from file '%s'\n", diskfile);
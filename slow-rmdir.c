@@ -5,7 +5,7 @@
 
 void usage(char *prog)
 {
-  printf("USAGE: %s [disk] dir\n", prog);
+  printf("USAGE: %s [disk|socket] dir\n(a socket is that of fsd; with neither, $FSD_SOCKET or else default-disk)\n", prog);
   exit(1);
 }
 
@@ -14,7 +14,7 @@ int main(int argc, char *argv[])
   char *diskfile, *path;
   if(argc != 2 && argc != 3) usage(argv[0]);
   if(argc == 3) { diskfile = argv[1]; path = argv[2]; }
-  else { diskfile = "default-disk"; path = argv[1]; }
+  else { diskfile = getenv("FSD_SOCKET") ? getenv("FSD_SOCKET") : "default-disk"; path = argv[1]; }
 
   if(FS_Boot(diskfile) < 0) {
     printf("ERROR: can't boot file system from file '%s'\n", diskfile);